@@ -0,0 +1,359 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fnmatch.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "fs/operations.h"
+#include "lockprof.h"
+#include "find.h"
+
+/*
+ * A page of a directory left to read: its path below the root of the
+ * search and the cursor where the page starts. Directories are kept by
+ * path, not by i-number, because the i-nodes of a snapshot change when
+ * the directories it shares are unshared.
+ */
+typedef struct find_dir {
+	char path[MAX_FILE_NAME];
+	int cursor;
+} find_dir;
+
+typedef struct find_search {
+	/* raiz sem barras a mais ("" para a raiz do servidor), para os caminhos dos resultados */
+	char root[MAX_FILE_NAME];
+	int root_length;
+	char *pattern;
+	int limit;
+	/* snapshot da raiz, ou FAIL se nao houve i-node para ela */
+	int snapshot;
+
+	struct sockaddr_un *client;
+	char *prefix;
+
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+	find_dir *dirs;
+	int count, capacity;
+	/* threads a ler uma pagina, e threads que se juntaram a procura */
+	int active;
+	pthread_t helpers[FIND_MAX_THREADS];
+	int helper_count;
+
+	int matches;
+	int stopped;
+	int error;
+
+	char batch[FIND_BATCH_SIZE];
+	int batch_length, batch_count, batches;
+	struct timespec last_sent;
+} find_search;
+
+static int server_sockfd;
+static find_lock_fn server_read_lock, server_write_lock, server_unlock;
+static int find_site;
+
+
+static double elapsed_ms(struct timespec *since) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - since->tv_sec) * 1e3 + (now.tv_nsec - since->tv_nsec) / 1e6;
+}
+
+
+/*
+ * Finds a directory of the search from its path below the root. Without a
+ * snapshot, the path is followed from the root of the server.
+ * Must be called with the server lock held.
+ * Returns: the i-number of the directory or FAIL
+ */
+static int resolve(find_search *search, const char *relative) {
+	char full[2 * MAX_FILE_NAME];
+	int inumber = search->snapshot;
+	union Data data;
+	type nType;
+	fs_path path;
+
+	if (inumber == FAIL) {
+		snprintf(full, sizeof(full), "%s/%s", search->root, relative);
+		if (path_parse(&path, full) == FAIL)
+			return FAIL;
+		inumber = lookup_parsed(&path, path.depth, NULL);
+	}
+	else {
+		if (path_parse(&path, relative) == FAIL)
+			return FAIL;
+		for (int i = 0; i < path.depth && inumber != FAIL; i++) {
+			if (inode_get(inumber, &nType, &data) == FAIL || nType != T_DIRECTORY)
+				return FAIL;
+			inumber = lookup_sub_component(PATH_NAME(&path, i), path.components[i].length,
+			                               path.components[i].hash, data.directory);
+		}
+	}
+	if (inumber == FAIL || inode_get(inumber, &nType, NULL) == FAIL || nType != T_DIRECTORY)
+		return FAIL;
+	return inumber;
+}
+
+
+/*
+ * Sends the batch of matches found so far, even if empty, waiting up to
+ * FIND_SEND_TIMEOUT_MS for room in the socket of the client. If there is
+ * none the search is given up. Must be called with the lock of the search
+ * held.
+ */
+static void send_batch(find_search *search) {
+	char message[FIND_BATCH_SIZE + 64];
+	struct timespec start;
+	int c = snprintf(message, sizeof(message), "%s+ %d %d%s", search->prefix, search->batches,
+	                 search->batch_count, search->batch);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (sendto(server_sockfd, message, c + 1, MSG_DONTWAIT, (struct sockaddr *) search->client,
+	              sizeof(struct sockaddr_un)) < 0) {
+		if ((errno != EAGAIN && errno != EWOULDBLOCK) || elapsed_ms(&start) >= FIND_SEND_TIMEOUT_MS) {
+			search->error = TECNICOFS_ERROR_CONNECTION_ERROR;
+			search->stopped = 1;
+			return;
+		}
+		usleep(1000);
+	}
+	search->batches++;
+	search->batch_length = search->batch_count = 0;
+	search->batch[0] = '\0';
+	clock_gettime(CLOCK_MONOTONIC, &search->last_sent);
+}
+
+
+/*
+ * Adds a match to the batch, sending the batch first if it has no room.
+ * Must be called with the lock of the search held.
+ */
+static void add_match(find_search *search, const char *relative, type nodeType) {
+	char line[2 * MAX_FILE_NAME + 8];
+	int c = snprintf(line, sizeof(line), " %s/%s %c", search->root, relative,
+	                 nodeType == T_DIRECTORY ? 'd' : 'f');
+
+	if (search->batch_length + c >= FIND_BATCH_SIZE) {
+		send_batch(search);
+		if (search->stopped)
+			return;
+	}
+	memcpy(search->batch + search->batch_length, line, c + 1);
+	search->batch_length += c;
+	search->batch_count++;
+	if (++search->matches == search->limit)
+		search->stopped = 1;
+}
+
+
+/*
+ * Adds a page of a directory to read. Must be called with the lock of the
+ * search held.
+ * Returns: SUCCESS or FAIL
+ */
+static int add_dir(find_search *search, const char *relative, int cursor) {
+	if (search->count == search->capacity) {
+		int capacity = search->capacity ? search->capacity * 2 : 64;
+		find_dir *dirs = realloc(search->dirs, capacity * sizeof(find_dir));
+
+		if (dirs == NULL)
+			return FAIL;
+		search->dirs = dirs;
+		search->capacity = capacity;
+	}
+	strcpy(search->dirs[search->count].path, relative);
+	search->dirs[search->count].cursor = cursor;
+	search->count++;
+	return SUCCESS;
+}
+
+
+/*
+ * Waits for a page to read, while other threads may still find more.
+ * Returns: 1 with the page in dir, or 0 once the search is over
+ */
+static int take_dir(find_search *search, find_dir *dir) {
+	int found;
+
+	lockprof_mutex_lock(&search->lock, find_site);
+	while (search->count == 0 && search->active > 0 && !search->stopped)
+		lockprof_cond_wait(&search->changed, &search->lock, find_site);
+	found = search->count > 0 && !search->stopped;
+	if (found) {
+		*dir = search->dirs[--search->count];
+		search->active++;
+	}
+	else
+		pthread_cond_broadcast(&search->changed);
+	lockprof_mutex_unlock(&search->lock);
+	return found;
+}
+
+
+static void *search_helper(void *arg);
+
+/*
+ * Takes the matches and subdirectories of a page that was read, and gets
+ * another thread to help if many directories wait to be read.
+ */
+static void page_done(find_search *search, find_dir *dir, DirListEntry *entries, int count, int next_cursor) {
+	char relative[2 * MAX_FILE_NAME];
+
+	lockprof_mutex_lock(&search->lock, find_site);
+	if (next_cursor != TECNICOFS_READDIR_END && add_dir(search, dir->path, next_cursor) == FAIL)
+		search->error = TECNICOFS_ERROR_OTHER;
+
+	for (int i = 0; i < count && !search->stopped; i++) {
+		int length = snprintf(relative, sizeof(relative), "%s%s%s", dir->path,
+		                      dir->path[0] != '\0' ? "/" : "", entries[i].name);
+
+		/* os caminhos que nao cabem num pedido ficam de fora, como no print */
+		if (search->root_length + 1 + length >= MAX_FILE_NAME)
+			continue;
+		if (fnmatch(search->pattern, entries[i].name, 0) == 0)
+			add_match(search, relative, entries[i].nodeType);
+		if (entries[i].nodeType == T_DIRECTORY && add_dir(search, relative, TECNICOFS_READDIR_START) == FAIL)
+			search->error = TECNICOFS_ERROR_OTHER;
+	}
+	if (search->error)
+		search->stopped = 1;
+	if (!search->stopped && elapsed_ms(&search->last_sent) >= FIND_FLUSH_MS)
+		send_batch(search);
+
+	if (!search->stopped && search->count >= FIND_SPLIT_DIRS && search->helper_count + 1 < FIND_MAX_THREADS &&
+	    pthread_create(&search->helpers[search->helper_count], NULL, search_helper, search) == 0)
+		search->helper_count++;
+	search->active--;
+	pthread_cond_broadcast(&search->changed);
+	lockprof_mutex_unlock(&search->lock);
+}
+
+
+/*
+ * Reads pages of the directories of a search until there are none left,
+ * holding the server lock only while it copies each page.
+ */
+static void *search_dirs(void *arg) {
+	find_search *search = arg;
+	DirListEntry entries[FIND_PAGE_SIZE];
+	find_dir dir;
+
+	while (take_dir(search, &dir)) {
+		int inumber, count = 0, next_cursor = TECNICOFS_READDIR_END;
+
+		server_read_lock();
+		if ((inumber = resolve(search, dir.path)) != FAIL)
+			count = dir_read_entries(inumber, dir.cursor, FIND_PAGE_SIZE, entries, &next_cursor);
+		server_unlock();
+		/* uma diretoria apagada entretanto (so sem snapshot) fica por ler */
+		if (count < 0) {
+			count = 0;
+			next_cursor = TECNICOFS_READDIR_END;
+		}
+		page_done(search, &dir, entries, count, next_cursor);
+	}
+	return NULL;
+}
+
+
+/*
+ * A helper thread of a search, which leaves its lock profile to the next
+ * thread when it ends.
+ */
+static void *search_helper(void *arg) {
+	search_dirs(arg);
+	lockprof_thread_exit();
+	return NULL;
+}
+
+
+/*
+ * Sets how a search sends the matches and takes the server lock.
+ * Input:
+ *  - sockfd: socket of the server
+ *  - read_lock, write_lock, unlock: take and release the server lock
+ */
+void find_init(int sockfd, find_lock_fn read_lock, find_lock_fn write_lock, find_lock_fn unlock) {
+	server_sockfd = sockfd;
+	server_read_lock = read_lock;
+	server_write_lock = write_lock;
+	server_unlock = unlock;
+	find_site = lockprof_site("find");
+}
+
+
+/*
+ * Searches a subtree for the entries whose name matches a pattern, sending
+ * the matches to the client in batches, each prefixed like the reply of
+ * the request. The snapshot of the subtree takes an i-node, and, like any
+ * snapshot, makes a change to a directory it shares during the search
+ * copy the table of that directory. Without a free i-node for it, the
+ * subtree is read as each page is when it is read.
+ * Input:
+ *  - client: where the batches go
+ *  - prefix: prefix of the reply to the request ("#<seq> "), or ""
+ *  - root: path of the directory searched, which is not a match itself
+ *  - pattern: pattern of fnmatch(3) for the names of the entries
+ *  - limit: most matches to find, or 0 for all of them
+ *  - batches: set to the number of batches sent
+ * Returns: number of matches, TECNICOFS_ERROR_FILE_NOT_FOUND if root is
+ * not a directory, or another error if the search was given up
+ */
+int find_run(struct sockaddr_un *client, char *prefix, char *root, char *pattern, int limit, int *batches) {
+	find_search *search;
+	fs_path path;
+	int inumber, res;
+
+	*batches = 0;
+	if (path_parse(&path, root) == FAIL)
+		return TECNICOFS_ERROR_FILE_NOT_FOUND;
+	if ((search = calloc(1, sizeof(find_search))) == NULL)
+		return TECNICOFS_ERROR_OTHER;
+	for (int i = 0; i < path.depth; i++)
+		search->root_length += sprintf(search->root + search->root_length, "/%.*s",
+		                               path.components[i].length, PATH_NAME(&path, i));
+	search->pattern = pattern;
+	search->limit = limit > 0 ? limit : -1;
+	search->client = client;
+	search->prefix = prefix;
+	pthread_mutex_init(&search->lock, NULL);
+	pthread_cond_init(&search->changed, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &search->last_sent);
+	search->snapshot = FAIL;
+
+	server_write_lock();
+	inumber = resolve(search, "");
+	if (inumber != FAIL)
+		search->snapshot = inode_clone(inumber, 1);
+	server_unlock();
+
+	if (inumber == FAIL)
+		res = TECNICOFS_ERROR_FILE_NOT_FOUND;
+	else {
+		add_dir(search, "", TECNICOFS_READDIR_START);
+		search_dirs(search);
+		for (int i = 0; i < search->helper_count; i++)
+			pthread_join(search->helpers[i], NULL);
+		if (!search->error && search->batch_count > 0)
+			send_batch(search);
+		res = search->error ? search->error : search->matches;
+	}
+
+	if (search->snapshot != FAIL) {
+		server_write_lock();
+		inode_delete(search->snapshot);
+		server_unlock();
+	}
+	*batches = search->batches;
+	pthread_mutex_destroy(&search->lock);
+	pthread_cond_destroy(&search->changed);
+	free(search->dirs);
+	free(search);
+	return res;
+}
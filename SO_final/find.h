@@ -0,0 +1,44 @@
+#ifndef FIND_H
+#define FIND_H
+
+#include <sys/un.h>
+
+/*
+ * Search of a subtree for the entries whose name matches a pattern
+ * (fnmatch(3)). The subtree is searched in a snapshot taken when the
+ * search starts, so the search sees it as it was then while other
+ * requests go on changing it. The search only holds the server lock, for
+ * reading, while it reads a page of a directory. Wide subtrees are
+ * searched by up to FIND_MAX_THREADS threads at once. The matches are
+ * sent to the client as they are found, in batches ("+ <batch> <count>"
+ * and "<path> <f|d>" per match), and the search stops once it found as
+ * many as it was asked for. Must be called without the server lock held:
+ * it takes the lock through the functions given to find_init.
+ */
+
+#define FIND_MAX_THREADS 4
+
+/* Directories waiting to be read for which another thread joins a search */
+#define FIND_SPLIT_DIRS 8
+
+/* Entries read at a time while holding the server lock */
+#define FIND_PAGE_SIZE 64
+
+/* Bytes of a batch of matches, which the client must be able to receive */
+#define FIND_BATCH_SIZE 4096
+
+/*
+ * A batch is sent at least this often, even if it is empty, so the client
+ * knows the search goes on and does not send the request again
+ */
+#define FIND_FLUSH_MS 20
+
+/* How long a batch waits for room in the socket of the client */
+#define FIND_SEND_TIMEOUT_MS 1000
+
+typedef void (*find_lock_fn)();
+
+void find_init(int sockfd, find_lock_fn read_lock, find_lock_fn write_lock, find_lock_fn unlock);
+int find_run(struct sockaddr_un *client, char *prefix, char *root, char *pattern, int limit, int *batches);
+
+#endif /* FIND_H */
@@ -0,0 +1,66 @@
+#include "filter.h"
+
+static int filter_enabled = 1;
+
+
+/*
+ * Spreads the bits of a name_hash, whose low bits barely change between
+ * names that only differ in the high bits of a character.
+ */
+static uint32_t filter_mix(uint32_t hash) {
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6bu;
+	hash ^= hash >> 13;
+	hash *= 0xc2b2ae35u;
+	hash ^= hash >> 16;
+	return hash;
+}
+
+
+/*
+ * Sets the bits of a name in the filter of a directory.
+ * Input:
+ *  - filter: FILTER_WORDS(capacity) words
+ *  - capacity: slots of the directory
+ *  - hash: name_hash of the name
+ */
+void filter_add(uint64_t *filter, int capacity, uint32_t hash) {
+	uint32_t mask = capacity * FILTER_BITS_PER_SLOT - 1;
+	uint32_t bit = filter_mix(hash);
+	uint32_t step = (bit >> 16 | bit << 16) | 1;
+
+	for (int i = 0; i < FILTER_HASHES; i++, bit += step)
+		filter[(bit & mask) / 64] |= 1ULL << (bit % 64);
+}
+
+
+/*
+ * Tells if a name may be in a directory, given its filter.
+ * Input:
+ *  - filter: FILTER_WORDS(capacity) words
+ *  - capacity: slots of the directory
+ *  - hash: name_hash of the name
+ * Returns: 0 if the name is not in the directory, 1 if it may be
+ */
+int filter_may_contain(const uint64_t *filter, int capacity, uint32_t hash) {
+	uint32_t mask = capacity * FILTER_BITS_PER_SLOT - 1;
+	uint32_t bit = filter_mix(hash);
+	uint32_t step = (bit >> 16 | bit << 16) | 1;
+
+	if (!filter_enabled)
+		return 1;
+	for (int i = 0; i < FILTER_HASHES; i++, bit += step) {
+		if (!(filter[(bit & mask) / 64] & 1ULL << (bit % 64)))
+			return 0;
+	}
+	return 1;
+}
+
+
+/*
+ * Turns the filters on or off for lookups; they are kept up to date
+ * either way.
+ */
+void filter_set_enabled(int enabled) {
+	filter_enabled = enabled;
+}
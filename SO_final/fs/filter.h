@@ -0,0 +1,33 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <stdint.h>
+
+/*
+ * Directories with at least FILTER_MIN_SLOTS slots also keep a Bloom
+ * filter of the hashes of the names of their entries, with
+ * FILTER_BITS_PER_SLOT bits per slot and FILTER_HASHES bits set per name,
+ * so most lookups of a name that is not there end without comparing any
+ * tags. The bits of a removed entry stay set until the filter is rebuilt
+ * from the entries, see dir_reset_entry. Filters can be turned off to
+ * compare lookups with and without them.
+ */
+#define FILTER_MIN_SLOTS 128
+#define FILTER_BITS_PER_SLOT 8
+#define FILTER_HASHES 3
+
+/*
+ * Removed names a filter keeps before it is rebuilt: an eighth of the
+ * entries, and at least a thirty-second of the slots, so a rebuild costs
+ * no more than 32 slots per removal
+ */
+#define FILTER_MAX_STALE(count, capacity) ((count) / 8 + (capacity) / 32)
+
+/* Words of the filter of a directory with capacity slots, a power of two */
+#define FILTER_WORDS(capacity) ((capacity) * FILTER_BITS_PER_SLOT / 64)
+
+void filter_add(uint64_t *filter, int capacity, uint32_t hash);
+int filter_may_contain(const uint64_t *filter, int capacity, uint32_t hash);
+void filter_set_enabled(int enabled);
+
+#endif /* FILTER_H */
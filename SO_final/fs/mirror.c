@@ -0,0 +1,336 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "state.h"
+#include "path.h"
+#include "mirror.h"
+#include "../tecnicofs-mirror.h"
+
+static mirror_header *header;
+static uint32_t *counters;
+static mirror_entry *slots;
+
+/* Slots of the entries of each directory, plus one, to clear it quickly */
+static int dir_first[INODE_TABLE_SIZE];
+static int slot_next[MIRROR_ENTRIES];
+static int slot_prev[MIRROR_ENTRIES];
+
+/* Entries in the table, and slots that are not empty (entries or deleted) */
+static int live, filled;
+/* Changes ignored since the mirror went out of date */
+static int stale_changes;
+
+
+/*
+ * A writer makes a counter odd before it changes what the counter covers
+ * and even again after.
+ */
+static void write_begin(uint32_t *seq) {
+	__atomic_store_n(seq, *seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+
+static void write_end(uint32_t *seq) {
+	__atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Tells if the mirror is kept up to date. While it is not, every
+ * MIRROR_REBUILD_INTERVAL changes it is rebuilt, in case it fits again.
+ */
+static int mirror_usable() {
+	if (header == NULL)
+		return 0;
+	if (header->valid)
+		return 1;
+	if (++stale_changes >= MIRROR_REBUILD_INTERVAL)
+		mirror_rebuild();
+	return 0;
+}
+
+
+/*
+ * Finds the slot of an entry.
+ * Input:
+ *  - free_slot: set to the first slot where the entry could be added
+ * Returns: the slot, or FAIL if there is no such entry
+ */
+static int find_slot(int parent, const char *name, int len, uint32_t hash, int *free_slot) {
+	unsigned int start = (hash ^ parent * MIRROR_HASH_MULTIPLIER) % MIRROR_ENTRIES;
+
+	*free_slot = FAIL;
+	for (int i = 0; i < MIRROR_ENTRIES; i++) {
+		int slot = (start + i) % MIRROR_ENTRIES;
+		mirror_entry *entry = &slots[slot];
+
+		if (entry->parent == MIRROR_EMPTY || entry->parent == MIRROR_DELETED) {
+			if (*free_slot == FAIL)
+				*free_slot = slot;
+			if (entry->parent == MIRROR_EMPTY)
+				return FAIL;
+		}
+		else if (entry->parent == parent && entry->hash == hash && entry->length == len &&
+		         memcmp(entry->name, name, len) == 0)
+			return slot;
+	}
+	return FAIL;
+}
+
+
+/*
+ * Adds an entry, or changes its i-number if it is already there. The
+ * parent is written last, so a reader never takes a slot being written
+ * for an entry of another directory.
+ * Returns: SUCCESS, or FAIL if the table is too full
+ */
+static int insert_entry(int parent, const char *name, int len, uint32_t hash, int inumber) {
+	int free_slot, slot = find_slot(parent, name, len, hash, &free_slot);
+	mirror_entry *entry;
+
+	if (slot != FAIL) {
+		__atomic_store_n(&slots[slot].inumber, inumber, __ATOMIC_RELAXED);
+		return SUCCESS;
+	}
+	if (free_slot == FAIL || len >= MAX_FILE_NAME)
+		return FAIL;
+	if (slots[free_slot].parent == MIRROR_EMPTY) {
+		/* os slots apagados so voltam a estar vazios quando a tabela e refeita */
+		if (filled >= MIRROR_ENTRIES / 4 * 3)
+			return FAIL;
+		filled++;
+	}
+
+	entry = &slots[free_slot];
+	entry->inumber = inumber;
+	entry->hash = hash;
+	entry->length = len;
+	memcpy(entry->name, name, len);
+	entry->name[len] = '\0';
+	__atomic_store_n(&entry->parent, parent, __ATOMIC_RELEASE);
+
+	slot_prev[free_slot] = 0;
+	slot_next[free_slot] = dir_first[parent];
+	if (dir_first[parent] != 0)
+		slot_prev[dir_first[parent] - 1] = free_slot + 1;
+	dir_first[parent] = free_slot + 1;
+	live++;
+	return SUCCESS;
+}
+
+
+static void erase_entry(int slot) {
+	int parent = slots[slot].parent;
+
+	__atomic_store_n(&slots[slot].parent, MIRROR_DELETED, __ATOMIC_RELEASE);
+	if (slot_prev[slot] != 0)
+		slot_next[slot_prev[slot] - 1] = slot_next[slot];
+	else
+		dir_first[parent] = slot_next[slot];
+	if (slot_next[slot] != 0)
+		slot_prev[slot_next[slot] - 1] = slot_prev[slot];
+	live--;
+}
+
+
+/*
+ * Adds every entry a directory has now.
+ * Returns: SUCCESS, or FAIL if the table is too full
+ */
+static int insert_directory(int parent) {
+	DirListEntry entries[64];
+	int cursor = TECNICOFS_READDIR_START;
+
+	while (cursor != TECNICOFS_READDIR_END) {
+		int count = dir_read_entries(parent, cursor, 64, entries, &cursor);
+
+		if (count == FAIL)
+			return FAIL;
+		for (int i = 0; i < count; i++) {
+			int len = strlen(entries[i].name);
+			if (insert_entry(parent, entries[i].name, len, name_hash(entries[i].name, len),
+			                 entries[i].inumber) == FAIL)
+				return FAIL;
+		}
+	}
+	return SUCCESS;
+}
+
+
+/*
+ * Creates the mirror of the namespace, "<server_path>.map", with every
+ * entry the namespace has now. It is written under another name and then
+ * renamed, so a client never maps a file that is not ready.
+ * Returns: SUCCESS or FAIL
+ */
+int mirror_open(char *server_path) {
+	char path[PATH_MAX], tmp_path[PATH_MAX];
+	size_t size = MIRROR_SIZE(INODE_TABLE_SIZE, MIRROR_ENTRIES);
+	void *base;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s%s", server_path, MIRROR_SUFFIX);
+	snprintf(tmp_path, sizeof(tmp_path), "%s%s.tmp", server_path, MIRROR_SUFFIX);
+	unlink(tmp_path);
+	if ((fd = open(tmp_path, O_RDWR | O_CREAT | O_EXCL, 0644)) < 0)
+		return FAIL;
+	if (ftruncate(fd, size) < 0 ||
+	    (base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		close(fd);
+		unlink(tmp_path);
+		return FAIL;
+	}
+	close(fd);
+
+	header = base;
+	memcpy(header->magic, MIRROR_MAGIC, sizeof(header->magic));
+	header->version = MIRROR_VERSION;
+	header->inodes = INODE_TABLE_SIZE;
+	header->entries = MIRROR_ENTRIES;
+	counters = MIRROR_COUNTERS(header);
+	slots = MIRROR_SLOTS(header);
+	mirror_rebuild();
+
+	if (rename(tmp_path, path) < 0) {
+		munmap(header, size);
+		header = NULL;
+		unlink(tmp_path);
+		return FAIL;
+	}
+	return SUCCESS;
+}
+
+
+/*
+ * Marks the mirror out of date, so clients ask the server, and stops
+ * keeping it.
+ * Input:
+ *  - server_path: path of the server socket
+ *  - remove: whether to remove the file too (not after a handoff, when
+ *    the file is already the one of the new process)
+ */
+void mirror_close(char *server_path, int remove) {
+	char path[PATH_MAX];
+
+	if (header == NULL)
+		return;
+	mirror_invalidate();
+	munmap(header, MIRROR_SIZE(INODE_TABLE_SIZE, MIRROR_ENTRIES));
+	header = NULL;
+	if (remove) {
+		snprintf(path, sizeof(path), "%s%s", server_path, MIRROR_SUFFIX);
+		unlink(path);
+	}
+}
+
+
+/*
+ * Marks the mirror out of date until the next rebuild, such as while the
+ * server is handed over to a new process.
+ */
+void mirror_invalidate() {
+	if (header == NULL)
+		return;
+	write_begin(&header->seq);
+	header->valid = 0;
+	write_end(&header->seq);
+	stale_changes = 0;
+}
+
+
+/*
+ * An entry was added to a directory.
+ */
+void mirror_add(int parent, const char *name, int len, uint32_t hash, int inumber) {
+	int res;
+
+	if (!mirror_usable())
+		return;
+	write_begin(&counters[parent]);
+	res = insert_entry(parent, name, len, hash, inumber);
+	write_end(&counters[parent]);
+	/* refazer a tabela limpa os slots apagados; se nem assim couber, fica desatualizada */
+	if (res == FAIL)
+		mirror_rebuild();
+}
+
+
+/*
+ * An entry was removed from a directory.
+ */
+void mirror_remove(int parent, const char *name, int len, uint32_t hash) {
+	int free_slot, slot;
+
+	if (!mirror_usable())
+		return;
+	if ((slot = find_slot(parent, name, len, hash, &free_slot)) == FAIL)
+		return;
+	write_begin(&counters[parent]);
+	erase_entry(slot);
+	write_end(&counters[parent]);
+}
+
+
+/*
+ * A directory has no entries any more (it was deleted).
+ */
+void mirror_clear(int parent) {
+	if (!mirror_usable())
+		return;
+	write_begin(&counters[parent]);
+	while (dir_first[parent] != 0)
+		erase_entry(dir_first[parent] - 1);
+	write_end(&counters[parent]);
+}
+
+
+/*
+ * The entries of a directory changed all at once (it got a table of its
+ * own, or is a new clone): its entries are written again.
+ */
+void mirror_sync(int parent) {
+	int res;
+
+	if (!mirror_usable())
+		return;
+	write_begin(&counters[parent]);
+	while (dir_first[parent] != 0)
+		erase_entry(dir_first[parent] - 1);
+	res = insert_directory(parent);
+	write_end(&counters[parent]);
+	if (res == FAIL)
+		mirror_rebuild();
+}
+
+
+/*
+ * Writes the whole table again from the directories, without the slots
+ * of removed entries. If the entries do not fit, the mirror is left out
+ * of date.
+ */
+void mirror_rebuild() {
+	int valid = 1;
+
+	if (header == NULL)
+		return;
+	write_begin(&header->seq);
+	for (int i = 0; i < MIRROR_ENTRIES; i++)
+		slots[i].parent = MIRROR_EMPTY;
+	memset(dir_first, 0, sizeof(dir_first));
+	live = filled = 0;
+	for (int inumber = 0; inumber < INODE_TABLE_SIZE && valid; inumber++) {
+		type nType;
+
+		if (inode_version(inumber) != 0 && inode_get(inumber, &nType, NULL) == SUCCESS &&
+		    nType == T_DIRECTORY && insert_directory(inumber) == FAIL)
+			valid = 0;
+	}
+	header->valid = valid;
+	stale_changes = 0;
+	write_end(&header->seq);
+}
@@ -0,0 +1,25 @@
+#ifndef MIRROR_H
+#define MIRROR_H
+
+#include <stdint.h>
+
+/*
+ * Server side of the namespace mirror (see tecnicofs-mirror.h): the
+ * i-node functions tell it every entry added to or removed from a
+ * directory. Until mirror_open is called, it ignores them.
+ * All functions must be called with the server lock held.
+ */
+
+/* Changes while the mirror is out of date before it tries to rebuild it */
+#define MIRROR_REBUILD_INTERVAL 1024
+
+int mirror_open(char *server_path);
+void mirror_close(char *server_path, int remove);
+void mirror_invalidate();
+void mirror_add(int parent, const char *name, int len, uint32_t hash, int inumber);
+void mirror_remove(int parent, const char *name, int len, uint32_t hash);
+void mirror_sync(int parent);
+void mirror_clear(int parent);
+void mirror_rebuild();
+
+#endif /* MIRROR_H */
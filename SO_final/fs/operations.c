@@ -1,8 +1,95 @@
 #include "operations.h"
+#include "../tecnicofs-api-constants.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 
+/* Receives the changes to directory entries, if set */
+static fs_event_handler event_handler;
+
+/* Changes held back while they may still be undone, see hold_events */
+typedef struct held_event {
+	fs_event event;
+	int dir_inumber;
+	int inumber;
+	int len;
+	char name[MAX_FILE_NAME];
+} held_event;
+
+static held_event *held;
+static int held_count, held_capacity, holding;
+
+static int add_parsed(const fs_path *path, type nodeType, int inumber);
+static int remove_parsed(const fs_path *path, int keep);
+static void publish_freed(int dir_inumber, const char *name, int len, int inumber);
+
+/*
+ * Sets the function that receives the changes to directory entries.
+ * Input:
+ *  - handler: the function, or NULL to stop publishing
+ */
+void set_event_handler(fs_event_handler handler) {
+	event_handler = handler;
+}
+
+static void publish(fs_event event, int dir_inumber, const char *name, int len, int inumber) {
+	if (event_handler == NULL)
+		return;
+
+	if (holding) {
+		if (held_count == held_capacity) {
+			int capacity = held_capacity ? held_capacity * 2 : 16;
+			held_event *events = realloc(held, sizeof(held_event) * capacity);
+			/* sem memoria, o evento segue ja em vez de se perder */
+			if (events == NULL) {
+				event_handler(event, dir_inumber, name, len, inumber);
+				return;
+			}
+			held = events;
+			held_capacity = capacity;
+		}
+		held_event *e = &held[held_count++];
+		e->event = event;
+		e->dir_inumber = dir_inumber;
+		e->inumber = inumber;
+		e->len = len;
+		memcpy(e->name, name, len);
+		return;
+	}
+	event_handler(event, dir_inumber, name, len, inumber);
+}
+
+
+/*
+ * Publishes the deletion of the nodes freed along with a deleted snapshot,
+ * which only it had, so their watches end like the one of the snapshot.
+ */
+static void publish_freed(int dir_inumber, const char *name, int len, int inumber) {
+	publish(FS_EVENT_DELETE, dir_inumber, name, len, inumber);
+}
+
+
+/*
+ * Holds back the changes published from now on, so the changes of several
+ * operations that may still be undone are only seen if they are not.
+ */
+void hold_events() {
+	holding = 1;
+}
+
+
+/*
+ * Stops holding back changes.
+ * Input:
+ *  - deliver: whether the changes held back are published or dropped
+ */
+void release_events(int deliver) {
+	holding = 0;
+	for (int i = 0; deliver && i < held_count; i++)
+		publish(held[i].event, held[i].dir_inumber, held[i].name, held[i].len, held[i].inumber);
+	held_count = 0;
+}
+
 /* Given a path, fills pointers with strings for the parent path and child
  * file name
  * Input:
@@ -45,6 +132,7 @@ void split_parent_child_from_path(char * path, char ** parent, char ** child) {
  */
 void init_fs() {
 	inode_table_init();
+	inode_set_free_handler(publish_freed);
 	
 	/* create root inode */
 	int root = inode_create(T_DIRECTORY);
@@ -61,28 +149,54 @@ void init_fs() {
  */
 void destroy_fs() {
 	inode_table_destroy();
+	free(held);
+	held = NULL;
+	held_count = held_capacity = 0;
+}
+
+
+/*
+ * Saves tecnicofs, to be loaded by another server process.
+ * Input:
+ *  - fp: pointer to output stream
+ * Returns: SUCCESS or FAIL
+ */
+int save_fs(FILE *fp) {
+	return inode_table_save(fp);
+}
+
+
+/*
+ * Initializes tecnicofs with the i-nodes saved by save_fs, instead of an
+ * empty root.
+ * Input:
+ *  - fp: pointer to input stream
+ * Returns: SUCCESS or FAIL
+ */
+int load_fs(FILE *fp) {
+	type nodeType;
+
+	inode_table_init();
+	inode_set_free_handler(publish_freed);
+	if (inode_table_load(fp) == FAIL || inode_get(FS_ROOT, &nodeType, NULL) == FAIL || nodeType != T_DIRECTORY)
+		return FAIL;
+	return SUCCESS;
 }
 
 
 /*
  * Checks if content of directory is not empty.
  * Input:
- *  - entries: entries of directory
+ *  - dir: the directory
  * Returns: SUCCESS or FAIL
  * rlock only
  */
 
-int is_dir_empty(DirEntry *dirEntries) {
-	if (dirEntries == NULL) {
+int is_dir_empty(Directory *dir) {
+	if (dir == NULL || dir->count > 0) {
 
 		return FAIL;
 	}
-	for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-		if (dirEntries[i].inumber != FREE_INODE) {
-
-			return FAIL;
-		}
-	}
 	return SUCCESS;
 }
 
@@ -91,23 +205,54 @@ int is_dir_empty(DirEntry *dirEntries) {
  * Looks for node in directory entry from name.
  * Input:
  *  - name: path of node
- *  - entries: entries of directory
+ *  - dir: the directory
  * Returns:
  *  - inumber: found node's inumber
  *  - FAIL: if not found
  */
-int lookup_sub_node(char *name, DirEntry *entries) {
+int lookup_sub_node(char *name, Directory *dir) {
+	int len = strlen(name);
+
+	return lookup_sub_component(name, len, name_hash(name, len), dir);
+}
+
+
+/*
+ * Looks for node in directory entry from a name that is not terminated,
+ * asking the filter of the directory first, if it has one, and then
+ * comparing the tags of a group of slots at once and the hashes before
+ * the names.
+ * Input:
+ *  - name: name of node
+ *  - len: length of the name
+ *  - hash: name_hash of the name
+ *  - dir: the directory
+ * Returns:
+ *  - inumber: found node's inumber
+ *  - FAIL: if not found
+ */
+int lookup_sub_component(const char *name, int len, uint32_t hash, Directory *dir) {
 	
-	if (entries == NULL) {
+	if (dir == NULL) {
 		
 		return FAIL;
 	}
-	for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-		/*teste*/
-        if (entries[i].inumber != FREE_INODE && strcmp(entries[i].name, name) == 0) {
-            
-			return entries[i].inumber;
-        }
+	/* a maioria dos nomes que nao existem fica logo pelo filtro */
+	if (dir->filter && !filter_may_contain(dir->filter, dir->capacity, hash))
+		return FAIL;
+	uint8_t tag = TAG_OF_HASH(hash);
+	for (int group = 0; group < dir->capacity; group += TAG_GROUP_SIZE) {
+		uint32_t candidates = tag_match(dir->tags + group, tag);
+
+		while (candidates) {
+			DirEntry *entry = &dir->entries[group + __builtin_ctz(candidates)];
+			if (entry->hash == hash && DIR_ENTRY_LENGTH(dir, entry) == len &&
+			    memcmp(DIR_ENTRY_NAME(dir, entry), name, len) == 0) {
+
+				return entry->inumber;
+			}
+			candidates &= candidates - 1;
+		}
 	}
 	return FAIL;
 }
@@ -122,24 +267,81 @@ int lookup_sub_node(char *name, DirEntry *entries) {
  * rwlock
  */
 int create(char *name, type nodeType){
+	fs_path path;
+
+	if (path_parse(&path, name) == FAIL) {
+		printf("failed to create %s, invalid path\n", name);
+		return FAIL;
+	}
+	return create_parsed(&path, nodeType);
+}
+
+
+/*
+ * Creates a new node given a parsed path.
+ * Input:
+ *  - path: parsed path of node
+ *  - nodeType: type of node
+ * Returns: SUCCESS or FAIL
+ * rwlock
+ */
+int create_parsed(const fs_path *path, type nodeType){
+	return add_parsed(path, nodeType, FREE_INODE);
+}
+
+
+/*
+ * Puts back a node taken out by detach_parsed, given a parsed path.
+ * Input:
+ *  - path: parsed path of node
+ *  - inumber: identifier of the node
+ * Returns: SUCCESS or FAIL
+ */
+int attach_parsed(const fs_path *path, int inumber){
+	type nodeType;
+
+	if (inode_get(inumber, &nodeType, NULL) == FAIL)
+		return FAIL;
+	return add_parsed(path, nodeType, inumber);
+}
+
+
+/*
+ * Adds a node to its parent directory given a parsed path.
+ * Input:
+ *  - path: parsed path of node
+ *  - nodeType: type of node
+ *  - inumber: identifier of the node, or FREE_INODE to create a new one
+ * Returns: SUCCESS or FAIL
+ */
+static int add_parsed(const fs_path *path, type nodeType, int inumber){
 	
 	int parent_inumber, child_inumber;
-	char *parent_name, *child_name, name_copy[MAX_FILE_NAME];
+	const path_component *child;
+	const char *child_name;
 
 	/* use for copy */
 	type pType;
 	union Data pdata;
 
+	if (path->depth == 0) {
+		printf("failed to create %.*s, root already exists\n", path->length, path->buffer);
+		return FAIL;
+	}
+	child = &path->components[path->depth - 1];
+	child_name = PATH_NAME(path, path->depth - 1);
 
-	strcpy(name_copy, name);
-
-	split_parent_child_from_path(name_copy, &parent_name, &child_name);
-
-	parent_inumber = lookup(parent_name);
+	parent_inumber = lookup_unshared(path, path->depth - 1, 1);
 
+	if (parent_inumber == TECNICOFS_ERROR_PERMISSION_DENIED) {
+		printf("failed to create %.*s, %.*s is in a snapshot\n",
+		       path->length, path->buffer, PATH_PARENT_LENGTH(path), path->buffer);
+		return parent_inumber;
+	}
 
 	if (parent_inumber == FAIL) {
-		printf("failed to create %s, invalid parent dir %s\n", name, parent_name);
+		printf("failed to create %.*s, invalid parent dir %.*s\n",
+		       path->length, path->buffer, PATH_PARENT_LENGTH(path), path->buffer);
 
 		return FAIL;
 	}
@@ -147,34 +349,36 @@ int create(char *name, type nodeType){
 	inode_get(parent_inumber, &pType, &pdata);
 	
 	if(pType != T_DIRECTORY) {
-		printf("failed to create %s, parent %s is not a dir\n",
-		        name, parent_name);		
+		printf("failed to create %.*s, parent %.*s is not a dir\n",
+		        path->length, path->buffer, PATH_PARENT_LENGTH(path), path->buffer);
 
 		return FAIL;
 	}
 
-	if (lookup_sub_node(child_name, pdata.dirEntries) != FAIL) {
-		printf("failed to create %s, already exists in dir %s\n",
-		       child_name, parent_name);
+	if (lookup_sub_component(child_name, child->length, child->hash, pdata.directory) != FAIL) {
+		printf("failed to create %.*s, already exists in dir %.*s\n",
+		       child->length, child_name, PATH_PARENT_LENGTH(path), path->buffer);
 		return FAIL;
 	}
 
 	/* create node and add entry to folder that contains new node */
-	child_inumber = inode_create(nodeType);
+	child_inumber = inumber == FREE_INODE ? inode_create(nodeType) : inumber;
 
 	if (child_inumber == FAIL) {
-		printf("failed to create %s in  %s, couldn't allocate inode\n",
-		        child_name, parent_name);
+		printf("failed to create %.*s in  %.*s, couldn't allocate inode\n",
+		        child->length, child_name, PATH_PARENT_LENGTH(path), path->buffer);
 		return FAIL;
 	}
 
-	if (dir_add_entry(parent_inumber, child_inumber, child_name) == FAIL) {
-		printf("could not add entry %s in dir %s\n",
-		       child_name, parent_name);
-
+	if (dir_add_component(parent_inumber, child_inumber, child_name, child->length, child->hash) == FAIL) {
+		printf("could not add entry %.*s in dir %.*s\n",
+		       child->length, child_name, PATH_PARENT_LENGTH(path), path->buffer);
+		if (inumber == FREE_INODE)
+			inode_delete(child_inumber);
 		return FAIL;
 	}
 
+	publish(FS_EVENT_CREATE, parent_inumber, child_name, child->length, child_inumber);
 	return SUCCESS;
 }
 
@@ -187,64 +391,127 @@ int create(char *name, type nodeType){
  * rwlock
  */
 int delete(char *name){
+	fs_path path;
+
+	if (path_parse(&path, name) == FAIL) {
+		printf("failed to delete %s, invalid path\n", name);
+		return FAIL;
+	}
+	return delete_parsed(&path);
+}
+
+
+/*
+ * Deletes a node given a parsed path.
+ * Input:
+ *  - path: parsed path of node
+ * Returns: SUCCESS or FAIL
+ * rwlock
+ */
+int delete_parsed(const fs_path *path){
+	int res = remove_parsed(path, 0);
+
+	return res < 0 ? res : SUCCESS;
+}
+
+
+/*
+ * Takes a node out of its parent directory given a parsed path, without
+ * deleting it, so it can be put back with attach_parsed or deleted later
+ * with inode_delete.
+ * Input:
+ *  - path: parsed path of node
+ * Returns: identifier of the node or FAIL
+ */
+int detach_parsed(const fs_path *path){
+	return remove_parsed(path, 1);
+}
+
+
+/*
+ * Removes a node from its parent directory given a parsed path.
+ * Input:
+ *  - path: parsed path of node
+ *  - keep: whether the i-node is kept instead of deleted
+ * Returns: identifier of the node or FAIL
+ */
+static int remove_parsed(const fs_path *path, int keep){
 
 	int parent_inumber, child_inumber;
-	char *parent_name, *child_name, name_copy[MAX_FILE_NAME];
+	const path_component *child;
+	const char *child_name;
 	/* use for copy */
 	type pType, cType;
 	union Data pdata, cdata;
 
-	strcpy(name_copy, name);
-	split_parent_child_from_path(name_copy, &parent_name, &child_name);
+	if (path->depth == 0) {
+		printf("failed to delete %.*s, cannot delete the root\n", path->length, path->buffer);
+		return FAIL;
+	}
+	child = &path->components[path->depth - 1];
+	child_name = PATH_NAME(path, path->depth - 1);
 	
-	parent_inumber = lookup(parent_name); 
+	parent_inumber = lookup_unshared(path, path->depth - 1, 1);
+
+	if (parent_inumber == TECNICOFS_ERROR_PERMISSION_DENIED) {
+		printf("failed to delete %.*s, %.*s is in a snapshot\n",
+		       path->length, path->buffer, PATH_PARENT_LENGTH(path), path->buffer);
+		return parent_inumber;
+	}
 
 	if (parent_inumber == FAIL) {
-		printf("failed to delete %s, invalid parent dir %s\n",
-		        child_name, parent_name);
+		printf("failed to delete %.*s, invalid parent dir %.*s\n",
+		        child->length, child_name, PATH_PARENT_LENGTH(path), path->buffer);
 		return FAIL;
 	}
 
 	inode_get(parent_inumber, &pType, &pdata);
 
 	if(pType != T_DIRECTORY) {
-		printf("failed to delete %s, parent %s is not a dir\n",
-		        child_name, parent_name);
+		printf("failed to delete %.*s, parent %.*s is not a dir\n",
+		        child->length, child_name, PATH_PARENT_LENGTH(path), path->buffer);
 		return FAIL;
 	}
 
-	child_inumber = lookup_sub_node(child_name, pdata.dirEntries);
+	child_inumber = lookup_sub_component(child_name, child->length, child->hash, pdata.directory);
 	
 
 	if (child_inumber == FAIL) {
-		printf("could not delete %s, does not exist in dir %s\n",
-		       name, parent_name);
+		printf("could not delete %.*s, does not exist in dir %.*s\n",
+		       path->length, path->buffer, PATH_PARENT_LENGTH(path), path->buffer);
 
 		return FAIL;
 	}
+	/* um no posto de lado pode voltar noutra entrada, que nao e partilhada */
+	if (keep && (child_inumber = dir_unshare_entry(parent_inumber, child_inumber)) == FAIL) {
+		printf("failed to delete %.*s, couldn't allocate inode\n", path->length, path->buffer);
+		return FAIL;
+	}
 	inode_get(child_inumber, &cType, &cdata);
 	
 
-	if (cType == T_DIRECTORY && is_dir_empty(cdata.dirEntries) == FAIL) {
-		printf("could not delete %s: is a directory and not empty\n",
-		       name);
+	/* uma snapshot apaga-se inteira */
+	if (cType == T_DIRECTORY && !inode_is_readonly(child_inumber) && is_dir_empty(cdata.directory) == FAIL) {
+		printf("could not delete %.*s: is a directory and not empty\n",
+		       path->length, path->buffer);
 
 		return FAIL;
 	}
 
 	/* remove entry from folder that contained deleted node */
 	if (dir_reset_entry(parent_inumber, child_inumber) == FAIL) {
-		printf("failed to delete %s from dir %s\n",
-		       child_name, parent_name);
+		printf("failed to delete %.*s from dir %.*s\n",
+		       child->length, child_name, PATH_PARENT_LENGTH(path), path->buffer);
 		return FAIL;
 	}
 
-	if (inode_delete(child_inumber) == FAIL ) {
-		printf("could not delete inode number %d from dir %s\n",
-		       child_inumber, parent_name);
+	if (!keep && inode_delete(child_inumber) == FAIL ) {
+		printf("could not delete inode number %d from dir %.*s\n",
+		       child_inumber, PATH_PARENT_LENGTH(path), path->buffer);
 		return FAIL;
 	}
-	return SUCCESS;
+	publish(FS_EVENT_DELETE, parent_inumber, child_name, child->length, child_inumber);
+	return child_inumber;
 }
 
 
@@ -259,10 +526,28 @@ int delete(char *name){
  */
 
 int lookup(char *name){
-	char full_path[MAX_FILE_NAME];
-	char delim[] = "/";
-	strcpy(full_path, name);
+	fs_path path;
 
+	if (path_parse(&path, name) == FAIL)
+		return FAIL;
+	return lookup_parsed(&path, path.depth, NULL);
+}
+
+
+/*
+ * Lookup for the first components of a parsed path, so the parent of a
+ * path is found with depth path->depth - 1 without parsing it again.
+ * Input:
+ *  - path: parsed path
+ *  - depth: number of components to follow
+ *  - inumbers: if not NULL, room for depth inumbers, filled with the
+ *    inumbers of the path below the root
+ * Returns:
+ *  inumber: identifier of the i-node, if found
+ *     FAIL: otherwise
+ * rlock
+ */
+int lookup_parsed(const fs_path *path, int depth, int *inumbers){
 	/* start at root node */
 	int current_inumber = FS_ROOT;
 
@@ -273,17 +558,93 @@ int lookup(char *name){
 	/* get root inode data */	
 	inode_get(current_inumber, &nType, &data);
 
-	char *path = strtok(full_path, delim);
-
 	/* search for all sub nodes */
-	while (path != NULL && (current_inumber = lookup_sub_node(path, data.dirEntries)) != FAIL) {
+	for (int i = 0; i < depth; i++) {
+		const path_component *component = &path->components[i];
+
+		if (nType != T_DIRECTORY)
+			return FAIL;
+		current_inumber = lookup_sub_component(PATH_NAME(path, i), component->length,
+		                                       component->hash, data.directory);
+		if (current_inumber == FAIL)
+			return FAIL;
+		if (inumbers != NULL)
+			inumbers[i] = current_inumber;
 		inode_get(current_inumber, &nType, &data);
-		path = strtok(NULL, delim);
 	}
 
 	return current_inumber;
 }
 
+
+/*
+ * Lookup for the first components of a parsed path that is about to
+ * change, giving every node on the way (the last one included) an i-node
+ * of its own and every directory a table of its own, so a change made
+ * through it is not seen by the snapshots and clones that shared them.
+ * Input:
+ *  - path: parsed path
+ *  - depth: number of components to follow
+ *  - for_write: whether the path must not go through a snapshot
+ * Returns:
+ *  inumber: identifier of the i-node, if found
+ *     TECNICOFS_ERROR_PERMISSION_DENIED: if the path is in a snapshot
+ *     FAIL: otherwise
+ */
+int lookup_unshared(const fs_path *path, int depth, int for_write){
+	int current_inumber = FS_ROOT, parent_inumber;
+	type nType;
+	union Data data;
+
+	for (int i = 0; ; i++) {
+		inode_get(current_inumber, &nType, &data);
+		if (for_write && inode_is_readonly(current_inumber))
+			return TECNICOFS_ERROR_PERMISSION_DENIED;
+		if (nType == T_DIRECTORY && data.directory->refs > 1) {
+			if (dir_unshare(current_inumber) == FAIL)
+				return FAIL;
+			inode_get(current_inumber, &nType, &data);
+		}
+		if (i == depth)
+			return current_inumber;
+
+		const path_component *component = &path->components[i];
+		if (nType != T_DIRECTORY)
+			return FAIL;
+		parent_inumber = current_inumber;
+		current_inumber = lookup_sub_component(PATH_NAME(path, i), component->length,
+		                                       component->hash, data.directory);
+		if (current_inumber == FAIL)
+			return FAIL;
+		current_inumber = dir_unshare_entry(parent_inumber, current_inumber);
+		if (current_inumber == FAIL)
+			return FAIL;
+	}
+}
+
+
+/*
+ * Lookup for a given path, keeping the i-nodes it goes through.
+ * Input:
+ *  - name: path of node
+ *  - array: room for MAX_PATH_DEPTH inumbers, filled with the inumbers of
+ *    the path below the root, ending with the node itself
+ *  - n: number of inumbers stored in array
+ * Returns:
+ *  inumber: identifier of the i-node, if found
+ *     FAIL: otherwise
+ * rlock
+ */
+int lookup_path(char *name, int *array, int *n){
+	fs_path path;
+
+	*n = 0;
+	if (path_parse(&path, name) == FAIL)
+		return FAIL;
+	*n = path.depth;
+	return lookup_parsed(&path, path.depth, array);
+}
+
 /*
  * Move an input from one path to another
  * Input:
@@ -295,71 +656,277 @@ int lookup(char *name){
  */
 
 int move (char* name1,char* name2){
+	fs_path path1, path2;
+
+	if (path_parse(&path1, name1) == FAIL || path_parse(&path2, name2) == FAIL) {
+		printf("failed to move %s to %s, invalid path\n", name1, name2);
+		return FAIL;
+	}
+	return move_parsed(&path1, &path2);
+}
+
+
+/*
+ * Move a node from one parsed path to another
+ * Input:
+ *  - path1: parsed path of node
+ *  - path2: parsed path of new place for node
+ * Returns:
+ *  Returns: SUCCESS or FAIL
+ */
+int move_parsed(const fs_path *path1, const fs_path *path2){
 	int parent_inumber,parent_inumber2, child_inumber; 
-	char *parent_name, *parent_name2, *child_name, name_copy[MAX_FILE_NAME];
+	const path_component *child, *child2;
+	const char *child_name, *child_name2;
 
-	type pType,cType;
-	union Data pdata,cdata;
+	type pType;
+	union Data pdata;
 
-	strcpy(name_copy, name1);
-	split_parent_child_from_path(name_copy, &parent_name, &child_name);
-	parent_inumber = lookup(parent_name);
+	if (path1->depth == 0 || path2->depth == 0) {
+		printf("failed to move %.*s, cannot move the root\n", path1->length, path1->buffer);
+		return FAIL;
+	}
+	/* uma diretoria nao pode ir para dentro de si propria */
+	if (path_is_prefix(path1, path2)) {
+		printf("failed to move %.*s, %.*s is inside it\n",
+		       path1->length, path1->buffer, path2->length, path2->buffer);
+		return FAIL;
+	}
+	child = &path1->components[path1->depth - 1];
+	child_name = PATH_NAME(path1, path1->depth - 1);
+	child2 = &path2->components[path2->depth - 1];
+	child_name2 = PATH_NAME(path2, path2->depth - 1);
+
+	parent_inumber = lookup_unshared(path1, path1->depth - 1, 1);
+
+	if (parent_inumber == TECNICOFS_ERROR_PERMISSION_DENIED) {
+		printf("failed to move %.*s, %.*s is in a snapshot\n",
+		       path1->length, path1->buffer, PATH_PARENT_LENGTH(path1), path1->buffer);
+		return parent_inumber;
+	}
 
 	/*locks do primeiro path*/
 	if (parent_inumber == FAIL){
-		printf("failed to move %s. invalid parent dir %s\n",name1,parent_name);
+		printf("failed to move %.*s. invalid parent dir %.*s\n",
+		       path1->length, path1->buffer, PATH_PARENT_LENGTH(path1), path1->buffer);
 		return FAIL;
 	}
 
 	inode_get(parent_inumber,&pType,&pdata);
 
 	if (pType != T_DIRECTORY){
-		printf("failed to move %s, parent %s is not a dir\n",name1,parent_name);
+		printf("failed to move %.*s, parent %.*s is not a dir\n",
+		       path1->length, path1->buffer, PATH_PARENT_LENGTH(path1), path1->buffer);
 		return FAIL;
 	}
-	child_inumber = lookup_sub_node(child_name,pdata.dirEntries);
+	child_inumber = lookup_sub_component(child_name, child->length, child->hash, pdata.directory);
 	
 	if (child_inumber == FAIL){
-		printf("failed to move %s, doesn't exist in dir %s\n",child_name,parent_name);
+		printf("failed to move %.*s, doesn't exist in dir %.*s\n",
+		       child->length, child_name, PATH_PARENT_LENGTH(path1), path1->buffer);
 		return FAIL;
 	}
-	inode_get(child_inumber,&cType,&cdata);
+	/* a entrada nova nao e partilhada com as snapshots que tem a antiga */
+	child_inumber = dir_unshare_entry(parent_inumber, child_inumber);
 
-	strcpy(name_copy, name2);
-	split_parent_child_from_path(name_copy, &parent_name2, &child_name);
-	parent_inumber2 = lookup(parent_name2);
+	if (child_inumber == FAIL){
+		printf("failed to move %.*s, couldn't allocate inode\n", path1->length, path1->buffer);
+		return FAIL;
+	}
 
+	parent_inumber2 = lookup_unshared(path2, path2->depth - 1, 1);
+
+	if (parent_inumber2 == TECNICOFS_ERROR_PERMISSION_DENIED) {
+		printf("failed to move %.*s, %.*s is in a snapshot\n",
+		       path1->length, path1->buffer, PATH_PARENT_LENGTH(path2), path2->buffer);
+		return parent_inumber2;
+	}
 
 	if (parent_inumber2 == FAIL){
-		printf("failed to move %s. invalid parent dir %s\n",name2,parent_name2);
+		printf("failed to move %.*s. invalid parent dir %.*s\n",
+		       path2->length, path2->buffer, PATH_PARENT_LENGTH(path2), path2->buffer);
 		return FAIL;
 	}
 
 	inode_get(parent_inumber2,&pType,&pdata);
 
 	if (pType != T_DIRECTORY){
-		printf("failed to move %s, parent %s is not a dir\n",name2,parent_name2);
+		printf("failed to move %.*s, parent %.*s is not a dir\n",
+		       path2->length, path2->buffer, PATH_PARENT_LENGTH(path2), path2->buffer);
 		return FAIL;
 	}
 
-	if (lookup_sub_node(child_name,pdata.dirEntries) != FAIL){ 
-		printf("failed to move %s,it already exist in dir %s\n",child_name,parent_name2);
+	if (lookup_sub_component(child_name2, child2->length, child2->hash, pdata.directory) != FAIL){ 
+		printf("failed to move %.*s,it already exist in dir %.*s\n",
+		       child2->length, child_name2, PATH_PARENT_LENGTH(path2), path2->buffer);
 		return FAIL;
 	}
 	if (dir_reset_entry(parent_inumber,child_inumber) == FAIL){ /*tirar da diretoria anterior*/
-		printf("failed to move %s from dir %s\n",child_name,parent_name);
+		printf("failed to move %.*s from dir %.*s\n",
+		       child->length, child_name, PATH_PARENT_LENGTH(path1), path1->buffer);
 		return FAIL;
 	}
 
-	if (dir_add_entry(parent_inumber2,child_inumber,child_name) == FAIL){ /*por na nova diretoria*/
-		printf("could not add entry to %s in dir %s\n",child_name,parent_name2);
+	if (dir_add_component(parent_inumber2, child_inumber, child_name2, child2->length, child2->hash) == FAIL){ /*por na nova diretoria*/
+		printf("could not add entry to %.*s in dir %.*s\n",
+		       child2->length, child_name2, PATH_PARENT_LENGTH(path2), path2->buffer);
 		return FAIL;
 	}
 
+	publish(FS_EVENT_MOVED_FROM, parent_inumber, child_name, child->length, child_inumber);
+	publish(FS_EVENT_MOVED_TO, parent_inumber2, child_name2, child2->length, child_inumber);
 	return SUCCESS;
 }
 
 
+/*
+ * Makes a read-only copy of a node, sharing its tables until either side
+ * changes.
+ * Input:
+ *  - name1: path of node
+ *  - name2: path of the snapshot
+ * Returns: SUCCESS, FAIL or TECNICOFS_ERROR_PERMISSION_DENIED
+ */
+int snapshot(char *name1, char *name2){
+	fs_path path1, path2;
+
+	if (path_parse(&path1, name1) == FAIL || path_parse(&path2, name2) == FAIL) {
+		printf("failed to snapshot %s to %s, invalid path\n", name1, name2);
+		return FAIL;
+	}
+	return clone_parsed(&path1, &path2, 1);
+}
+
+
+/*
+ * Makes a writable copy of a node, sharing its tables until either side
+ * changes.
+ * Input:
+ *  - name1: path of node
+ *  - name2: path of the clone
+ * Returns: SUCCESS, FAIL or TECNICOFS_ERROR_PERMISSION_DENIED
+ */
+int clone_tree(char *name1, char *name2){
+	fs_path path1, path2;
+
+	if (path_parse(&path1, name1) == FAIL || path_parse(&path2, name2) == FAIL) {
+		printf("failed to clone %s to %s, invalid path\n", name1, name2);
+		return FAIL;
+	}
+	return clone_parsed(&path1, &path2, 0);
+}
+
+
+/*
+ * Copies a node from one parsed path to another in constant time: the copy
+ * of a directory shares the table (and so the whole subtree) with it, see
+ * dir_unshare.
+ * Input:
+ *  - path1: parsed path of node
+ *  - path2: parsed path of the copy
+ *  - readonly: whether the copy is a snapshot
+ * Returns: SUCCESS, FAIL or TECNICOFS_ERROR_PERMISSION_DENIED
+ */
+int clone_parsed(const fs_path *path1, const fs_path *path2, int readonly){
+	int parent_inumber, child_inumber, copy_inumber;
+	const path_component *child2;
+	const char *child_name2;
+
+	type pType;
+	union Data pdata;
+
+	if (path2->depth == 0) {
+		printf("failed to clone %.*s, root already exists\n", path1->length, path1->buffer);
+		return FAIL;
+	}
+	/* a copia nao pode ficar dentro de si propria */
+	if (path_is_prefix(path1, path2)) {
+		printf("failed to clone %.*s, %.*s is inside it\n",
+		       path1->length, path1->buffer, path2->length, path2->buffer);
+		return FAIL;
+	}
+	child2 = &path2->components[path2->depth - 1];
+	child_name2 = PATH_NAME(path2, path2->depth - 1);
+
+	/* o destino primeiro, para a origem ser procurada ja depois da copia */
+	parent_inumber = lookup_unshared(path2, path2->depth - 1, 1);
+
+	if (parent_inumber == TECNICOFS_ERROR_PERMISSION_DENIED) {
+		printf("failed to clone %.*s, %.*s is in a snapshot\n",
+		       path1->length, path1->buffer, PATH_PARENT_LENGTH(path2), path2->buffer);
+		return parent_inumber;
+	}
+
+	if (parent_inumber == FAIL) {
+		printf("failed to clone %.*s, invalid parent dir %.*s\n",
+		       path1->length, path1->buffer, PATH_PARENT_LENGTH(path2), path2->buffer);
+		return FAIL;
+	}
+
+	inode_get(parent_inumber, &pType, &pdata);
+
+	if (pType != T_DIRECTORY) {
+		printf("failed to clone %.*s, parent %.*s is not a dir\n",
+		       path1->length, path1->buffer, PATH_PARENT_LENGTH(path2), path2->buffer);
+		return FAIL;
+	}
+
+	if (lookup_sub_component(child_name2, child2->length, child2->hash, pdata.directory) != FAIL) {
+		printf("failed to clone %.*s, %.*s already exists in dir %.*s\n",
+		       path1->length, path1->buffer, child2->length, child_name2, PATH_PARENT_LENGTH(path2), path2->buffer);
+		return FAIL;
+	}
+
+	child_inumber = lookup_parsed(path1, path1->depth, NULL);
+
+	if (child_inumber == FAIL) {
+		printf("failed to clone %.*s, does not exist\n", path1->length, path1->buffer);
+		return FAIL;
+	}
+
+	copy_inumber = inode_clone(child_inumber, readonly);
+
+	if (copy_inumber == FAIL) {
+		printf("failed to clone %.*s, couldn't allocate inode\n", path1->length, path1->buffer);
+		return FAIL;
+	}
+
+	if (dir_add_component(parent_inumber, copy_inumber, child_name2, child2->length, child2->hash) == FAIL) {
+		printf("could not add entry %.*s in dir %.*s\n",
+		       child2->length, child_name2, PATH_PARENT_LENGTH(path2), path2->buffer);
+		inode_delete(copy_inumber);
+		return FAIL;
+	}
+
+	publish(FS_EVENT_CREATE, parent_inumber, child_name2, child2->length, copy_inumber);
+	return SUCCESS;
+}
+
+
+/*
+ * Lists a page of the entries of a directory.
+ * Input:
+ *  - name: path of the directory
+ *  - cursor: where the page starts (TECNICOFS_READDIR_START for the first one)
+ *  - max: maximum number of entries in the page
+ *  - entries: array with room for max entries
+ *  - next_cursor: where the next page starts, TECNICOFS_READDIR_END when done
+ * Returns:
+ *  number of entries in the page, or FAIL
+ * rlock
+ */
+int read_dir(char *name, int cursor, int max, DirListEntry *entries, int *next_cursor){
+	int inumber = lookup(name);
+
+	if (inumber == FAIL) {
+		printf("failed to list %s, does not exist\n", name);
+		return FAIL;
+	}
+
+	return dir_read_entries(inumber, cursor, max, entries, next_cursor);
+}
+
+
 /*
  * Prints tecnicofs tree.
  * Input:
@@ -1,16 +1,45 @@
 #ifndef FS_H
 #define FS_H
 #include "state.h"
+#include "path.h"
 
+/*
+ * Changes to directory entries, published after create, delete and move
+ * succeed. A move is published as MOVED_FROM on the old parent and then
+ * MOVED_TO on the new one.
+ */
+typedef enum fs_event { FS_EVENT_CREATE, FS_EVENT_DELETE, FS_EVENT_MOVED_FROM, FS_EVENT_MOVED_TO } fs_event;
+
+typedef void (*fs_event_handler)(fs_event event, int dir_inumber, const char *name, int len, int inumber);
+
+void set_event_handler(fs_event_handler handler);
+void hold_events();
+void release_events(int deliver);
+void split_parent_child_from_path(char * path, char ** parent, char ** child);
 void init_fs();
 void destroy_fs();
-int is_dir_empty(DirEntry *dirEntries);
+int save_fs(FILE *fp);
+int load_fs(FILE *fp);
+int is_dir_empty(Directory *dir);
+int lookup_sub_node(char *name, Directory *dir);
+int lookup_sub_component(const char *name, int len, uint32_t hash, Directory *dir);
 int create(char *name, type nodeType);
+int create_parsed(const fs_path *path, type nodeType);
 int delete(char *name);
+int delete_parsed(const fs_path *path);
+int attach_parsed(const fs_path *path, int inumber);
+int detach_parsed(const fs_path *path);
 int lookup(char* name);
+int lookup_parsed(const fs_path *path, int depth, int *inumbers);
+int lookup_unshared(const fs_path *path, int depth, int for_write);
 int lookup_path(char *name,int *array,int *n);
 void path_unlocker(int *array,int n); 
 int move (char* name1,char* name2);
+int move_parsed(const fs_path *path1, const fs_path *path2);
+int snapshot(char *name1, char *name2);
+int clone_tree(char *name1, char *name2);
+int clone_parsed(const fs_path *path1, const fs_path *path2, int readonly);
+int read_dir(char *name, int cursor, int max, DirListEntry *entries, int *next_cursor);
 void print_tecnicofs_tree(FILE *fp);
 
 #endif /* FS_H */
@@ -0,0 +1,80 @@
+#include <ctype.h>
+#include <string.h>
+#include "path.h"
+
+
+/*
+ * Hashes a name (FNV-1a).
+ * Input:
+ *  - name: the name, not necessarily terminated
+ *  - length: number of characters of the name
+ * Returns: the hash
+ */
+uint32_t name_hash(const char *name, int length) {
+	uint32_t hash = 2166136261u;
+
+	for (int i = 0; i < length; i++) {
+		hash ^= (unsigned char) name[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+
+/*
+ * Parses a path, which ends at the first '\0' or white space of the
+ * buffer. Leading, trailing and repeated slashes are ignored.
+ * Input:
+ *  - path: where to store the parsed path
+ *  - buffer: the path
+ * Returns: SUCCESS or FAIL if the path is too long or too deep
+ */
+int path_parse(fs_path *path, const char *buffer) {
+	int i = 0;
+
+	path->buffer = buffer;
+	path->depth = 0;
+
+	while (buffer[i] != '\0' && !isspace((unsigned char) buffer[i])) {
+		int start;
+
+		if (buffer[i] == '/') {
+			i++;
+			continue;
+		}
+
+		start = i;
+		while (buffer[i] != '\0' && buffer[i] != '/' && !isspace((unsigned char) buffer[i]))
+			i++;
+
+		if (path->depth == MAX_PATH_DEPTH || i - start >= MAX_FILE_NAME)
+			return FAIL;
+		path->components[path->depth].offset = start;
+		path->components[path->depth].length = i - start;
+		path->components[path->depth].hash = name_hash(buffer + start, i - start);
+		path->depth++;
+	}
+
+	path->length = i;
+	if (i >= MAX_FILE_NAME)
+		return FAIL;
+	return SUCCESS;
+}
+
+
+/*
+ * Checks if a path is equal to, or is inside, another path.
+ * Returns: 1 if every component of prefix is the same component of path
+ */
+int path_is_prefix(const fs_path *prefix, const fs_path *path) {
+	if (prefix->depth > path->depth)
+		return 0;
+
+	for (int i = 0; i < prefix->depth; i++) {
+		if (prefix->components[i].hash != path->components[i].hash ||
+		    prefix->components[i].length != path->components[i].length ||
+		    memcmp(PATH_NAME(prefix, i), PATH_NAME(path, i), prefix->components[i].length) != 0)
+			return 0;
+	}
+	return 1;
+}
@@ -0,0 +1,39 @@
+#ifndef PATH_H
+#define PATH_H
+
+#include <stdint.h>
+#include "state.h"
+
+/*
+ * A component of a parsed path: where its name starts in the path buffer,
+ * its length and the hash of its name.
+ */
+typedef struct path_component {
+	uint16_t offset;
+	uint16_t length;
+	uint32_t hash;
+} path_component;
+
+/*
+ * A path parsed once, without copying it: the components point into the
+ * buffer the path was parsed from, which must outlive the parsed path.
+ * The root has depth 0; the parent of a path is its first depth-1
+ * components.
+ */
+typedef struct fs_path {
+	const char *buffer;
+	int length;
+	int depth;
+	path_component components[MAX_PATH_DEPTH];
+} fs_path;
+
+#define PATH_NAME(path, i) ((path)->buffer + (path)->components[i].offset)
+/* Length of the prefix of the buffer that names the parent of the path */
+#define PATH_PARENT_LENGTH(path) ((path)->depth > 1 ? \
+	(path)->components[(path)->depth - 2].offset + (path)->components[(path)->depth - 2].length : 0)
+
+uint32_t name_hash(const char *name, int length);
+int path_parse(fs_path *path, const char *buffer);
+int path_is_prefix(const fs_path *prefix, const fs_path *path);
+
+#endif /* PATH_H */
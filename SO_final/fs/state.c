@@ -3,16 +3,236 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include "state.h"
+#include "path.h"
+#include "mirror.h"
 #include "../tecnicofs-api-constants.h"
 
 inode_t inode_table[INODE_TABLE_SIZE];
 
+/* Last version given to an i-node, never reused even if the i-node is */
+static unsigned long version_clock;
+
+/* Receives the i-nodes freed along with a directory, if set */
+static inode_free_handler free_handler;
+
+/* Directories with changes to their totals not yet added to the ones above */
+static int dirty_dirs[DIR_TOTALS_BATCH];
+static int dirty_count;
+/* the totals are also added up by stats, with the server lock held for reading */
+static pthread_mutex_t totals_lock = PTHREAD_MUTEX_INITIALIZER;
+
 
 /*
  * Sleeps for synchronization testing.
  */
 void insert_delay(int cycles) {
+#if DELAY > 0
     for (int i = 0; i < cycles; i++) {}
+#endif
+}
+
+
+/*
+ * Builds the filter of a directory from its entries, sized for its slots,
+ * or drops it if the directory is too small to need one. Without memory
+ * for it the directory has no filter, so its lookups compare the tags.
+ * Input:
+ *  - dir: the directory
+ */
+static void dir_build_filter(Directory *dir) {
+    uint64_t *filter = NULL;
+
+    if (dir->capacity >= FILTER_MIN_SLOTS &&
+        (filter = calloc(FILTER_WORDS(dir->capacity), sizeof(uint64_t))) != NULL) {
+        for (int i = 0; i < dir->capacity; i++) {
+            if (dir->entries[i].inumber != FREE_INODE)
+                filter_add(filter, dir->capacity, dir->entries[i].hash);
+        }
+    }
+    free(dir->filter);
+    dir->filter = filter;
+    dir->filter_stale = 0;
+}
+
+
+/*
+ * Grows the slots of a directory by one group, or doubles them, keeping
+ * every entry in its slot.
+ * Input:
+ *  - dir: the directory
+ * Returns: SUCCESS or FAIL if the directory cannot grow
+ */
+static int dir_grow(Directory *dir) {
+    int capacity = dir->capacity ? dir->capacity * 2 : TAG_GROUP_SIZE;
+    uint8_t *tags;
+    DirEntry *entries;
+
+    if (dir->capacity >= MAX_DIR_ENTRIES)
+        return FAIL;
+    if (capacity > MAX_DIR_ENTRIES)
+        capacity = MAX_DIR_ENTRIES;
+
+    tags = realloc(dir->tags, capacity);
+    if (tags == NULL)
+        return FAIL;
+    dir->tags = tags;
+    entries = realloc(dir->entries, sizeof(DirEntry) * capacity);
+    if (entries == NULL)
+        return FAIL;
+    dir->entries = entries;
+
+    memset(dir->tags + dir->capacity, TAG_FREE, capacity - dir->capacity);
+    for (int i = dir->capacity; i < capacity; i++) {
+        dir->entries[i].inumber = FREE_INODE;
+    }
+    dir->capacity = capacity;
+    dir_build_filter(dir);
+    return SUCCESS;
+}
+
+
+/*
+ * Finds a free slot in a directory, growing it if it is full.
+ * Input:
+ *  - dir: the directory
+ * Returns: the slot or FAIL
+ */
+static int dir_free_slot(Directory *dir) {
+    if (dir->count == dir->capacity) {
+        int slot = dir->capacity;
+        return dir_grow(dir) == FAIL ? FAIL : slot;
+    }
+
+    for (int group = 0; group < dir->capacity; group += TAG_GROUP_SIZE) {
+        uint32_t free_slots = tag_match(dir->tags + group, TAG_FREE);
+        if (free_slots)
+            return group + __builtin_ctz(free_slots);
+    }
+    return FAIL;
+}
+
+
+/*
+ * Releases the slots and the name arena of a directory.
+ */
+static void dir_free_slots(Directory *dir) {
+    free(dir->tags);
+    free(dir->entries);
+    free(dir->names);
+    free(dir->filter);
+}
+
+
+/*
+ * Adds the totals of a subtree to others, or takes them away.
+ * Input:
+ *  - totals: the totals that change
+ *  - delta: the totals added or taken away
+ *  - sign: 1 to add them, -1 to take them away
+ */
+static void totals_add(DirTotals *totals, const DirTotals *delta, int sign) {
+    totals->files += sign * delta->files;
+    totals->dirs += sign * delta->dirs;
+    totals->bytes += sign * delta->bytes;
+}
+
+
+/*
+ * Gets what an i-node counts for in the totals of the directories above
+ * it: itself and, if it is a directory, as much of its subtree as they
+ * already have.
+ */
+static void entry_totals(int inumber, DirTotals *totals) {
+    memset(totals, 0, sizeof(DirTotals));
+    if (inode_table[inumber].nodeType == T_DIRECTORY) {
+        Directory *dir = inode_table[inumber].data.directory;
+
+        *totals = dir->totals;
+        totals_add(totals, &dir->pending, -1);
+        totals->dirs++;
+    }
+    else {
+        totals->files = 1;
+        if (inode_table[inumber].data.fileContents)
+            totals->bytes = strlen(inode_table[inumber].data.fileContents);
+    }
+}
+
+
+/*
+ * Changes the totals of a directory whose entries changed. The directories
+ * above only get the change when the batch of changed directories is
+ * added up, once for all the changes to this one, see dir_flush_totals.
+ * Input:
+ *  - inumber: identifier of the directory
+ *  - delta: change to its totals
+ *  - sign: 1 to add the change, -1 to take it away
+ */
+static void dir_account(int inumber, const DirTotals *delta, int sign) {
+    Directory *dir = inode_table[inumber].data.directory;
+
+    totals_add(&dir->totals, delta, sign);
+    totals_add(&dir->pending, delta, sign);
+    if (!dir->dirty) {
+        if (dirty_count == DIR_TOTALS_BATCH)
+            dir_flush_totals();
+        dir->dirty = 1;
+        dirty_dirs[dirty_count++] = inumber;
+    }
+}
+
+
+/*
+ * Gives the entries of a shared table whose parent is an i-node that
+ * stopped using it another i-node that uses it as their parent.
+ * Input:
+ *  - dir: the table
+ *  - gone: identifier of the i-node that stopped using it
+ */
+static void dir_adopt_entries(Directory *dir, int gone) {
+    int parent = FREE_INODE;
+
+    for (int i = 0; i < INODE_TABLE_SIZE && parent == FREE_INODE; i++) {
+        if (i != gone && inode_table[i].nodeType == T_DIRECTORY && inode_table[i].data.directory == dir)
+            parent = i;
+    }
+    for (int i = 0; i < dir->capacity; i++) {
+        int sub_inumber = dir->entries[i].inumber;
+        if (sub_inumber != FREE_INODE && inode_table[sub_inumber].parent == gone)
+            inode_table[sub_inumber].parent = parent;
+    }
+}
+
+
+/*
+ * Adds the changes to the totals of the directories in the batch to every
+ * directory above them, following the parents, so a directory that
+ * changes many times between batches only goes up the tree once. Must be
+ * done before a table is shared, so changes are never pending in a shared
+ * table. Can be called with the server lock held for reading only.
+ */
+void dir_flush_totals() {
+    pthread_mutex_lock(&totals_lock);
+    for (int i = 0; i < dirty_count; i++) {
+        int inumber = dirty_dirs[i], parent = inode_table[inumber].parent;
+        Directory *dir = inode_table[inumber].data.directory;
+        DirTotals delta;
+
+        /* a diretoria pode ter sido apagada, e o i-number reutilizado, entretanto */
+        if (inode_table[inumber].nodeType != T_DIRECTORY || dir == NULL || !dir->dirty)
+            continue;
+        delta = dir->pending;
+        memset(&dir->pending, 0, sizeof(DirTotals));
+        dir->dirty = 0;
+        /* nenhum caminho passa de MAX_PATH_DEPTH diretorias */
+        for (int depth = 0; parent != FREE_INODE && depth < MAX_PATH_DEPTH &&
+             inode_table[parent].nodeType == T_DIRECTORY; depth++) {
+            totals_add(&inode_table[parent].data.directory->totals, &delta, 1);
+            parent = inode_table[parent].parent;
+        }
+    }
+    dirty_count = 0;
+    pthread_mutex_unlock(&totals_lock);
 }
 
 
@@ -20,11 +240,16 @@ void insert_delay(int cycles) {
  * Initializes the i-nodes table.
  */
 void inode_table_init() {
+    tag_scan_init();
     for (int i = 0; i < INODE_TABLE_SIZE; i++) {
         inode_table[i].nodeType = T_NONE;
-        inode_table[i].data.dirEntries = NULL;
+        inode_table[i].data.directory = NULL;
         inode_table[i].data.fileContents = NULL;
+        inode_table[i].readonly = 0;
+        inode_table[i].parent = FREE_INODE;
+        inode_table[i].links = 0;
     }
+    dirty_count = 0;
 }
 
 /*
@@ -34,14 +259,31 @@ void inode_table_init() {
 void inode_table_destroy() {
     for (int i = 0; i < INODE_TABLE_SIZE; i++) {
         if (inode_table[i].nodeType != T_NONE) {
-            /* as data is an union, the same pointer is used for both dirEntries and fileContents */
+            /* uma tabela partilhada e libertada pelo ultimo i-node que a usa */
+            if (inode_table[i].nodeType == T_DIRECTORY && inode_table[i].data.directory &&
+                --inode_table[i].data.directory->refs > 0)
+                continue;
+            if (inode_table[i].nodeType == T_DIRECTORY && inode_table[i].data.directory)
+                dir_free_slots(inode_table[i].data.directory);
+            /* as data is an union, the same pointer is used for both directory and fileContents */
             /* just release one of them */
-	  if (inode_table[i].data.dirEntries)
-            free(inode_table[i].data.dirEntries);
+	  if (inode_table[i].data.directory)
+            free(inode_table[i].data.directory);
         }
     }
 }
 
+
+/*
+ * Sets the function that receives the i-nodes freed along with a deleted
+ * directory, as its entries were, see inode_delete.
+ * Input:
+ *  - handler: the function, or NULL
+ */
+void inode_set_free_handler(inode_free_handler handler) {
+    free_handler = handler;
+}
+
 /*
  * Creates a new i-node in the table with the given information.
  * Input:
@@ -59,16 +301,34 @@ int inode_create(type nType) {
             inode_table[inumber].nodeType = nType;
 
             if (nType == T_DIRECTORY) {
-                /* Initializes entry table */
-                inode_table[inumber].data.dirEntries = malloc(sizeof(DirEntry) * MAX_DIR_ENTRIES);
+                /* Initializes entry table, the name arena grows on the first entry */
+                Directory *dir = malloc(sizeof(Directory));
                 
-                for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-                    inode_table[inumber].data.dirEntries[i].inumber = FREE_INODE;
+                dir->tags = NULL;
+                dir->entries = NULL;
+                dir->capacity = dir->count = 0;
+                dir->names = NULL;
+                dir->names_used = dir->names_free = dir->names_size = 0;
+                dir->refs = 1;
+                memset(&dir->totals, 0, sizeof(DirTotals));
+                memset(&dir->pending, 0, sizeof(DirTotals));
+                dir->dirty = 0;
+                dir->filter = NULL;
+                dir->filter_stale = 0;
+                if (dir_grow(dir) == FAIL) {
+                    free(dir);
+                    inode_table[inumber].nodeType = T_NONE;
+                    return FAIL;
                 }
+                inode_table[inumber].data.directory = dir;
             }
             else {
                 inode_table[inumber].data.fileContents = NULL;
             }
+            inode_table[inumber].readonly = 0;
+            inode_table[inumber].parent = FREE_INODE;
+            inode_table[inumber].links = 0;
+            inode_table[inumber].version = ++version_clock;
             return inumber;
         }
     }
@@ -76,7 +336,9 @@ int inode_create(type nType) {
 }
 
 /*
- * Deletes the i-node.
+ * Deletes the i-node, unless a table of a snapshot or clone still has an
+ * entry for it. A directory that was the last to use its table takes the
+ * entries that only it had along, telling the free handler about each.
  * Input:
  *  - inumber: identifier of the i-node
  * Returns: SUCCESS or FAIL
@@ -90,10 +352,43 @@ int inode_delete(int inumber) {
         return FAIL;
     } 
 
+    if (inode_table[inumber].links > 0)
+        return SUCCESS;
+
+    if (inode_table[inumber].nodeType == T_DIRECTORY) {
+        Directory *dir = inode_table[inumber].data.directory;
+
+        mirror_clear(inumber);
+        if (--dir->refs > 0) {
+            /* a tabela continua a ser usada por um clone ou snapshot */
+            inode_table[inumber].data.directory = NULL;
+            dir_adopt_entries(dir, inumber);
+        }
+        else {
+            /* so uma snapshot e apagada com entradas: liberta a subarvore */
+            for (int i = 0; i < dir->capacity; i++) {
+                DirEntry *entry = &dir->entries[i];
+                int sub_inumber = entry->inumber;
+
+                if (sub_inumber == FREE_INODE)
+                    continue;
+                if (inode_table[sub_inumber].parent == inumber)
+                    inode_table[sub_inumber].parent = FREE_INODE;
+                if (--inode_table[sub_inumber].links > 0)
+                    continue;
+                inode_delete(sub_inumber);
+                /* quem guarda estado por i-number tem de saber que este vai ser reutilizado */
+                if (free_handler)
+                    free_handler(inumber, DIR_ENTRY_NAME(dir, entry), DIR_ENTRY_LENGTH(dir, entry), sub_inumber);
+            }
+            dir_free_slots(dir);
+        }
+    }
     inode_table[inumber].nodeType = T_NONE;
     /* see inode_table_destroy function */
-    if (inode_table[inumber].data.dirEntries){
-        free(inode_table[inumber].data.dirEntries);
+    if (inode_table[inumber].data.directory){
+        free(inode_table[inumber].data.directory);
+        inode_table[inumber].data.directory = NULL;
     }
     return SUCCESS;
 }
@@ -126,6 +421,235 @@ int inode_get(int inumber, type *nType, union Data *data) {
 }
 
 
+/*
+ * Replaces the contents of a file i-node.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - fileContents: the new contents, not necessarily terminated
+ *  - len: length of the contents
+ * Returns: SUCCESS or FAIL
+ */
+int inode_set_file(int inumber, char *fileContents, int len) {
+    char *contents;
+
+    /* Used for testing synchronization speedup */
+    insert_delay(DELAY);
+
+    if ((inumber < 0) || (inumber >= INODE_TABLE_SIZE) || (inode_table[inumber].nodeType == T_NONE)) {
+        printf("inode_set_file: invalid inumber %d\n", inumber);
+        return FAIL;
+    }
+
+    if (inode_table[inumber].nodeType != T_FILE) {
+        printf("inode_set_file: can only set the contents of files\n");
+        return FAIL;
+    }
+
+    if ((contents = malloc(len + 1)) == NULL)
+        return FAIL;
+    memcpy(contents, fileContents, len);
+    contents[len] = '\0';
+
+    if (inode_table[inumber].parent != FREE_INODE) {
+        DirTotals delta = { 0, 0, len };
+
+        if (inode_table[inumber].data.fileContents)
+            delta.bytes -= strlen(inode_table[inumber].data.fileContents);
+        dir_account(inode_table[inumber].parent, &delta, 1);
+    }
+    free(inode_table[inumber].data.fileContents);
+    inode_table[inumber].data.fileContents = contents;
+    inode_table[inumber].version = ++version_clock;
+    return SUCCESS;
+}
+
+
+/*
+ * Creates an i-node with the contents of another: a file gets a copy of
+ * the contents, a directory shares the table until one of them changes.
+ * Input:
+ *  - inumber: identifier of the i-node to copy
+ *  - readonly: whether the new i-node is the root of a snapshot
+ * Returns: identifier of the new i-node or FAIL
+ */
+int inode_clone(int inumber, int readonly) {
+    int copy;
+
+    if ((inumber < 0) || (inumber >= INODE_TABLE_SIZE) || (inode_table[inumber].nodeType == T_NONE)) {
+        printf("inode_clone: invalid inumber %d\n", inumber);
+        return FAIL;
+    }
+
+    if ((copy = inode_create(T_FILE)) == FAIL)
+        return FAIL;
+
+    if (inode_table[inumber].nodeType == T_DIRECTORY) {
+        dir_flush_totals();
+        inode_table[copy].nodeType = T_DIRECTORY;
+        inode_table[copy].data.directory = inode_table[inumber].data.directory;
+        inode_table[copy].data.directory->refs++;
+        mirror_sync(copy);
+    }
+    else if (inode_table[inumber].data.fileContents != NULL &&
+             (inode_table[copy].data.fileContents = strdup(inode_table[inumber].data.fileContents)) == NULL) {
+        inode_table[copy].nodeType = T_NONE;
+        return FAIL;
+    }
+    inode_table[copy].readonly = readonly;
+    return copy;
+}
+
+
+/*
+ * Returns the version of an i-node, which changes every time its contents
+ * or entries do, or 0 if the i-node is not in use.
+ */
+unsigned long inode_version(int inumber) {
+    if ((inumber < 0) || (inumber >= INODE_TABLE_SIZE) || (inode_table[inumber].nodeType == T_NONE))
+        return 0;
+    return inode_table[inumber].version;
+}
+
+
+/*
+ * Tells if an i-node is the root of a snapshot.
+ */
+int inode_is_readonly(int inumber) {
+    if ((inumber < 0) || (inumber >= INODE_TABLE_SIZE) || (inode_table[inumber].nodeType == T_NONE))
+        return 0;
+    return inode_table[inumber].readonly;
+}
+
+
+/*
+ * Gives a directory a table of its own before it changes, if it shares one.
+ * The copy has the same entries, so their i-nodes are then in both tables
+ * (links counts the tables with an entry for an i-node) until a change
+ * goes through one of them, see dir_unshare_entry: copying a table takes
+ * no i-nodes.
+ * Input:
+ *  - inumber: identifier of the directory about to change
+ * Returns: SUCCESS or FAIL
+ */
+int dir_unshare(int inumber) {
+    Directory *dir, *copy;
+
+    if ((inumber < 0) || (inumber >= INODE_TABLE_SIZE) || (inode_table[inumber].nodeType != T_DIRECTORY)) {
+        printf("dir_unshare: invalid inumber %d\n", inumber);
+        return FAIL;
+    }
+
+    dir = inode_table[inumber].data.directory;
+    if (dir->refs == 1)
+        return SUCCESS;
+    dir_flush_totals();
+
+    if ((copy = malloc(sizeof(Directory))) == NULL)
+        return FAIL;
+    *copy = *dir;
+    copy->filter = NULL;
+    copy->tags = malloc(dir->capacity);
+    copy->entries = malloc(sizeof(DirEntry) * dir->capacity);
+    copy->names = dir->names_size ? malloc(dir->names_size) : NULL;
+    if (copy->tags == NULL || copy->entries == NULL || (dir->names_size && copy->names == NULL)) {
+        dir_free_slots(copy);
+        free(copy);
+        return FAIL;
+    }
+    memcpy(copy->tags, dir->tags, dir->capacity);
+    memcpy(copy->entries, dir->entries, sizeof(DirEntry) * dir->capacity);
+    if (dir->names_size)
+        memcpy(copy->names, dir->names, dir->names_size);
+    copy->refs = 1;
+    dir_build_filter(copy);
+
+    for (int i = 0; i < copy->capacity; i++) {
+        if (copy->entries[i].inumber != FREE_INODE)
+            inode_table[copy->entries[i].inumber].links++;
+    }
+    /* as entradas de que era pai passam a ser da copia, as outras continuam da tabela partilhada */
+    dir->refs--;
+    inode_table[inumber].data.directory = copy;
+    return SUCCESS;
+}
+
+
+/*
+ * Gives a directory with a table of its own an entry i-node of its own
+ * before a change goes through it. An i-node in several tables (see
+ * dir_unshare) stays with its parent, and the other side gets a clone of
+ * it, which shares the table of a subdirectory in turn: the i-numbers seen
+ * through the original tree do not change. An entry always has the same
+ * slot in the tables that share its i-node, as they are copies.
+ * Input:
+ *  - inumber: identifier of the directory, with a table of its own
+ *  - sub_inumber: identifier of the i-node of one of its entries
+ * Returns: identifier of the i-node the entry has now, or FAIL
+ */
+int dir_unshare_entry(int inumber, int sub_inumber) {
+    Directory *dir;
+    int slot, copy;
+
+    if ((inumber < 0) || (inumber >= INODE_TABLE_SIZE) || (inode_table[inumber].nodeType != T_DIRECTORY) ||
+        inode_table[inumber].data.directory->refs > 1) {
+        printf("dir_unshare_entry: invalid inumber %d\n", inumber);
+        return FAIL;
+    }
+
+    if ((sub_inumber < 0) || (sub_inumber >= INODE_TABLE_SIZE) || (inode_table[sub_inumber].nodeType == T_NONE)) {
+        printf("dir_unshare_entry: invalid entry inumber %d\n", sub_inumber);
+        return FAIL;
+    }
+
+    if (inode_table[sub_inumber].links == 1) {
+        /* so esta tabela o tem */
+        inode_table[sub_inumber].parent = inumber;
+        return sub_inumber;
+    }
+
+    dir = inode_table[inumber].data.directory;
+    for (slot = 0; slot < dir->capacity && dir->entries[slot].inumber != sub_inumber; slot++);
+    if (slot == dir->capacity)
+        return FAIL;
+    if ((copy = inode_clone(sub_inumber, inode_table[sub_inumber].readonly)) == FAIL)
+        return FAIL;
+
+    if (inode_table[sub_inumber].parent != inumber) {
+        DirEntry *entry = &dir->entries[slot];
+
+        entry->inumber = copy;
+        inode_table[sub_inumber].links--;
+        inode_table[copy].links = 1;
+        inode_table[copy].parent = inumber;
+        mirror_remove(inumber, DIR_ENTRY_NAME(dir, entry), DIR_ENTRY_LENGTH(dir, entry), entry->hash);
+        mirror_add(inumber, DIR_ENTRY_NAME(dir, entry), DIR_ENTRY_LENGTH(dir, entry), entry->hash, copy);
+        return copy;
+    }
+
+    /* o i-node e desta tabela: as outras passam a ter o clone */
+    for (int i = 0; i < INODE_TABLE_SIZE; i++) {
+        Directory *other = inode_table[i].data.directory;
+        DirEntry *entry;
+
+        if (inode_table[i].nodeType != T_DIRECTORY || other == dir || other->capacity <= slot)
+            continue;
+        entry = &other->entries[slot];
+        if (entry->inumber == sub_inumber) {
+            entry->inumber = copy;
+            inode_table[sub_inumber].links--;
+            if (inode_table[copy].links++ == 0)
+                inode_table[copy].parent = i;
+        }
+        /* todos os i-nodes que usam a tabela, tambem os que ja tinham passado */
+        if (entry->inumber == copy) {
+            mirror_remove(i, DIR_ENTRY_NAME(other, entry), DIR_ENTRY_LENGTH(other, entry), entry->hash);
+            mirror_add(i, DIR_ENTRY_NAME(other, entry), DIR_ENTRY_LENGTH(other, entry), entry->hash, copy);
+        }
+    }
+    return sub_inumber;
+}
+
+
 /*
  * Resets an entry for a directory.
  * Input:
@@ -152,11 +676,31 @@ int dir_reset_entry(int inumber, int sub_inumber) {
         return FAIL;
     }
 
-    
-    for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (inode_table[inumber].data.dirEntries[i].inumber == sub_inumber) {
-            inode_table[inumber].data.dirEntries[i].inumber = FREE_INODE;
-            inode_table[inumber].data.dirEntries[i].name[0] = '\0';
+    Directory *dir = inode_table[inumber].data.directory;
+    if (dir->refs > 1) {
+        printf("inode_reset_entry: directory is shared, see dir_unshare\n");
+        return FAIL;
+    }
+    for (int i = 0; i < dir->capacity; i++) {
+        if (dir->entries[i].inumber == sub_inumber) {
+            DirTotals totals;
+
+            entry_totals(sub_inumber, &totals);
+            dir_account(inumber, &totals, -1);
+            /* o i-node pode continuar noutra tabela, que o partilhava */
+            if (inode_table[sub_inumber].parent == inumber)
+                inode_table[sub_inumber].parent = FREE_INODE;
+            inode_table[sub_inumber].links--;
+            mirror_remove(inumber, DIR_ENTRY_NAME(dir, &dir->entries[i]), DIR_ENTRY_LENGTH(dir, &dir->entries[i]),
+                          dir->entries[i].hash);
+            dir->entries[i].inumber = FREE_INODE;
+            dir->tags[i] = TAG_FREE;
+            dir->count--;
+            dir->names_free += DIR_ENTRY_LENGTH(dir, &dir->entries[i]) + 2;
+            /* o nome fica no filtro ate haver demasiados nomes removidos */
+            if (dir->filter && ++dir->filter_stale > FILTER_MAX_STALE(dir->count, dir->capacity))
+                dir_build_filter(dir);
+            inode_table[inumber].version = ++version_clock;
             return SUCCESS;
         }
     }
@@ -164,6 +708,74 @@ int dir_reset_entry(int inumber, int sub_inumber) {
 }
 
 
+/*
+ * Rewrites the name arena of a directory with the names of its entries
+ * only, dropping the names of removed entries.
+ * Input:
+ *  - dir: the directory
+ *  - size: size of the new arena, at least the size of the live names
+ * Returns: SUCCESS or FAIL
+ */
+static int dir_compact_names(Directory *dir, int size) {
+    char *names = malloc(size);
+    int used = 0;
+
+    if (names == NULL)
+        return FAIL;
+
+    for (int i = 0; i < dir->capacity; i++) {
+        DirEntry *entry = &dir->entries[i];
+        if (entry->inumber != FREE_INODE) {
+            int len = DIR_ENTRY_LENGTH(dir, entry) + 2;
+            memcpy(names + used, dir->names + entry->name, len);
+            entry->name = used;
+            used += len;
+        }
+    }
+    free(dir->names);
+    dir->names = names;
+    dir->names_used = used;
+    dir->names_free = 0;
+    dir->names_size = size;
+    return SUCCESS;
+}
+
+
+/*
+ * Stores a name in the name arena of a directory, compacting the arena if
+ * half of it holds names of removed entries and growing it if full.
+ * Input:
+ *  - dir: the directory
+ *  - name: the name, not necessarily terminated
+ *  - len: length of the name, less than MAX_FILE_NAME
+ * Returns: offset of the name in the arena or FAIL
+ */
+static int dir_intern_name(Directory *dir, const char *name, int len) {
+    int needed = len + 2;
+    int offset;
+
+    if (dir->names_used + needed > dir->names_size) {
+        int live = dir->names_used - dir->names_free;
+        int size = dir->names_size ? dir->names_size : 64;
+
+        /* keeps the size only if compacting frees at least half of the arena */
+        if (dir->names_size && dir->names_free < size / 2)
+            size *= 2;
+        while (size < live + needed)
+            size *= 2;
+        if (dir_compact_names(dir, size) == FAIL)
+            return FAIL;
+    }
+
+    offset = dir->names_used;
+    dir->names[offset] = len;
+    memcpy(dir->names + offset + 1, name, len);
+    dir->names[offset + 1 + len] = '\0';
+    dir->names_used += needed;
+    return offset;
+}
+
+
 /*
  * Adds an entry to the i-node directory data.
  * Input:
@@ -173,10 +785,30 @@ int dir_reset_entry(int inumber, int sub_inumber) {
  * Returns: SUCCESS or FAIL
  */
 int dir_add_entry(int inumber, int sub_inumber, char *sub_name) {
+    int len = strlen(sub_name);
+
+    return dir_add_component(inumber, sub_inumber, sub_name, len, name_hash(sub_name, len));
+}
+
+
+/*
+ * Adds an entry to the i-node directory data, given a name that is not
+ * terminated, such as a component of a parsed path.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - sub_inumber: identifier of the sub i-node entry
+ *  - sub_name: name of the sub i-node entry
+ *  - len: length of the name
+ *  - hash: name_hash of the name
+ * Returns: SUCCESS or FAIL
+ */
+int dir_add_component(int inumber, int sub_inumber, const char *sub_name, int len, uint32_t hash) {
+    DirTotals totals;
+
     /* Used for testing synchronization speedup */
     insert_delay(DELAY);
 
-    if ((inumber < 0) || (inumber > INODE_TABLE_SIZE) || (inode_table[inumber].nodeType == T_NONE)) {
+    if ((inumber < 0) || (inumber >= INODE_TABLE_SIZE) || (inode_table[inumber].nodeType == T_NONE)) {
         printf("inode_add_entry: invalid inumber\n");
         return FAIL;
     }
@@ -186,25 +818,156 @@ int dir_add_entry(int inumber, int sub_inumber, char *sub_name) {
         return FAIL;
     }
 
-    if ((sub_inumber < 0) || (sub_inumber > INODE_TABLE_SIZE) || (inode_table[sub_inumber].nodeType == T_NONE)) {
+    if ((sub_inumber < 0) || (sub_inumber >= INODE_TABLE_SIZE) || (inode_table[sub_inumber].nodeType == T_NONE)) {
         printf("inode_add_entry: invalid entry inumber\n");
         return FAIL;
     }
 
-    if (strlen(sub_name) == 0 ) {
+    if (len == 0 || len >= MAX_FILE_NAME) {
         printf("inode_add_entry: \
                entry name must be non-empty\n");
         return FAIL;
     }
     
-    for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (inode_table[inumber].data.dirEntries[i].inumber == FREE_INODE) {
-            inode_table[inumber].data.dirEntries[i].inumber = sub_inumber;
-            strcpy(inode_table[inumber].data.dirEntries[i].name, sub_name);
-            return SUCCESS;
+    Directory *dir = inode_table[inumber].data.directory;
+    if (dir->refs > 1) {
+        printf("inode_add_entry: directory is shared, see dir_unshare\n");
+        return FAIL;
+    }
+    int slot = dir_free_slot(dir);
+    if (slot == FAIL) {
+        return FAIL;
+    }
+    int name = dir_intern_name(dir, sub_name, len);
+    if (name == FAIL) {
+        return FAIL;
+    }
+    dir->entries[slot].inumber = sub_inumber;
+    dir->entries[slot].hash = hash;
+    dir->entries[slot].name = name;
+    dir->tags[slot] = TAG_OF_HASH(hash);
+    dir->count++;
+    if (dir->filter)
+        filter_add(dir->filter, dir->capacity, hash);
+    inode_table[inumber].version = ++version_clock;
+    entry_totals(sub_inumber, &totals);
+    dir_account(inumber, &totals, 1);
+    inode_table[sub_inumber].parent = inumber;
+    inode_table[sub_inumber].links++;
+    mirror_add(inumber, sub_name, len, hash, sub_inumber);
+    return SUCCESS;
+}
+
+
+/*
+ * Copies a page of entries from the i-node directory data.
+ * Entries never change slot while they exist, so a cursor (the slot where
+ * the next page starts) stays valid across concurrent inserts and deletes.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - cursor: slot where the page starts
+ *  - max: maximum number of entries to copy
+ *  - entries: array with room for max entries
+ *  - next_cursor: set to the slot where the next page starts, or
+ *    TECNICOFS_READDIR_END if there are no more entries
+ * Returns: number of entries copied or FAIL
+ */
+int dir_read_entries(int inumber, int cursor, int max, DirListEntry *entries, int *next_cursor) {
+    /* Used for testing synchronization speedup */
+    insert_delay(DELAY);
+
+    if ((inumber < 0) || (inumber >= INODE_TABLE_SIZE) || (inode_table[inumber].nodeType == T_NONE)) {
+        printf("dir_read_entries: invalid inumber\n");
+        return FAIL;
+    }
+
+    if (inode_table[inumber].nodeType != T_DIRECTORY) {
+        printf("dir_read_entries: can only read entries of directories\n");
+        return FAIL;
+    }
+
+    if (cursor < 0 || max < 1) {
+        printf("dir_read_entries: invalid cursor\n");
+        return FAIL;
+    }
+
+    Directory *dir = inode_table[inumber].data.directory;
+    int count = 0;
+    int i;
+    for (i = cursor; i < dir->capacity && count < max; i++) {
+        DirEntry *entry = &dir->entries[i];
+        if (entry->inumber != FREE_INODE) {
+            memcpy(entries[count].name, DIR_ENTRY_NAME(dir, entry), DIR_ENTRY_LENGTH(dir, entry) + 1);
+            entries[count].inumber = entry->inumber;
+            entries[count].nodeType = inode_table[entry->inumber].nodeType;
+            count++;
         }
     }
-    return FAIL;
+
+    /* skip trailing free slots so the caller knows when the listing is over */
+    while (i < dir->capacity && dir->entries[i].inumber == FREE_INODE)
+        i++;
+
+    *next_cursor = (i < dir->capacity) ? i : TECNICOFS_READDIR_END;
+    return count;
+}
+
+
+/*
+ * Gets the totals of the subtree below a directory, or of a file (itself
+ * and its bytes), in constant time once the batch of changes to the
+ * totals is added up. Can be called with the server lock held for
+ * reading only.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - totals: set to the totals
+ * Returns: SUCCESS or FAIL
+ */
+int inode_totals(int inumber, DirTotals *totals) {
+    if ((inumber < 0) || (inumber >= INODE_TABLE_SIZE) || (inode_table[inumber].nodeType == T_NONE)) {
+        printf("inode_totals: invalid inumber %d\n", inumber);
+        return FAIL;
+    }
+
+    if (inode_table[inumber].nodeType != T_DIRECTORY) {
+        entry_totals(inumber, totals);
+        return SUCCESS;
+    }
+    dir_flush_totals();
+    pthread_mutex_lock(&totals_lock);
+    *totals = inode_table[inumber].data.directory->totals;
+    pthread_mutex_unlock(&totals_lock);
+    return SUCCESS;
+}
+
+
+/*
+ * Adds up the memory used by the i-nodes in use: the i-node itself and,
+ * for directories, the tags, the entries, the allocated name arena and
+ * the filter.
+ * Input:
+ *  - inodes: if not NULL, set to the number of i-nodes in use
+ * Returns: number of bytes
+ */
+size_t inode_table_bytes(int *inodes) {
+    size_t bytes = 0;
+    int count = 0;
+
+    for (int i = 0; i < INODE_TABLE_SIZE; i++) {
+        if (inode_table[i].nodeType == T_NONE)
+            continue;
+        count++;
+        bytes += sizeof(inode_t);
+        if (inode_table[i].nodeType == T_DIRECTORY) {
+            Directory *dir = inode_table[i].data.directory;
+            /* uma tabela partilhada conta uma vez, dividida pelos i-nodes */
+            bytes += (sizeof(Directory) + dir->capacity * (1 + sizeof(DirEntry)) + dir->names_size +
+                      (dir->filter ? FILTER_WORDS(dir->capacity) * sizeof(uint64_t) : 0)) / dir->refs;
+        }
+    }
+    if (inodes)
+        *inodes = count;
+    return bytes;
 }
 
 
@@ -222,15 +985,209 @@ void inode_print_tree(FILE *fp, int inumber, char *name) {
 
     if (inode_table[inumber].nodeType == T_DIRECTORY) {
         fprintf(fp, "%s\n", name);
-        for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-            if (inode_table[inumber].data.dirEntries[i].inumber != FREE_INODE) {
+        Directory *dir = inode_table[inumber].data.directory;
+        for (int i = 0; i < dir->capacity; i++) {
+            if (dir->entries[i].inumber != FREE_INODE) {
+                char path[MAX_FILE_NAME];
+                if (snprintf(path, sizeof(path), "%s/%s", name, DIR_ENTRY_NAME(dir, &dir->entries[i])) > sizeof(path)) {
+                    fprintf(stderr, "truncation when building full path\n");
+                }
+                inode_print_tree(fp, dir->entries[i].inumber, path);
+            }
+        }
+    }
+}
+
+
+
+/*
+ * Writes file contents on a single line, escaping '\\' and newlines.
+ */
+static void export_contents(FILE *fp, char *contents) {
+    for (char *c = contents; *c != '\0'; c++) {
+        if (*c == '\\')
+            fputs("\\\\", fp);
+        else if (*c == '\n')
+            fputs("\\n", fp);
+        else
+            fputc(*c, fp);
+    }
+}
+
+
+/*
+ * Exports a subtree, one "<f|d> <path>" line per i-node in preorder, so
+ * every directory comes before the entries it contains. A file with
+ * contents has them after its path, escaped by export_contents.
+ * Input:
+ *  - fp: pointer to output file
+ *  - inumber: identifier of the i-node at the root of the subtree
+ *  - name: path given to the root of the subtree
+ */
+void inode_export_tree(FILE *fp, int inumber, char *name) {
+    if (inode_table[inumber].nodeType == T_FILE) {
+        char *contents = inode_table[inumber].data.fileContents;
+
+        fprintf(fp, "f %s", name);
+        if (contents != NULL && contents[0] != '\0') {
+            fputc(' ', fp);
+            export_contents(fp, contents);
+        }
+        fputc('\n', fp);
+        return;
+    }
+
+    if (inode_table[inumber].nodeType == T_DIRECTORY) {
+        fprintf(fp, "d %s\n", name);
+        Directory *dir = inode_table[inumber].data.directory;
+        for (int i = 0; i < dir->capacity; i++) {
+            if (dir->entries[i].inumber != FREE_INODE) {
                 char path[MAX_FILE_NAME];
-                if (snprintf(path, sizeof(path), "%s/%s", name, inode_table[inumber].data.dirEntries[i].name) > sizeof(path)) {
+                if (snprintf(path, sizeof(path), "%s/%s", name, DIR_ENTRY_NAME(dir, &dir->entries[i])) >= sizeof(path)) {
                     fprintf(stderr, "truncation when building full path\n");
                 }
-                inode_print_tree(fp, inode_table[inumber].data.dirEntries[i].inumber, path);
+                inode_export_tree(fp, dir->entries[i].inumber, path);
+            }
+        }
+    }
+}
+
+
+/*
+ * Saves the i-nodes in use, by i-number, with the slots and the name arena
+ * of each directory copied as they are, so loading them is a copy too.
+ * A table shared with an i-node saved before is saved as its i-number.
+ * The parent of each i-node is saved too, as the i-nodes of the entries
+ * a snapshot or clone shares keep the side of their parent.
+ * Input:
+ *  - fp: pointer to output stream
+ * Returns: SUCCESS or FAIL
+ */
+int inode_table_save(FILE *fp) {
+    int end[5] = { FREE_INODE, T_NONE, 0, FREE_INODE, FREE_INODE };
+
+    /* as tabelas vao com os totais ja somados */
+    dir_flush_totals();
+
+    for (int i = 0; i < INODE_TABLE_SIZE; i++) {
+        int header[5] = { i, inode_table[i].nodeType, inode_table[i].readonly, FREE_INODE, inode_table[i].parent };
+
+        if (inode_table[i].nodeType == T_NONE)
+            continue;
+        if (inode_table[i].nodeType == T_DIRECTORY && inode_table[i].data.directory->refs > 1) {
+            for (int j = 0; j < i && header[3] == FREE_INODE; j++) {
+                if (inode_table[j].nodeType == T_DIRECTORY &&
+                    inode_table[j].data.directory == inode_table[i].data.directory)
+                    header[3] = j;
             }
         }
+        if (fwrite(header, sizeof(header), 1, fp) != 1 ||
+            fwrite(&inode_table[i].version, sizeof(unsigned long), 1, fp) != 1)
+            return FAIL;
+        if (header[3] != FREE_INODE)
+            continue;
+
+        if (inode_table[i].nodeType == T_FILE) {
+            char *contents = inode_table[i].data.fileContents;
+            int len = contents ? strlen(contents) : -1;
+            if (fwrite(&len, sizeof(len), 1, fp) != 1 || (len > 0 && fwrite(contents, 1, len, fp) != len))
+                return FAIL;
+        }
+        else {
+            Directory *dir = inode_table[i].data.directory;
+            if (fwrite(dir, sizeof(Directory), 1, fp) != 1 ||
+                fwrite(dir->tags, 1, dir->capacity, fp) != dir->capacity ||
+                fwrite(dir->entries, sizeof(DirEntry), dir->capacity, fp) != dir->capacity ||
+                fwrite(dir->names, 1, dir->names_size, fp) != dir->names_size)
+                return FAIL;
+        }
     }
+    return fwrite(end, sizeof(end), 1, fp) == 1 ? SUCCESS : FAIL;
 }
 
+
+/*
+ * Loads the i-nodes saved by inode_table_save into an empty table.
+ * Input:
+ *  - fp: pointer to input stream
+ * Returns: SUCCESS or FAIL
+ */
+int inode_table_load(FILE *fp) {
+    int header[5];
+
+    while (fread(header, sizeof(header), 1, fp) == 1) {
+        int inumber = header[0], shared = header[3];
+
+        if (inumber == FREE_INODE)
+            return SUCCESS;
+        if (inumber < 0 || inumber >= INODE_TABLE_SIZE || inode_table[inumber].nodeType != T_NONE ||
+            header[4] < FREE_INODE || header[4] >= INODE_TABLE_SIZE)
+            return FAIL;
+        inode_table[inumber].readonly = header[2];
+        inode_table[inumber].parent = header[4];
+        if (fread(&inode_table[inumber].version, sizeof(unsigned long), 1, fp) != 1)
+            return FAIL;
+        /* as versions seguintes continuam depois das que foram lidas */
+        if (inode_table[inumber].version > version_clock)
+            version_clock = inode_table[inumber].version;
+
+        if (header[1] == T_DIRECTORY && shared != FREE_INODE) {
+            /* a tabela foi lida com o i-node que a partilha, antes deste */
+            if (shared < 0 || shared >= inumber || inode_table[shared].nodeType != T_DIRECTORY)
+                return FAIL;
+            inode_table[inumber].data.directory = inode_table[shared].data.directory;
+            inode_table[inumber].nodeType = T_DIRECTORY;
+        }
+        else if (header[1] == T_FILE) {
+            char *contents = NULL;
+            int len;
+
+            if (fread(&len, sizeof(len), 1, fp) != 1)
+                return FAIL;
+            if (len >= 0) {
+                if ((contents = malloc(len + 1)) == NULL || fread(contents, 1, len, fp) != len) {
+                    free(contents);
+                    return FAIL;
+                }
+                contents[len] = '\0';
+            }
+            inode_table[inumber].data.fileContents = contents;
+            inode_table[inumber].nodeType = T_FILE;
+        }
+        else if (header[1] == T_DIRECTORY) {
+            Directory *dir = malloc(sizeof(Directory));
+
+            if (dir == NULL || fread(dir, sizeof(Directory), 1, fp) != 1 ||
+                dir->capacity <= 0 || dir->capacity > MAX_DIR_ENTRIES || dir->names_size < 0) {
+                free(dir);
+                return FAIL;
+            }
+            /* o filtro nao e guardado, e refeito a partir das entradas */
+            dir->filter = NULL;
+            dir->tags = malloc(dir->capacity);
+            dir->entries = malloc(sizeof(DirEntry) * dir->capacity);
+            dir->names = dir->names_size ? malloc(dir->names_size) : NULL;
+            /* fica na tabela ja, para ser libertada se a leitura falhar */
+            inode_table[inumber].data.directory = dir;
+            inode_table[inumber].nodeType = T_DIRECTORY;
+            if (dir->tags == NULL || dir->entries == NULL || (dir->names_size && dir->names == NULL) ||
+                fread(dir->tags, 1, dir->capacity, fp) != dir->capacity ||
+                fread(dir->entries, sizeof(DirEntry), dir->capacity, fp) != dir->capacity ||
+                fread(dir->names, 1, dir->names_size, fp) != dir->names_size)
+                return FAIL;
+            dir_build_filter(dir);
+            /* cada tabela e lida uma vez, mesmo que partilhada */
+            for (int i = 0; i < dir->capacity; i++) {
+                int sub_inumber = dir->entries[i].inumber;
+                if (sub_inumber != FREE_INODE) {
+                    if (sub_inumber < 0 || sub_inumber >= INODE_TABLE_SIZE)
+                        return FAIL;
+                    inode_table[sub_inumber].links++;
+                }
+            }
+        }
+        else
+            return FAIL;
+    }
+    return FAIL;
+}
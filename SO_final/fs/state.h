@@ -3,36 +3,101 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <pthread.h>
 #include "../tecnicofs-api-constants.h"
+#include "tags.h"
+#include "filter.h"
 
 /* FS root inode number */
 #define FS_ROOT 0
 
 #define FREE_INODE -1
-#define INODE_TABLE_SIZE 50
-#define MAX_DIR_ENTRIES 20
+#define INODE_TABLE_SIZE 4096
+/* Directories start with one group of slots and double up to this many */
+#define MAX_DIR_ENTRIES 4096
+/* Most components a path can have, as each takes at least 2 characters */
+#define MAX_PATH_DEPTH (MAX_FILE_NAME / 2)
+/* Directories whose totals changed before the changes go up the tree */
+#define DIR_TOTALS_BATCH 256
 
 #define SUCCESS 0
 #define FAIL -1
 
+/* Spin loop in every i-node call, build with -DDELAY=0 to compile it out */
+#ifndef DELAY
 #define DELAY 5000
+#endif
 
 
 /*
- * Contains the name of the entry and respective i-number
+ * Contains the hash of the name of the entry (see name_hash), where the
+ * name is in the name arena of the directory and respective i-number
  */
 typedef struct dirEntry {
-	char name[MAX_FILE_NAME];
+	uint32_t hash;
+	uint32_t name;
 	int inumber;
 } DirEntry;
 
 /*
- * Data is either text (file) or entries (DirEntry)
+ * Files, directories and bytes of the files in a subtree
+ */
+typedef struct dirTotals {
+	long files;
+	long dirs;
+	long bytes;
+} DirTotals;
+
+/*
+ * Entries of a directory, with the tag of each slot (see tags.h), and the
+ * arena with their names, each stored once as a length byte, the
+ * characters and a '\0'. The names of removed entries are reclaimed when
+ * the arena is compacted. The capacity is a multiple of TAG_GROUP_SIZE.
+ * A clone or snapshot shares the table of the directory it was made from
+ * (refs counts the i-nodes that use it) until one of them changes, see
+ * dir_unshare.
+ * The totals of the subtree below the directory are kept up to date with
+ * every change to its own entries; pending is the part of them that the
+ * directories above have yet to add, see dir_flush_totals.
+ * Large directories also have a filter of the names of their entries (see
+ * filter.h) that still has the names of filter_stale removed entries.
+ */
+typedef struct directory {
+	uint8_t *tags;
+	DirEntry *entries;
+	int capacity;
+	int count;
+	char *names;
+	int names_used;
+	int names_free;
+	int names_size;
+	int refs;
+	DirTotals totals;
+	DirTotals pending;
+	int dirty;
+	uint64_t *filter;
+	int filter_stale;
+} Directory;
+
+#define DIR_ENTRY_NAME(dir, entry) ((dir)->names + (entry)->name + 1)
+#define DIR_ENTRY_LENGTH(dir, entry) ((unsigned char) (dir)->names[(entry)->name])
+
+/*
+ * Copy of a directory entry, as listed by dir_read_entries
+ */
+typedef struct dirListEntry {
+	char name[MAX_FILE_NAME];
+	int inumber;
+	type nodeType;
+} DirListEntry;
+
+/*
+ * Data is either text (file) or a directory
  */
 union Data {
 	char *fileContents; /* for files */
-	DirEntry *dirEntries; /* for directories */
+	Directory *directory; /* for directories */
 };
 
 /*
@@ -41,20 +106,43 @@ union Data {
 typedef struct inode_t {    
 	type nodeType;
 	union Data data;
+	int readonly; /* root of a snapshot */
+	unsigned long version; /* changes whenever the contents change */
+	int parent; /* directory whose table has the entry of the i-node, or FREE_INODE */
+	int links; /* tables with an entry for the i-node, see dir_unshare */
 	pthread_rwlock_t lock;
     /* more i-node attributes will be added in future exercises */
 } inode_t;
 
+/*
+ * Receives each i-node freed along with the directory that had its entry
+ */
+typedef void (*inode_free_handler)(int dir_inumber, const char *name, int len, int inumber);
+
 
 void insert_delay(int cycles);
 void inode_table_init();
 void inode_table_destroy();
+void inode_set_free_handler(inode_free_handler handler);
 int inode_create(type nType);
 int inode_delete(int inumber);
 int inode_get(int inumber, type *nType, union Data *data);
 int inode_set_file(int inumber, char *fileContents, int len);
+int inode_clone(int inumber, int readonly);
+int inode_is_readonly(int inumber);
+unsigned long inode_version(int inumber);
+int dir_unshare(int inumber);
+int dir_unshare_entry(int inumber, int sub_inumber);
 int dir_reset_entry(int inumber, int sub_inumber);
 int dir_add_entry(int inumber, int sub_inumber, char *sub_name);
+int dir_add_component(int inumber, int sub_inumber, const char *sub_name, int len, uint32_t hash);
+int dir_read_entries(int inumber, int cursor, int max, DirListEntry *entries, int *next_cursor);
+void dir_flush_totals();
+int inode_totals(int inumber, DirTotals *totals);
+size_t inode_table_bytes(int *inodes);
 void inode_print_tree(FILE *fp, int inumber, char *name);
+void inode_export_tree(FILE *fp, int inumber, char *name);
+int inode_table_save(FILE *fp);
+int inode_table_load(FILE *fp);
 
 #endif /* INODES_H */
@@ -0,0 +1,99 @@
+#include <string.h>
+#include "tags.h"
+#include "state.h"
+#if (defined(__x86_64__) || defined(__i386__)) && !defined(TAG_SCAN_SCALAR)
+#include <immintrin.h>
+#define HAVE_TAG_SCAN_SIMD 1
+#endif
+
+tag_match_fn tag_match;
+static const char *tag_match_name;
+
+
+/*
+ * Compares 8 tags per step in a 64-bit word: the bytes equal to the tag
+ * become zero and the high bit of each zero byte is gathered into the mask.
+ */
+static uint32_t tag_match_scalar(const uint8_t *group, uint8_t tag) {
+	uint32_t mask = 0;
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	for (int i = 0; i < TAG_GROUP_SIZE; i += 8) {
+		uint64_t word, zeros;
+
+		memcpy(&word, group + i, sizeof(word));
+		word ^= 0x0101010101010101ULL * tag;
+		zeros = ~(((word & 0x7f7f7f7f7f7f7f7fULL) + 0x7f7f7f7f7f7f7f7fULL) | word) & 0x8080808080808080ULL;
+		mask |= (uint32_t) (((zeros >> 7) * 0x0102040810204080ULL) >> 56) << i;
+	}
+#else
+	for (int i = 0; i < TAG_GROUP_SIZE; i++)
+		mask |= (uint32_t) (group[i] == tag) << i;
+#endif
+	return mask;
+}
+
+#ifdef HAVE_TAG_SCAN_SIMD
+__attribute__((target("sse2")))
+static uint32_t tag_match_sse2(const uint8_t *group, uint8_t tag) {
+	__m128i needle = _mm_set1_epi8(tag);
+	uint32_t low = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) group), needle));
+	uint32_t high = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (group + 16)), needle));
+
+	return low | high << 16;
+}
+
+__attribute__((target("avx2")))
+static uint32_t tag_match_avx2(const uint8_t *group, uint8_t tag) {
+	__m256i needle = _mm256_set1_epi8(tag);
+
+	return _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) group), needle));
+}
+#endif
+
+
+/*
+ * Chooses how tag groups are compared.
+ * Input:
+ *  - name: "avx2", "sse2" or "scalar"
+ * Returns: SUCCESS or FAIL if not supported by this build or CPU
+ */
+int tag_scan_select(const char *name) {
+	if (strcmp(name, "scalar") == 0) {
+		tag_match = tag_match_scalar;
+		tag_match_name = "scalar";
+		return SUCCESS;
+	}
+#ifdef HAVE_TAG_SCAN_SIMD
+	__builtin_cpu_init();
+	if (strcmp(name, "sse2") == 0 && __builtin_cpu_supports("sse2")) {
+		tag_match = tag_match_sse2;
+		tag_match_name = "sse2";
+		return SUCCESS;
+	}
+	if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2")) {
+		tag_match = tag_match_avx2;
+		tag_match_name = "avx2";
+		return SUCCESS;
+	}
+#endif
+	return FAIL;
+}
+
+
+/*
+ * Chooses the widest comparison the CPU supports, unless one was already
+ * chosen with tag_scan_select.
+ */
+void tag_scan_init() {
+	if (tag_match == NULL && tag_scan_select("avx2") == FAIL && tag_scan_select("sse2") == FAIL)
+		tag_scan_select("scalar");
+}
+
+
+/*
+ * Returns: the name of the comparison in use
+ */
+const char *tag_scan_name() {
+	return tag_match_name;
+}
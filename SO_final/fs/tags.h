@@ -0,0 +1,27 @@
+#ifndef TAGS_H
+#define TAGS_H
+
+#include <stdint.h>
+
+/*
+ * Directories keep a control array with one tag per slot: 7 bits of the
+ * hash of the name of the entry, or TAG_FREE for free slots. Tags are
+ * compared a group at a time and only the entries whose tag matches have
+ * their names compared. The group is compared with AVX2, SSE2 or plain C,
+ * chosen at run time from what the CPU supports (build with
+ * -DTAG_SCAN_SCALAR to only have plain C).
+ */
+#define TAG_FREE 0x80
+#define TAG_GROUP_SIZE 32
+#define TAG_OF_HASH(hash) ((uint8_t) ((hash) >> 25))
+
+/* Bit i of the result is set if group[i] == tag */
+typedef uint32_t (*tag_match_fn)(const uint8_t *group, uint8_t tag);
+
+extern tag_match_fn tag_match;
+
+void tag_scan_init();
+int tag_scan_select(const char *name);
+const char *tag_scan_name();
+
+#endif /* TAGS_H */
@@ -0,0 +1,165 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "fs/operations.h"
+#include "shard.h"
+#include "lease.h"
+#include "openfile.h"
+#include "watch.h"
+#include "replycache.h"
+#include "handoff.h"
+
+/* pending connections of the control socket */
+#define HANDOFF_BACKLOG 1
+
+
+/*
+ * Builds the address of the control socket of a server.
+ * Returns: its length, or 0 if the path is too long
+ */
+static socklen_t control_addr(char *server_path, struct sockaddr_un *addr) {
+	memset(addr, 0, sizeof(struct sockaddr_un));
+	addr->sun_family = AF_UNIX;
+	if (snprintf(addr->sun_path, sizeof(addr->sun_path), "%s%s", server_path, HANDOFF_SUFFIX) >=
+	    sizeof(addr->sun_path))
+		return 0;
+	return SUN_LEN(addr);
+}
+
+
+/*
+ * Creates the control socket a new process connects to for the handoff.
+ * Input:
+ *  - server_path: path of the server socket
+ * Returns: the listening socket, or FAIL
+ */
+int handoff_listen(char *server_path) {
+	struct sockaddr_un addr;
+	socklen_t len = control_addr(server_path, &addr);
+	int fd;
+
+	if (len == 0 || (fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		return FAIL;
+	unlink(addr.sun_path);
+	if (bind(fd, (struct sockaddr *) &addr, len) < 0 || listen(fd, HANDOFF_BACKLOG) < 0) {
+		close(fd);
+		return FAIL;
+	}
+	return fd;
+}
+
+
+void handoff_unlink(char *server_path) {
+	struct sockaddr_un addr;
+
+	if (control_addr(server_path, &addr) != 0)
+		unlink(addr.sun_path);
+}
+
+
+/*
+ * Connects to the control socket of the server running at server_path.
+ * Returns: the connection, or FAIL
+ */
+int handoff_connect(char *server_path) {
+	struct sockaddr_un addr;
+	socklen_t len = control_addr(server_path, &addr);
+	int fd;
+
+	if (len == 0 || (fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		return FAIL;
+	if (connect(fd, (struct sockaddr *) &addr, len) < 0) {
+		close(fd);
+		return FAIL;
+	}
+	return fd;
+}
+
+
+/*
+ * Sends the server socket over the control connection.
+ * Returns: SUCCESS or FAIL
+ */
+int handoff_send_socket(int conn, int sockfd) {
+	char byte = 0;
+	struct iovec iov = { &byte, 1 };
+	union {
+		struct cmsghdr header;
+		char buffer[CMSG_SPACE(sizeof(int))];
+	} control;
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1,
+	                      .msg_control = control.buffer, .msg_controllen = sizeof(control.buffer) };
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &sockfd, sizeof(int));
+
+	return sendmsg(conn, &msg, 0) == 1 ? SUCCESS : FAIL;
+}
+
+
+/*
+ * Receives the server socket sent by handoff_send_socket.
+ * Returns: the socket, or FAIL
+ */
+int handoff_receive_socket(int conn) {
+	char byte;
+	struct iovec iov = { &byte, 1 };
+	union {
+		struct cmsghdr header;
+		char buffer[CMSG_SPACE(sizeof(int))];
+	} control;
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1,
+	                      .msg_control = control.buffer, .msg_controllen = sizeof(control.buffer) };
+	struct cmsghdr *cmsg;
+	int sockfd;
+
+	if (recvmsg(conn, &msg, 0) != 1 || (cmsg = CMSG_FIRSTHDR(&msg)) == NULL ||
+	    cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+		return FAIL;
+	memcpy(&sockfd, CMSG_DATA(cmsg), sizeof(int));
+	return sockfd;
+}
+
+
+/*
+ * Saves the whole state of the server: the i-nodes, the open files, the
+ * watches, the leases, the prepared cross-shard moves and the reply cache.
+ * Must be called with the server lock held and no request being applied.
+ * Returns: SUCCESS or FAIL
+ */
+int handoff_save(FILE *fp) {
+	uint32_t version = HANDOFF_VERSION;
+
+	if (fwrite(HANDOFF_MAGIC, 8, 1, fp) != 1 || fwrite(&version, sizeof(version), 1, fp) != 1)
+		return FAIL;
+	if (save_fs(fp) == FAIL || openfile_save(fp) == FAIL || watch_save(fp) == FAIL ||
+	    lease_save(fp) == FAIL || shard_save(fp) == FAIL || reply_cache_save(fp) == FAIL)
+		return FAIL;
+	return fflush(fp) == 0 ? SUCCESS : FAIL;
+}
+
+
+/*
+ * Loads the state saved by handoff_save, instead of initializing an empty
+ * file system.
+ * Returns: SUCCESS or FAIL
+ */
+int handoff_load(FILE *fp) {
+	char magic[8];
+	uint32_t version;
+
+	if (fread(magic, sizeof(magic), 1, fp) != 1 || memcmp(magic, HANDOFF_MAGIC, sizeof(magic)) != 0 ||
+	    fread(&version, sizeof(version), 1, fp) != 1 || version != HANDOFF_VERSION)
+		return FAIL;
+	if (load_fs(fp) == FAIL || openfile_load(fp) == FAIL || watch_load(fp) == FAIL ||
+	    lease_load(fp) == FAIL || shard_load(fp) == FAIL || reply_cache_load(fp) == FAIL)
+		return FAIL;
+	return SUCCESS;
+}
@@ -0,0 +1,27 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <stdio.h>
+
+/*
+ * Handoff of a running server to a new process (tecnicofs -u), without
+ * losing its state or the requests sent meanwhile. The new process
+ * connects to the control socket of the old one ("<socket>.ctl"); the old
+ * one stops taking requests, lets the ones being applied finish and sends
+ * the server socket (as SCM_RIGHTS) followed by its state. Requests that
+ * arrive in between wait in the server socket for the new process.
+ */
+
+#define HANDOFF_SUFFIX ".ctl"
+#define HANDOFF_MAGIC "TFSSTATE"
+#define HANDOFF_VERSION 6
+
+int handoff_listen(char *server_path);
+void handoff_unlink(char *server_path);
+int handoff_connect(char *server_path);
+int handoff_send_socket(int conn, int sockfd);
+int handoff_receive_socket(int conn);
+int handoff_save(FILE *fp);
+int handoff_load(FILE *fp);
+
+#endif /* HANDOFF_H */
@@ -0,0 +1,246 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "fs/operations.h"
+#include "lease.h"
+
+/*
+ * A client holding a lease on an i-node, until expiry.
+ */
+typedef struct lease_holder {
+	struct sockaddr_un client;
+	struct timespec expiry;
+	struct lease_holder *next;
+} lease_holder;
+
+/*
+ * An invalidation to send once the server lock is released.
+ */
+typedef struct lease_notice {
+	int inumber;
+	lease_holder *holder;
+	struct lease_notice *next;
+} lease_notice;
+
+static lease_holder *holders[INODE_TABLE_SIZE];
+static pthread_mutex_t holders_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Invalidations revoked by the request this thread is applying */
+static __thread lease_notice *notices;
+
+
+static int expired(struct timespec *expiry, struct timespec *now) {
+	return expiry->tv_sec < now->tv_sec ||
+	       (expiry->tv_sec == now->tv_sec && expiry->tv_nsec <= now->tv_nsec);
+}
+
+
+/*
+ * Grants a lease to a client on every i-node of a path.
+ * Input:
+ *  - client: socket path of the client
+ *  - inumbers: i-nodes of the path below the root (see lookup_path)
+ *  - n: number of i-nodes
+ * Returns: duration of the lease in milliseconds, 0 if it was not granted
+ */
+int lease_grant(char *client, int *inumbers, int n) {
+	struct timespec expiry;
+	int duration = LEASE_DURATION_MS;
+
+	clock_gettime(CLOCK_MONOTONIC, &expiry);
+	expiry.tv_sec += LEASE_DURATION_MS / 1000;
+	expiry.tv_nsec += (LEASE_DURATION_MS % 1000) * 1000000L;
+	if (expiry.tv_nsec >= 1000000000L) {
+		expiry.tv_sec++;
+		expiry.tv_nsec -= 1000000000L;
+	}
+
+	pthread_mutex_lock(&holders_lock);
+	for (int i = 0; i < n; i++) {
+		lease_holder *holder;
+
+		for (holder = holders[inumbers[i]]; holder != NULL; holder = holder->next) {
+			if (strcmp(holder->client.sun_path, client) == 0)
+				break;
+		}
+		if (holder == NULL) {
+			/* a client that cannot be told must not cache the lookup */
+			if ((holder = malloc(sizeof(lease_holder))) == NULL) {
+				duration = 0;
+				break;
+			}
+			bzero(&holder->client, sizeof(holder->client));
+			holder->client.sun_family = AF_UNIX;
+			strncpy(holder->client.sun_path, client, sizeof(holder->client.sun_path) - 1);
+			holder->next = holders[inumbers[i]];
+			holders[inumbers[i]] = holder;
+		}
+		holder->expiry = expiry;
+	}
+	pthread_mutex_unlock(&holders_lock);
+	return duration;
+}
+
+
+/*
+ * Revokes every lease on an i-node that is about to be deleted or moved.
+ * The holders are sent an invalidation by the next lease_flush of this
+ * thread.
+ * Input:
+ *  - sockfd: server socket
+ *  - inumber: identifier of the i-node
+ */
+void lease_revoke(int sockfd, int inumber) {
+	lease_holder *list;
+	struct timespec now;
+
+	if (inumber < 0 || inumber >= INODE_TABLE_SIZE)
+		return;
+
+	pthread_mutex_lock(&holders_lock);
+	list = holders[inumber];
+	holders[inumber] = NULL;
+	pthread_mutex_unlock(&holders_lock);
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	while (list != NULL) {
+		lease_holder *holder = list;
+		lease_notice *notice;
+		list = holder->next;
+
+		if (expired(&holder->expiry, &now) || (notice = malloc(sizeof(lease_notice))) == NULL) {
+			free(holder);
+			continue;
+		}
+		notice->inumber = inumber;
+		notice->holder = holder;
+		notice->next = notices;
+		notices = notice;
+	}
+}
+
+
+/*
+ * Sends the invalidations revoked by this thread. Must be called without
+ * the server lock, before the request that revoked them is answered.
+ * Holders are sent an invalidation ("!") without blocking; a holder whose
+ * socket is full cannot be told, so this waits for its lease to expire.
+ * Input:
+ *  - sockfd: server socket
+ */
+void lease_flush(int sockfd) {
+	while (notices != NULL) {
+		lease_notice *notice = notices;
+		lease_holder *holder = notice->holder;
+		char message[16];
+		int len = sprintf(message, "! %d", notice->inumber);
+		notices = notice->next;
+
+		if (sendto(sockfd, message, len + 1, MSG_DONTWAIT, (struct sockaddr *) &holder->client,
+		           sizeof(struct sockaddr_un)) < 0 &&
+		    (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			printf("Lease: waiting for %s to expire\n", holder->client.sun_path);
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &holder->expiry, NULL);
+		}
+		free(holder);
+		free(notice);
+	}
+}
+
+
+/*
+ * Drops the leases on an i-node freed along with a deleted directory,
+ * without telling the holders: their lookups went through the directory,
+ * whose leases were revoked.
+ * Input:
+ *  - inumber: identifier of the i-node
+ */
+void lease_forget(int inumber) {
+	lease_holder *list;
+
+	if (inumber < 0 || inumber >= INODE_TABLE_SIZE)
+		return;
+
+	pthread_mutex_lock(&holders_lock);
+	list = holders[inumber];
+	holders[inumber] = NULL;
+	pthread_mutex_unlock(&holders_lock);
+
+	while (list != NULL) {
+		lease_holder *holder = list;
+		list = holder->next;
+		free(holder);
+	}
+}
+
+
+/*
+ * Revokes the leases on the node of a path, if it exists.
+ */
+void lease_revoke_path(int sockfd, char *path) {
+	int inumber = lookup(path);
+
+	if (inumber != FAIL && inumber != FS_ROOT)
+		lease_revoke(sockfd, inumber);
+}
+
+
+/*
+ * Saves the leases that have not expired, to be loaded by another server
+ * process. Their expiry is on the monotonic clock, which is the same for
+ * every process.
+ * Returns: SUCCESS or FAIL
+ */
+int lease_save(FILE *fp) {
+	struct timespec now;
+	int end = FREE_INODE;
+
+	int res = SUCCESS;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	pthread_mutex_lock(&holders_lock);
+	for (int inumber = 0; inumber < INODE_TABLE_SIZE && res == SUCCESS; inumber++) {
+		for (lease_holder *holder = holders[inumber]; holder != NULL; holder = holder->next) {
+			if (expired(&holder->expiry, &now))
+				continue;
+			if (fwrite(&inumber, sizeof(inumber), 1, fp) != 1 || fwrite(holder, sizeof(lease_holder), 1, fp) != 1) {
+				res = FAIL;
+				break;
+			}
+		}
+	}
+	pthread_mutex_unlock(&holders_lock);
+	if (res == FAIL)
+		return FAIL;
+	return fwrite(&end, sizeof(end), 1, fp) == 1 ? SUCCESS : FAIL;
+}
+
+
+/*
+ * Loads the leases saved by lease_save.
+ * Returns: SUCCESS or FAIL
+ */
+int lease_load(FILE *fp) {
+	int inumber;
+
+	while (fread(&inumber, sizeof(inumber), 1, fp) == 1) {
+		lease_holder *holder;
+
+		if (inumber == FREE_INODE)
+			return SUCCESS;
+		if (inumber < 0 || inumber >= INODE_TABLE_SIZE || (holder = malloc(sizeof(lease_holder))) == NULL)
+			return FAIL;
+		if (fread(holder, sizeof(lease_holder), 1, fp) != 1) {
+			free(holder);
+			return FAIL;
+		}
+		holder->next = holders[inumber];
+		holders[inumber] = holder;
+	}
+	return FAIL;
+}
@@ -0,0 +1,26 @@
+#ifndef LEASE_H
+#define LEASE_H
+
+#include <stdio.h>
+
+/*
+ * Lookup leases: a client may cache a lookup result until its lease
+ * expires. Before a node is deleted or moved, every client holding a lease
+ * on it (or on a directory of its path) is sent an invalidation.
+ * The holders have a lock of their own: grants only need the server read
+ * lock, and revokes need the write lock. The invalidations are sent by
+ * lease_flush, once the server lock is released.
+ */
+
+/* How long a client may cache a lookup without asking again */
+#define LEASE_DURATION_MS 500
+
+int lease_grant(char *client, int *inumbers, int n);
+void lease_revoke(int sockfd, int inumber);
+void lease_revoke_path(int sockfd, char *path);
+void lease_forget(int inumber);
+void lease_flush(int sockfd);
+int lease_save(FILE *fp);
+int lease_load(FILE *fp);
+
+#endif /* LEASE_H */
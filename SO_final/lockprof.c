@@ -0,0 +1,486 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include "fs/state.h"
+#include "lockprof.h"
+
+/*
+ * Totals of a site, updated without a lock.
+ */
+typedef struct lockprof_stats {
+	unsigned long acquisitions;
+	unsigned long contended;
+	unsigned long wait_ns;
+	unsigned long wait_max_ns;
+	unsigned long hold_ns;
+	unsigned long hold_max_ns;
+} lockprof_stats;
+
+typedef struct lockprof_event {
+	int site;
+	int inumber;
+	uint64_t wait_ns; /* when it started waiting, since lockprof_open */
+	uint64_t acquired_ns;
+	uint64_t released_ns;
+} lockprof_event;
+
+/*
+ * The acquisitions recorded by a thread. Only that thread adds to it, the
+ * lock is for lockprof_close.
+ */
+typedef struct lockprof_thread {
+	pthread_mutex_t lock;
+	int id;
+	int in_use;
+	int count;
+	int size;
+	unsigned long dropped;
+	lockprof_event *events;
+} lockprof_thread;
+
+/* A lock held by the calling thread */
+typedef struct lockprof_held {
+	void *lock;
+	int site;
+	int inumber;
+	uint64_t wait_ns;
+	uint64_t acquired_ns;
+} lockprof_held;
+
+static int enabled;
+static char *trace_path;
+static struct timespec start;
+static char site_names[LOCKPROF_MAX_SITES][32] = { "other" };
+static int num_sites = 1;
+static lockprof_stats sites[LOCKPROF_MAX_SITES];
+static lockprof_stats inodes[INODE_TABLE_SIZE];
+static lockprof_thread *threads[LOCKPROF_MAX_THREADS];
+static int num_threads;
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread lockprof_thread *local_thread;
+static __thread lockprof_held held[LOCKPROF_MAX_HELD];
+static __thread int num_held;
+
+
+static uint64_t now_ns() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t) (t.tv_sec - start.tv_sec) * 1000000000ULL + t.tv_nsec - start.tv_nsec;
+}
+
+
+static void add_max(unsigned long *max, unsigned long value) {
+	unsigned long current = __atomic_load_n(max, __ATOMIC_RELAXED);
+	while (value > current &&
+	       !__atomic_compare_exchange_n(max, &current, value, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+
+static void add_stats(lockprof_stats *stats, int contended, unsigned long wait, unsigned long hold) {
+	__atomic_add_fetch(&stats->acquisitions, 1, __ATOMIC_RELAXED);
+	if (contended)
+		__atomic_add_fetch(&stats->contended, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stats->wait_ns, wait, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stats->hold_ns, hold, __ATOMIC_RELAXED);
+	add_max(&stats->wait_max_ns, wait);
+	add_max(&stats->hold_max_ns, hold);
+}
+
+
+/*
+ * Starts profiling the locks.
+ * Input:
+ *  - path: file the timeline is written to by lockprof_close
+ * Returns: SUCCESS or FAIL
+ */
+int lockprof_open(char *path) {
+	FILE *fp;
+
+	/* o ficheiro so e escrito no fim, mas um caminho errado nota-se ja */
+	if ((fp = fopen(path, "w")) == NULL)
+		return FAIL;
+	fclose(fp);
+	trace_path = path;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	enabled = 1;
+	return SUCCESS;
+}
+
+
+int lockprof_enabled() {
+	return enabled;
+}
+
+
+/*
+ * Returns the site with the given name, registering it the first time.
+ * Once every site is taken, new names get LOCKPROF_OTHER.
+ */
+int lockprof_site(const char *name) {
+	int site;
+
+	pthread_mutex_lock(&registry_lock);
+	for (site = 0; site < num_sites; site++) {
+		if (strcmp(site_names[site], name) == 0)
+			break;
+	}
+	if (site == num_sites) {
+		if (num_sites == LOCKPROF_MAX_SITES)
+			site = LOCKPROF_OTHER;
+		else {
+			snprintf(site_names[site], sizeof(site_names[site]), "%s", name);
+			num_sites++;
+		}
+	}
+	pthread_mutex_unlock(&registry_lock);
+	return site;
+}
+
+
+/*
+ * Gives the calling thread the timeline of a thread that exited, or a new
+ * one while there is room.
+ */
+static lockprof_thread *register_thread() {
+	lockprof_thread *thread = NULL;
+
+	pthread_mutex_lock(&registry_lock);
+	for (int t = 0; t < num_threads && thread == NULL; t++) {
+		if (!threads[t]->in_use)
+			thread = threads[t];
+	}
+	if (thread == NULL && num_threads < LOCKPROF_MAX_THREADS &&
+	    (thread = calloc(1, sizeof(lockprof_thread))) != NULL) {
+		pthread_mutex_init(&thread->lock, NULL);
+		thread->id = num_threads + 1;
+		threads[num_threads++] = thread;
+	}
+	if (thread != NULL)
+		thread->in_use = 1;
+	pthread_mutex_unlock(&registry_lock);
+	return thread;
+}
+
+
+/*
+ * Leaves the timeline of the calling thread, which is about to exit, to
+ * the next thread that registers. Its acquisitions stay in the timeline.
+ */
+void lockprof_thread_exit() {
+	if (local_thread == NULL)
+		return;
+	pthread_mutex_lock(&registry_lock);
+	local_thread->in_use = 0;
+	pthread_mutex_unlock(&registry_lock);
+	local_thread = NULL;
+}
+
+
+/*
+ * Records an acquisition in the timeline of the calling thread, which
+ * grows up to LOCKPROF_MAX_EVENTS acquisitions; the ones after that are
+ * only counted.
+ */
+static void record_event(lockprof_held *h, uint64_t released) {
+	lockprof_thread *thread = local_thread;
+
+	if (thread == NULL && (thread = local_thread = register_thread()) == NULL)
+		return;
+
+	pthread_mutex_lock(&thread->lock);
+	if (thread->count == thread->size) {
+		int size = thread->size ? thread->size * 2 : 1024;
+		lockprof_event *events = NULL;
+
+		if (size <= LOCKPROF_MAX_EVENTS)
+			events = realloc(thread->events, sizeof(lockprof_event) * size);
+		if (events == NULL) {
+			thread->dropped++;
+			pthread_mutex_unlock(&thread->lock);
+			return;
+		}
+		thread->events = events;
+		thread->size = size;
+	}
+	thread->events[thread->count++] = (lockprof_event) { h->site, h->inumber, h->wait_ns, h->acquired_ns, released };
+	pthread_mutex_unlock(&thread->lock);
+}
+
+
+/*
+ * Notes that the calling thread now holds a lock, taken at a site after
+ * waiting since wait_ns (UINT64_MAX if it did not wait).
+ */
+static void acquired(void *lock, int site, uint64_t wait_ns) {
+	uint64_t now = now_ns();
+
+	if (num_held == LOCKPROF_MAX_HELD)
+		return;
+	if (site < 0 || site >= num_sites)
+		site = LOCKPROF_OTHER;
+	held[num_held++] = (lockprof_held) { lock, site, FAIL, wait_ns == UINT64_MAX ? now : wait_ns, now };
+}
+
+
+static lockprof_held *find_held(void *lock) {
+	for (int i = num_held - 1; i >= 0; i--) {
+		if (held[i].lock == lock)
+			return &held[i];
+	}
+	return NULL;
+}
+
+
+/*
+ * Counts the time a lock was held by the calling thread, which is about
+ * to release it.
+ */
+static void released(void *lock) {
+	uint64_t now = now_ns();
+	lockprof_held *found = find_held(lock);
+
+	if (found == NULL)
+		return;
+
+	lockprof_held h = *found;
+	unsigned long wait = h.acquired_ns - h.wait_ns, hold = now - h.acquired_ns;
+	int contended = h.wait_ns != h.acquired_ns;
+
+	add_stats(&sites[h.site], contended, wait, hold);
+	if (h.inumber >= 0 && h.inumber < INODE_TABLE_SIZE)
+		add_stats(&inodes[h.inumber], contended, wait, hold);
+	record_event(&h, now);
+
+	*found = held[--num_held];
+}
+
+
+/*
+ * Tells which i-node the calling thread works on with a lock it has just
+ * taken. The time it took to find the i-node counts as neither waiting
+ * for the lock nor holding it.
+ */
+void lockprof_set_inode(void *lock, int inumber) {
+	lockprof_held *h;
+	uint64_t now;
+
+	if (!enabled || (h = find_held(lock)) == NULL)
+		return;
+	now = now_ns();
+	h->inumber = inumber;
+	h->wait_ns += now - h->acquired_ns;
+	h->acquired_ns = now;
+}
+
+
+/*
+ * Takes a lock at a site: first without waiting, so an acquisition that
+ * has to wait counts as contended.
+ * Returns: the result of the pthread function
+ */
+int lockprof_rdlock(pthread_rwlock_t *lock, int site) {
+	uint64_t wait;
+	int res;
+
+	if (!enabled)
+		return pthread_rwlock_rdlock(lock);
+	wait = now_ns();
+	if ((res = pthread_rwlock_tryrdlock(lock)) == EBUSY) {
+		if ((res = pthread_rwlock_rdlock(lock)) == 0)
+			acquired(lock, site, wait);
+	}
+	else if (res == 0)
+		acquired(lock, site, UINT64_MAX);
+	return res;
+}
+
+
+int lockprof_wrlock(pthread_rwlock_t *lock, int site) {
+	uint64_t wait;
+	int res;
+
+	if (!enabled)
+		return pthread_rwlock_wrlock(lock);
+	wait = now_ns();
+	if ((res = pthread_rwlock_trywrlock(lock)) == EBUSY) {
+		if ((res = pthread_rwlock_wrlock(lock)) == 0)
+			acquired(lock, site, wait);
+	}
+	else if (res == 0)
+		acquired(lock, site, UINT64_MAX);
+	return res;
+}
+
+
+int lockprof_mutex_lock(pthread_mutex_t *lock, int site) {
+	uint64_t wait;
+	int res;
+
+	if (!enabled)
+		return pthread_mutex_lock(lock);
+	wait = now_ns();
+	if ((res = pthread_mutex_trylock(lock)) == EBUSY) {
+		if ((res = pthread_mutex_lock(lock)) == 0)
+			acquired(lock, site, wait);
+	}
+	else if (res == 0)
+		acquired(lock, site, UINT64_MAX);
+	return res;
+}
+
+
+/*
+ * Releases a lock.
+ * Returns: the result of the pthread function
+ */
+int lockprof_rwunlock(pthread_rwlock_t *lock) {
+	if (enabled)
+		released(lock);
+	return pthread_rwlock_unlock(lock);
+}
+
+
+int lockprof_mutex_unlock(pthread_mutex_t *lock) {
+	if (enabled)
+		released(lock);
+	return pthread_mutex_unlock(lock);
+}
+
+
+/*
+ * Waits on a condition. The time waiting does not count as holding the
+ * lock, nor as waiting for it.
+ */
+int lockprof_cond_wait(pthread_cond_t *cond, pthread_mutex_t *lock, int site) {
+	int res;
+
+	if (!enabled)
+		return pthread_cond_wait(cond, lock);
+	released(lock);
+	res = pthread_cond_wait(cond, lock);
+	acquired(lock, site, UINT64_MAX);
+	return res;
+}
+
+
+/*
+ * Waits on a condition until a deadline, as lockprof_cond_wait.
+ */
+int lockprof_cond_timedwait(pthread_cond_t *cond, pthread_mutex_t *lock, int site, const struct timespec *deadline) {
+	int res;
+
+	if (!enabled)
+		return pthread_cond_timedwait(cond, lock, deadline);
+	released(lock);
+	res = pthread_cond_timedwait(cond, lock, deadline);
+	acquired(lock, site, UINT64_MAX);
+	return res;
+}
+
+
+static double average_us(unsigned long ns, unsigned long count) {
+	return count ? ns / 1e3 / count : 0;
+}
+
+
+/*
+ * Writes the totals of each site that was used and of the i-nodes that
+ * held the locks the longest, one per line.
+ * Input:
+ *  - buffer: where the report is written
+ *  - size: size of the buffer
+ * Returns: length of the report
+ */
+int lockprof_report(char *buffer, int size) {
+	int hot[LOCKPROF_HOT_INODES], num_hot = 0;
+	int c = 0;
+
+	if (!enabled || size < 1)
+		return 0;
+	buffer[0] = '\0';
+
+	for (int site = 0; site < num_sites && c < size; site++) {
+		lockprof_stats *s = &sites[site];
+		if (s->acquisitions == 0)
+			continue;
+		c += snprintf(buffer + c, size - c,
+		              "lock %s acquisitions=%lu contended=%lu wait_avg_us=%.1f wait_max_us=%.1f "
+		              "hold_avg_us=%.1f hold_max_us=%.1f\n",
+		              site_names[site], s->acquisitions, s->contended, average_us(s->wait_ns, s->acquisitions),
+		              s->wait_max_ns / 1e3, average_us(s->hold_ns, s->acquisitions), s->hold_max_ns / 1e3);
+	}
+
+	/* os i-nodes mais quentes, por tempo de espera mais tempo com o lock */
+	for (int inumber = 0; inumber < INODE_TABLE_SIZE; inumber++) {
+		unsigned long total = inodes[inumber].wait_ns + inodes[inumber].hold_ns;
+		int i;
+
+		if (inodes[inumber].acquisitions == 0)
+			continue;
+		for (i = num_hot; i > 0 && inodes[hot[i - 1]].wait_ns + inodes[hot[i - 1]].hold_ns < total; i--) {
+			if (i < LOCKPROF_HOT_INODES)
+				hot[i] = hot[i - 1];
+		}
+		if (i < LOCKPROF_HOT_INODES) {
+			hot[i] = inumber;
+			if (num_hot < LOCKPROF_HOT_INODES)
+				num_hot++;
+		}
+	}
+	for (int i = 0; i < num_hot && c < size; i++) {
+		lockprof_stats *s = &inodes[hot[i]];
+		c += snprintf(buffer + c, size - c,
+		              "inode %d acquisitions=%lu contended=%lu wait_total_us=%.1f hold_total_us=%.1f\n",
+		              hot[i], s->acquisitions, s->contended, s->wait_ns / 1e3, s->hold_ns / 1e3);
+	}
+	return c < size ? c : size - 1;
+}
+
+
+/*
+ * Writes the timeline to the file given to lockprof_open: per thread, an
+ * event for the time each lock was held and, if it had to wait, one for
+ * the wait. Acquisitions that are still held are left out.
+ * Returns: SUCCESS or FAIL
+ */
+int lockprof_close() {
+	FILE *fp;
+	int first = 1;
+
+	if (!enabled)
+		return SUCCESS;
+	if ((fp = fopen(trace_path, "w")) == NULL)
+		return FAIL;
+
+	fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+	pthread_mutex_lock(&registry_lock);
+	for (int t = 0; t < num_threads; t++) {
+		lockprof_thread *thread = threads[t];
+
+		pthread_mutex_lock(&thread->lock);
+		fprintf(fp, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+		        "\"args\":{\"name\":\"thread %d\"}}", first ? "" : ",", thread->id, thread->id);
+		first = 0;
+		for (int i = 0; i < thread->count; i++) {
+			lockprof_event *e = &thread->events[i];
+
+			if (e->wait_ns != e->acquired_ns)
+				fprintf(fp, ",\n{\"name\":\"wait %s\",\"cat\":\"wait\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+				        "\"pid\":1,\"tid\":%d}", site_names[e->site], e->wait_ns / 1e3,
+				        (e->acquired_ns - e->wait_ns) / 1e3, thread->id);
+			fprintf(fp, ",\n{\"name\":\"%s\",\"cat\":\"hold\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+			        "\"pid\":1,\"tid\":%d,\"args\":{\"inode\":%d}}", site_names[e->site], e->acquired_ns / 1e3,
+			        (e->released_ns - e->acquired_ns) / 1e3, thread->id, e->inumber);
+		}
+		if (thread->dropped > 0)
+			fprintf(stderr, "lockprof: thread %d dropped %lu acquisitions\n", thread->id, thread->dropped);
+		pthread_mutex_unlock(&thread->lock);
+	}
+	pthread_mutex_unlock(&registry_lock);
+	fprintf(fp, "\n]}\n");
+	return fclose(fp) == 0 ? SUCCESS : FAIL;
+}
@@ -0,0 +1,49 @@
+#ifndef LOCKPROF_H
+#define LOCKPROF_H
+
+#include <pthread.h>
+
+/*
+ * Lock contention profiler. The locks of the server are taken through the
+ * functions below, each at a site: a name for the lock and what it is
+ * taken for. Per site, it counts the acquisitions, how many had to wait
+ * for the lock, the time waiting and the time holding it; the time is
+ * also added to the i-node the holder works on, if it says which with
+ * lockprof_set_inode. Every
+ * acquisition is recorded, so the run can be seen as a timeline in Chrome
+ * trace event format (chrome://tracing or Perfetto). Until it is enabled
+ * with lockprof_open, the functions only take and release the locks. Has
+ * its own lock, so it can be called with or without the server lock held.
+ */
+
+/* Sites that can be told apart; more share LOCKPROF_OTHER */
+#define LOCKPROF_MAX_SITES 64
+#define LOCKPROF_OTHER 0
+
+/* Threads that record acquisitions at once, and acquisitions recorded by
+ * each; a thread that exits leaves its timeline to the next one */
+#define LOCKPROF_MAX_THREADS 256
+#define LOCKPROF_MAX_EVENTS 262144
+
+/* Locks a thread can hold at once */
+#define LOCKPROF_MAX_HELD 8
+
+/* I-nodes listed in the report, the ones that held the locks the longest */
+#define LOCKPROF_HOT_INODES 10
+
+int lockprof_open(char *path);
+int lockprof_enabled();
+int lockprof_site(const char *name);
+int lockprof_rdlock(pthread_rwlock_t *lock, int site);
+int lockprof_wrlock(pthread_rwlock_t *lock, int site);
+void lockprof_set_inode(void *lock, int inumber);
+int lockprof_rwunlock(pthread_rwlock_t *lock);
+int lockprof_mutex_lock(pthread_mutex_t *lock, int site);
+int lockprof_mutex_unlock(pthread_mutex_t *lock);
+int lockprof_cond_wait(pthread_cond_t *cond, pthread_mutex_t *lock, int site);
+int lockprof_cond_timedwait(pthread_cond_t *cond, pthread_mutex_t *lock, int site, const struct timespec *deadline);
+int lockprof_report(char *buffer, int size);
+void lockprof_thread_exit();
+int lockprof_close();
+
+#endif /* LOCKPROF_H */
@@ -1,9 +1,23 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <getopt.h>
 #include <string.h>
 #include <ctype.h>
 #include "fs/operations.h"
+#include "fs/mirror.h"
+#include "shard.h"
+#include "lease.h"
+#include "trace.h"
+#include "openfile.h"
+#include "watch.h"
+#include "replycache.h"
+#include "handoff.h"
+#include "txn.h"
+#include "scheduler.h"
+#include "pool.h"
+#include "find.h"
+#include "lockprof.h"
 #include <sys/time.h>
 #include <pthread.h>
 #include <sys/types.h>
@@ -13,28 +27,103 @@
 #include <sys/uio.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <signal.h>
+#include <limits.h>
+#include <time.h>
+#include <errno.h>
 
 #define MAX_COMMANDS 10
-#define INDIM 30
-#define OUTDIM 512
+#define INDIM (SHARD_SUBTREE_SIZE + 256)
+#define OUTDIM (SHARD_SUBTREE_SIZE + 32)
+/* Readdir entries that always fit in one reply */
+#define READDIR_MAX_BATCH ((READDIR_REPLY_SIZE - 32) / (MAX_FILE_NAME + 16))
 
 #define MAX_INPUT_SIZE 100
 
+/* Pedidos cuja resposta fica em cache, para nao serem repetidos se o cliente os reenviar */
+#define CACHED_COMMANDS "cdmoikaOCWwxsztF"
+
 int sockfd;
 int NumThreads;
 socklen_t addrlen;
-pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+/* Pedidos que so leem a arvore partilham o lock; os outros tem-no so para si */
+pthread_rwlock_t lock;
+
+/* Receiver e socket de controlo, para passar o servidor a um processo novo */
+pthread_t receiver;
+int ctlfd;
+volatile int handingOff, handedOff;
+
+/* Pedido que cada thread esta a aplicar: numero de sequencia dado pelo cliente, se tiver */
+static __thread unsigned long requestSeq;
+static __thread int requestHasSeq, requestCached;
+
+/* Comandos que o servidor aplica, cada um com um sitio no profiler de locks */
+#define COMMAND_TOKENS "cdlvALmszFpoikarOCRWSDUwxEtQP"
+
+/* Para o profiler de locks: sitio de cada comando e caminho do pedido a ser aplicado */
+static int commandSites[128];
+static __thread int lockSite;
+static __thread char *lockPath;
+
+/*
+ * Returns the directory a request works in (the parent of its path), for
+ * the lock profiler. Must be called with the lock held.
+ */
+static int lockInode() {
+    fs_path path;
+
+    if (lockPath == NULL || path_parse(&path, lockPath) == FAIL)
+        return FAIL;
+    return lookup_parsed(&path, path.depth > 0 ? path.depth - 1 : 0, NULL);
+}
 
 void mutex_lock(){
-    if (pthread_mutex_lock(&lock)!=0)
+    if (lockprof_wrlock(&lock, lockSite)!=0)
         exit(EXIT_FAILURE);
+    /* o i-node e procurado logo ao tirar o lock, fora do tempo com o lock */
+    if (lockprof_enabled())
+        lockprof_set_inode(&lock, lockInode());
+}
+
+void read_lock(){
+    if (lockprof_rdlock(&lock, lockSite)!=0)
+        exit(EXIT_FAILURE);
+    if (lockprof_enabled())
+        lockprof_set_inode(&lock, lockInode());
 }
 
 void mutex_unlock(){
-    if (pthread_mutex_unlock(&lock)!=0)
+    if (lockprof_rwunlock(&lock)!=0)
         exit(EXIT_FAILURE);
 }
 
+/*
+ * Gives each command its own site in the lock profiler, before the
+ * workers start.
+ */
+static void registerCommandSites() {
+    for (const char *token = COMMAND_TOKENS; *token != '\0'; token++) {
+        char name[16];
+        sprintf(name, "tree %c", *token);
+        commandSites[(unsigned char) *token] = lockprof_site(name);
+    }
+}
+
+/*
+ * Tells the lock profiler what a request takes the lock for: its command
+ * and, if it has one, the path it works on.
+ */
+static void profileCommand(char *in_buffer) {
+    unsigned char token = in_buffer[0];
+    char *arg = strchr(in_buffer, ' ');
+
+    /* um comando desconhecido fica com LOCKPROF_OTHER */
+    lockSite = token < 128 ? commandSites[token] : LOCKPROF_OTHER;
+    /* o 'p' recebe um ficheiro do servidor, nao um caminho do tecnicofs */
+    lockPath = (arg != NULL && arg[1] == '/' && token != 'p') ? arg + 1 : NULL;
+}
+
 int setSockAddrUn(char *path, struct sockaddr_un *addr) {
 
   if (addr == NULL)
@@ -53,181 +142,966 @@ void errorParse(){
 }
 
 
-void *applyCommands(){
-    while (1) {
-        struct sockaddr_un client_addr;
-        char in_buffer[INDIM],out_buffer[OUTDIM];
-        int res;
-        int c;
+/*
+ * Writes the reply to a readdir: "<count> <next_cursor>" followed by
+ * "<name> <inumber> <f|d>" per entry.
+ * Returns the length of the reply.
+ */
+int readDirReply(char *out_buffer, int count, int next_cursor, DirListEntry *entries) {
+    int c = sprintf(out_buffer, "%d %d", count, next_cursor);
 
-        addrlen=sizeof(struct sockaddr_un);
+    for (int i = 0; i < count; i++)
+        c += sprintf(out_buffer + c, " %s %d %c", entries[i].name, entries[i].inumber,
+                     entries[i].nodeType == T_DIRECTORY ? 'd' : 'f');
+    return c;
+}
 
-        c = recvfrom(sockfd, in_buffer, sizeof(in_buffer)-1, 0,(struct sockaddr *)&client_addr, &addrlen); //receives what the client sent
-        if (c <= 0) continue;
-    
-        //Preventivo, caso o cliente nao tenha terminado a mensagem em '\0', 
-        in_buffer[c]='\0';
-        char token, type;
-        char other_name[MAX_INPUT_SIZE];
-        char name[MAX_INPUT_SIZE];
-        sscanf(in_buffer,"%c",&token);
 
-        if (token == 'm') {           
-            int numTokens = sscanf(in_buffer, "%c %s %s", &token, name, other_name);/*ler os args do move*/
-        
-            if (numTokens < 2) { /*Verificar se sao os argumentos certos*/
-                fprintf(stderr, "Error: invalid command in Queue\n");
-                exit(EXIT_FAILURE);
-            }   
+/*
+ * Sends the reply to the current request, prefixed by its sequence number
+ * ("#<seq> <reply>") if the request had one, and keeps it in the reply
+ * cache if the request is one that must not be applied twice. A request
+ * answered as busy was not applied, so its reply is not kept: the client
+ * sends it again later.
+ */
+void sendReply(char *out_buffer, int c, struct sockaddr_un *client_addr) {
+    char reply[OUTDIM + 32];
+    int busy = atoi(out_buffer) == TECNICOFS_ERROR_BUSY;
+
+    if (requestHasSeq) {
+        c = snprintf(reply, sizeof(reply), "#%lu %s", requestSeq, out_buffer);
+        out_buffer = reply;
+    }
+    if (requestCached) {
+        reply_cache_end(client_addr, requestSeq, busy ? NULL : out_buffer, c);
+        requestCached = 0;
+    }
+    /* um cliente que nao le as respostas nao pode prender o worker: a
+     * resposta perde-se e o cliente reenvia o pedido */
+    sendto(sockfd, out_buffer, c+1, MSG_DONTWAIT, (struct sockaddr *)client_addr, sizeof(struct sockaddr_un));
+}
+
+
+/*
+ * Answers a malformed request with FAIL instead of stopping the server.
+ */
+void invalidCommand(struct sockaddr_un *client_addr) {
+    char out_buffer[16];
+    int c = sprintf(out_buffer, "%d", FAIL);
+
+    fprintf(stderr, "Error: invalid command in Queue\n");
+    sendReply(out_buffer, c, client_addr);
+}
+
+
+/*
+ * Receives the changes to directories: they go to the watches, and the
+ * leases on a deleted node go with it, as its i-number is reused.
+ */
+static void publishEvent(fs_event event, int dir_inumber, const char *name, int len, int inumber) {
+    watch_publish(event, dir_inumber, name, len, inumber);
+    /* um no que uma snapshot ainda tem nao foi libertado */
+    if (event == FS_EVENT_DELETE && inode_version(inumber) == 0)
+        lease_forget(inumber);
+}
+
+
+/*
+ * Applies a request received from a client and sends it the reply.
+ */
+void applyCommand(char *in_buffer, struct sockaddr_un *client_addr) {
+    char out_buffer[OUTDIM];
+    int res = FAIL;
+    int c;
+    char token, type;
+    char other_name[MAX_INPUT_SIZE];
+    char name[MAX_INPUT_SIZE];
+    sscanf(in_buffer,"%c",&token);
+    if (lockprof_enabled())
+        profileCommand(in_buffer);
+
+    if (token == 'm') {           
+        fs_path path, other_path;
+        int offset = 0, other_offset = 0;
+        int numTokens = sscanf(in_buffer, "%c %n%99s %n%99s", &token, &offset, name, &other_offset, other_name);/*ler os args do move*/
+    
+        if (numTokens < 2) { /*Verificar se sao os argumentos certos*/
+            invalidCommand(client_addr);
+            return;
+        }   
+        /* os caminhos sao lidos uma vez, diretamente do pedido */
+        if (numTokens < 3 || path_parse(&path, in_buffer + offset) == FAIL ||
+            path_parse(&other_path, in_buffer + other_offset) == FAIL)
+            res = FAIL;
+        else {
             mutex_lock();
             printf("Move: %s\n",name);
-            move(name,other_name); /*chamar o move*/
+            if (shard_path_busy(name) || shard_path_busy(other_name))
+                res = TECNICOFS_ERROR_BUSY;
+            else {
+                lease_revoke_path(sockfd, name);
+                res = move_parsed(&path, &other_path); /*chamar o move*/
+            }
             mutex_unlock();
-            
-
         }
-
-        else if (token == 'p') {
-            char filename[100];
-            int numTokens = sscanf(in_buffer, "%c %s", &token, filename);/*ler os args do print_tree*/
         
-            if (numTokens < 1) { /*Verificar se sao os argumentos certos*/
-                fprintf(stderr, "Error: invalid command in Queue\n");
-                exit(EXIT_FAILURE);
-            }
+
+    }
+
+    else if (token == 's' || token == 'z') {
+        fs_path path, other_path;
+        int offset = 0, other_offset = 0;
+        int numTokens = sscanf(in_buffer, "%c %n%99s %n%99s", &token, &offset, name, &other_offset, other_name);/*ler os args do snapshot e do clone*/
+
+        if (numTokens < 2) { /*Verificar se sao os argumentos certos*/
+            invalidCommand(client_addr);
+            return;
+        }
+        if (numTokens < 3 || path_parse(&path, in_buffer + offset) == FAIL ||
+            path_parse(&other_path, in_buffer + other_offset) == FAIL)
+            res = FAIL;
+        else {
             mutex_lock();
-            FILE *output = fopen(filename,"w"); 
-            printf("Print-Tree: %s\n",filename);
-            print_tecnicofs_tree(output); /*coloca no ficheiro de output definido a inode tree atual*/
-            fclose(output);
+            printf("%s: %s %s\n", token == 's' ? "Snapshot" : "Clone", name, other_name);
+            if (shard_path_busy(name) || shard_path_busy(other_name))
+                res = TECNICOFS_ERROR_BUSY;
+            /* um ficheiro aberto seria escrito nas duas copias */
+            else if (openfile_subtree_is_open(lookup_parsed(&path, path.depth, NULL)))
+                res = TECNICOFS_ERROR_FILE_IS_OPEN;
+            else
+                res = clone_parsed(&path, &other_path, token == 's');
             mutex_unlock();
         }
+    }
+
+    else if (token == 't') {
+        int nreads, nops;
+
+        if (sscanf(in_buffer, "%c %d %d", &token, &nreads, &nops) < 3) { /*Verificar se sao os argumentos certos*/
+            invalidCommand(client_addr);
+            return;
+        }
+        mutex_lock();
+        printf("Transaction: %d reads, %d changes\n", nreads, nops);
+        res = txn_commit(sockfd, in_buffer);
+        mutex_unlock();
+    }
+
+    else if (token == 'Q') {
+        /* metricas do escalonador: uma linha por classe de pedidos */
+        c = sched_stats(out_buffer, sizeof(out_buffer));
+        c += pool_stats(out_buffer + c, sizeof(out_buffer) - c);
+        c += lockprof_report(out_buffer + c, sizeof(out_buffer) - c);
+        sendReply(out_buffer, c, client_addr);
+        return;
+    }
+
+    else if (token == 'P') {
+        /* "P [min max]": limites do pool de workers; a resposta e o numero de workers */
+        int min, max;
+        int numTokens = sscanf(in_buffer, "%c %d %d", &token, &min, &max);
+
+        if (numTokens == 3 && pool_set_bounds(min, max) == FAIL)
+            res = TECNICOFS_ERROR_OTHER;
+        else
+            res = pool_size();
+    }
+
+    else if (token == 'F') {
+        /* "F <raiz> <padrao> <limite>": os resultados vao em lotes antes da resposta,
+         * "<encontrados> <lotes>" */
+        char pattern[MAX_INPUT_SIZE], prefix[32] = "";
+        int limit, batches;
+        int numTokens = sscanf(in_buffer, "%c %99s %99s %d", &token, name, pattern, &limit);/*ler os args do find*/
+
+        if (numTokens < 4) { /*Verificar se sao os argumentos certos*/
+            invalidCommand(client_addr);
+            return;
+        }
+        if (requestHasSeq)
+            sprintf(prefix, "#%lu ", requestSeq);
+        printf("Find: %s %s\n", name, pattern);
+        /* a procura tira o lock so enquanto le cada pagina */
+        res = find_run(client_addr, prefix, name, pattern, limit, &batches);
+        c = sprintf(out_buffer, "%d %d", res, batches);
+        sendReply(out_buffer, c, client_addr);
+        return;
+    }
+
+    else if (token == 'p') {
+        char filename[100];
+        int numTokens = sscanf(in_buffer, "%c %99s", &token, filename);/*ler os args do print_tree*/
     
-        else {
-            int numTokens = sscanf(in_buffer, "%c %s %c", &token, name, &type);
-            if (numTokens < 2) {
-                fprintf(stderr, "Error: invalid command in Queue\n");
-                exit(EXIT_FAILURE);
+        if (numTokens < 2) { /*Verificar se sao os argumentos certos*/
+            invalidCommand(client_addr);
+            return;
+        }
+        read_lock();
+        FILE *output = fopen(filename,"w"); 
+        printf("Print-Tree: %s\n",filename);
+        if (output != NULL) {
+            print_tecnicofs_tree(output); /*coloca no ficheiro de output definido a inode tree atual*/
+            fclose(output);
+            res = SUCCESS;
+        }
+        mutex_unlock();
+    }
+
+    else if (token == 'o' || token == 'i' || token == 'k' || token == 'a') {
+        long txid;
+        int offset = 0;
+        int numTokens = sscanf(in_buffer, "%c %ld %99s%n", &token, &txid, name, &offset);/*ler os args do move entre shards*/
+
+        /* um caminho cortado pelo %99s nao e o caminho pedido */
+        if (numTokens < 2 || (numTokens < 3 && (token == 'o' || token == 'i')) ||
+            (numTokens == 3 && !isspace((unsigned char) in_buffer[offset]) && in_buffer[offset] != '\0')) {
+            invalidCommand(client_addr);
+            return;
+        }
+
+        mutex_lock();
+        switch (token) {
+            case 'o':
+                printf("Shard move out: %s\n", name);
+                /* os handles nao sobrevivem a mudanca de servidor */
+                if (openfile_subtree_is_open(lookup(name))) {
+                    res = TECNICOFS_ERROR_FILE_IS_OPEN;
+                    break;
+                }
+                c = sprintf(out_buffer, "%d\n", SUCCESS);
+                res = shard_prepare_out(txid, name, out_buffer + c, sizeof(out_buffer) - c);
+                break;
+            case 'i':
+                /* a subarvore vem nas linhas seguintes ao path */
+                printf("Shard move in: %s\n", name);
+                res = shard_prepare_in(txid, name, in_buffer + offset + 1);
+                break;
+            case 'k':
+                printf("Shard commit: %ld\n", txid);
+                if (shard_move_out_path(txid) != NULL)
+                    lease_revoke_path(sockfd, shard_move_out_path(txid));
+                res = shard_commit(txid);
+                break;
+            default:
+                printf("Shard abort: %ld\n", txid);
+                res = shard_abort(txid);
+        }
+        mutex_unlock();
+
+        if (token == 'o' && res == SUCCESS) {
+            c += strlen(out_buffer + c);
+            sendReply(out_buffer, c, client_addr);
+            return;
+        }
+    }
+
+    else if (token == 'r') {
+        int cursor, max, next_cursor;
+        int numTokens = sscanf(in_buffer, "%c %99s %d %d", &token, name, &cursor, &max);/*ler os args do readdir*/
+
+        if (numTokens < 4) { /*Verificar se sao os argumentos certos*/
+            invalidCommand(client_addr);
+            return;
+        }
+        if (max > READDIR_MAX_BATCH)
+            max = READDIR_MAX_BATCH;
+
+        DirListEntry entries[READDIR_MAX_BATCH];
+
+        read_lock();
+        printf("Read-Dir: %s\n", name);
+        res = read_dir(name, cursor, max, entries, &next_cursor);
+        mutex_unlock();
+
+        if (res >= 0) {
+            c = readDirReply(out_buffer, res, next_cursor, entries);
+            sendReply(out_buffer, c, client_addr);
+            return;
+        }
+    }
+
+    else if (token == 'O') {
+        fs_path path;
+        int offset = 0, mode;
+        int numTokens = sscanf(in_buffer, "%c %n%99s %d", &token, &offset, name, &mode);/*ler os args do open*/
+
+        if (numTokens < 3) { /*Verificar se sao os argumentos certos*/
+            invalidCommand(client_addr);
+            return;
+        }
+
+        mutex_lock();
+        printf("Open: %s\n", name);
+        if (path_parse(&path, in_buffer + offset) == FAIL)
+            res = TECNICOFS_ERROR_FILE_NOT_FOUND;
+        else if (shard_path_busy(name))
+            res = TECNICOFS_ERROR_BUSY;
+        /* o handle fica com um i-node que nao e partilhado com snapshots */
+        else if ((res = lookup_unshared(&path, path.depth, mode & WRITE)) == FAIL)
+            res = TECNICOFS_ERROR_FILE_NOT_FOUND;
+        else if (res >= 0) {
+            enum type nodeType;
+            inode_get(res, &nodeType, NULL);
+            /* diretorias so se abrem para leitura */
+            if (nodeType == T_DIRECTORY && mode != READ)
+                res = TECNICOFS_ERROR_INVALID_MODE;
+            else
+                res = openfile_open(client_addr->sun_path, res, mode);
+        }
+        mutex_unlock();
+    }
+
+    else if (token == 'C' || token == 'R' || token == 'W' || token == 'S' || token == 'D') {
+        /* operacoes sobre um handle: vao diretamente ao i-node, sem procurar o caminho */
+        int handle, offset = 0;
+        int numTokens = sscanf(in_buffer, "%c %d%n", &token, &handle, &offset);
+        char *args = in_buffer + offset + (in_buffer[offset] == ' ');
+        enum type nodeType;
+        union Data data;
+
+        if (numTokens < 2) {
+            invalidCommand(client_addr);
+            return;
+        }
+
+        mutex_lock();
+        switch (token) {
+            case 'C':
+                printf("Close: %d\n", handle);
+                res = openfile_close(client_addr->sun_path, handle);
+                break;
+
+            case 'R': {
+                /* resposta: "<bytes> <conteudo>" */
+                int len = atoi(args);
+                printf("Read: %d\n", handle);
+                if ((res = openfile_get(client_addr->sun_path, handle, READ)) < 0)
+                    break;
+                inode_get(res, &nodeType, &data);
+                if (nodeType != T_FILE || len < 0) {
+                    res = TECNICOFS_ERROR_OTHER;
+                    break;
+                }
+                if (len > FILE_IO_SIZE)
+                    len = FILE_IO_SIZE;
+                char *contents = data.fileContents ? data.fileContents : "";
+                len = strnlen(contents, len);
+                c = sprintf(out_buffer, "%d %.*s", len, len, contents);
+                mutex_unlock();
+                sendReply(out_buffer, c, client_addr);
+                return;
             }
-            int searchResult;
-
-            switch (token) {
-                case 'c':
-                    switch (type) {
-                        case 'f':
-                            mutex_lock();
-                            printf("Create file: %s\n", name);
-                            res = create(name, T_FILE);
-                            mutex_unlock();
-                            break;
-                        case 'd':
-                            mutex_lock();
-                            printf("Create directory: %s\n", name);
-                            res = create(name, T_DIRECTORY);
-                            mutex_unlock();
-                            break;
-                        default:
-                            printf("Error: invalid node type\n");
-                            exit(EXIT_FAILURE);
-                    }
+
+            case 'W':
+                /* o conteudo e o resto do pedido */
+                printf("Write: %d\n", handle);
+                if ((res = openfile_get(client_addr->sun_path, handle, WRITE)) < 0)
+                    break;
+                res = inode_set_file(res, args, strlen(args)) == SUCCESS ? (int) strlen(args) : TECNICOFS_ERROR_OTHER;
+                break;
+
+            case 'S':
+                /* resposta: "0 <f|d> <bytes>" */
+                printf("Stat: %d\n", handle);
+                if ((res = openfile_get(client_addr->sun_path, handle, NONE)) < 0)
+                    break;
+                inode_get(res, &nodeType, &data);
+                c = sprintf(out_buffer, "%d %c %d", SUCCESS, nodeType == T_DIRECTORY ? 'd' : 'f',
+                            nodeType == T_FILE && data.fileContents ? (int) strlen(data.fileContents) : 0);
+                mutex_unlock();
+                sendReply(out_buffer, c, client_addr);
+                return;
+
+            default: {
+                int cursor = -1, max = 0, next_cursor;
+                DirListEntry entries[READDIR_MAX_BATCH];
+
+                printf("Read-Dir: %d\n", handle);
+                if ((res = openfile_get(client_addr->sun_path, handle, READ)) < 0)
                     break;
-                case 'l':
-                    mutex_lock();
-                    searchResult = lookup(name);
-                    if (searchResult >= 0){
-                        printf("Search: %s found\n", name);
+                sscanf(args, "%d %d", &cursor, &max);
+                if (max > READDIR_MAX_BATCH)
+                    max = READDIR_MAX_BATCH;
+                res = dir_read_entries(res, cursor, max, entries, &next_cursor);
+                if (res >= 0) {
+                    c = readDirReply(out_buffer, res, next_cursor, entries);
+                    mutex_unlock();
+                    sendReply(out_buffer, c, client_addr);
+                    return;
+                }
+            }
+        }
+        mutex_unlock();
+    }
+
+    else if (token == 'U') {
+        mutex_lock();
+        openfile_end_session(client_addr->sun_path);
+        watch_end_session(client_addr->sun_path);
+        mutex_unlock();
+        reply_cache_end_session(client_addr->sun_path);
+        res = SUCCESS;
+    }
+
+    else if (token == 'w') {
+        fs_path path;
+        int offset = 0;
+        int numTokens = sscanf(in_buffer, "%c %n%99s", &token, &offset, name);/*ler os args do watch*/
+
+        if (numTokens < 2) { /*Verificar se sao os argumentos certos*/
+            invalidCommand(client_addr);
+            return;
+        }
+
+        mutex_lock();
+        printf("Watch: %s\n", name);
+        /* tal como os handles, a watch fica com uma diretoria so sua */
+        if (path_parse(&path, in_buffer + offset) == FAIL || (res = lookup_unshared(&path, path.depth, 0)) == FAIL)
+            res = TECNICOFS_ERROR_FILE_NOT_FOUND;
+        else {
+            enum type nodeType;
+            inode_get(res, &nodeType, NULL);
+            res = nodeType == T_DIRECTORY ? watch_add(client_addr->sun_path, res) : TECNICOFS_ERROR_OTHER;
+        }
+        mutex_unlock();
+    }
+
+    else if (token == 'x') {
+        int id;
+
+        if (sscanf(in_buffer, "%c %d", &token, &id) < 2) {
+            invalidCommand(client_addr);
+            return;
+        }
+        mutex_lock();
+        res = watch_remove(client_addr->sun_path, id);
+        mutex_unlock();
+    }
+
+    else if (token == 'E') {
+        /* o cliente ficou sem eventos: envia os que ainda estao na fila */
+        mutex_lock();
+        watch_flush(client_addr->sun_path);
+        mutex_unlock();
+        res = SUCCESS;
+    }
+
+    else {
+        fs_path path;
+        int offset = 0;
+        int numTokens = sscanf(in_buffer, "%c %n%99s %c", &token, &offset, name, &type);
+        if (numTokens < 2) {
+            invalidCommand(client_addr);
+            return;
+        }
+        int searchResult;
+
+        /* os caminhos sao lidos uma vez, diretamente do pedido */
+        if (path_parse(&path, in_buffer + offset) == FAIL) {
+            c = sprintf(out_buffer, "%d", FAIL);
+            sendReply(out_buffer, c, client_addr);
+            return;
+        }
+
+        switch (token) {
+            case 'c':
+                switch (type) {
+                    case 'f':
+                        mutex_lock();
+                        printf("Create file: %s\n", name);
+                        res = shard_path_busy(name) ? TECNICOFS_ERROR_BUSY : create_parsed(&path, T_FILE);
                         mutex_unlock();
-                    }
-                    else{
-                        printf("Search: %s not found\n", name);
+                        break;
+                    case 'd':
+                        mutex_lock();
+                        printf("Create directory: %s\n", name);
+                        res = shard_path_busy(name) ? TECNICOFS_ERROR_BUSY : create_parsed(&path, T_DIRECTORY);
                         mutex_unlock();
-                    }
-                    break;
+                        break;
+                    default:
+                        printf("Error: invalid node type\n");
+                        res = FAIL;
+                }
+                break;
+            case 'l':
+                read_lock();
+                searchResult = lookup_parsed(&path, path.depth, NULL);
+                res = searchResult;
+                if (searchResult >= 0){
+                    printf("Search: %s found\n", name);
+                    mutex_unlock();
+                }
+                else{
+                    printf("Search: %s not found\n", name);
+                    mutex_unlock();
+                }
+                break;
 
-                case 'd':
-                    mutex_lock();
-                    printf("Delete: %s\n", name);
-                    delete(name);
+            case 'v': {
+                /* lookup de uma transacao: resposta "<inumber> <versao>" */
+                unsigned long version;
+
+                read_lock();
+                printf("Search with version: %s\n", name);
+                res = lookup_parsed(&path, path.depth, NULL);
+                version = inode_version(res);
+                mutex_unlock();
+                c = sprintf(out_buffer, "%d %lu", res, version);
+                sendReply(out_buffer, c, client_addr);
+                return;
+            }
+
+            case 'A': {
+                /* totais da subarvore: resposta "0 <ficheiros> <diretorias> <bytes>" */
+                DirTotals totals;
+
+                read_lock();
+                printf("Totals: %s\n", name);
+                res = lookup_parsed(&path, path.depth, NULL);
+                if (res >= 0 && inode_totals(res, &totals) == SUCCESS) {
                     mutex_unlock();
-                    break;
-                default: { /* error */
-                    fprintf(stderr, "Error: command to apply\n");
-                    exit(EXIT_FAILURE);
+                    c = sprintf(out_buffer, "%d %ld %ld %ld", SUCCESS, totals.files, totals.dirs, totals.bytes);
+                    sendReply(out_buffer, c, client_addr);
+                    return;
+                }
+                mutex_unlock();
+                res = TECNICOFS_ERROR_FILE_NOT_FOUND;
+                break;
+            }
+
+            case 'L': {
+                /* lookup com lease: resposta "<inumber> <f|d> <lease_ms>" */
+                int inumbers[MAX_PATH_DEPTH], n = path.depth;
+                enum type nodeType;
+
+                /* os leases tem um lock proprio: basta o lock de leitura */
+                read_lock();
+                printf("Search with lease: %s\n", name);
+                res = lookup_parsed(&path, n, inumbers);
+                if (res >= 0 && inode_get(res, &nodeType, NULL) == SUCCESS) {
+                    int duration = lease_grant(client_addr->sun_path, inumbers, n);
+                    mutex_unlock();
+                    c = sprintf(out_buffer, "%d %c %d", res, nodeType == T_DIRECTORY ? 'd' : 'f', duration);
+                    sendReply(out_buffer, c, client_addr);
+                    return;
                 }
+                mutex_unlock();
+                res = FAIL;
+                break;
             }
+
+            case 'd':
+                mutex_lock();
+                printf("Delete: %s\n", name);
+                if (shard_path_busy(name))
+                    res = TECNICOFS_ERROR_BUSY;
+                /* uma snapshot apaga-se com o que tem dentro */
+                else if (openfile_subtree_is_open(lookup_parsed(&path, path.depth, NULL)))
+                    res = TECNICOFS_ERROR_FILE_IS_OPEN;
+                else {
+                    lease_revoke_path(sockfd, name);
+                    res = delete_parsed(&path);
+                }
+                mutex_unlock();
+                break;
+            default: /* error */
+                fprintf(stderr, "Error: command to apply\n");
+                res = FAIL;
         }
-        c = sprintf(out_buffer, "%d", res);
-        sendto(sockfd, out_buffer, c+1, 0, (struct sockaddr *)&client_addr, sizeof(struct sockaddr_un));
+    }
+    /* as invalidacoes vao sem o lock da arvore, mas antes da resposta */
+    lease_flush(sockfd);
+    c = sprintf(out_buffer, "%d", res);
+    sendReply(out_buffer, c, client_addr);
+}
+
+
+/*
+ * Answers a request with a status without applying it, prefixed by its
+ * sequence number if it has one.
+ */
+void rejectRequest(char *in_buffer, struct sockaddr_un *client_addr, int status) {
+    char reply[32];
+    unsigned long seq;
+    int c;
+
+    if (in_buffer[0] == '#' && sscanf(in_buffer, "#%lu", &seq) == 1)
+        c = sprintf(reply, "#%lu %d", seq, status);
+    else
+        c = sprintf(reply, "%d", status);
+    sendto(sockfd, reply, c+1, MSG_DONTWAIT, (struct sockaddr *)client_addr, sizeof(struct sockaddr_un));
+}
+
+
+/*
+ * Receives the requests and queues them by class for the workers. A
+ * request whose queue is full is answered as busy right away.
+ */
+void *receiveRequests(){
+    /* no handoff, para de receber e os workers esvaziam as filas */
+    while (!handingOff) {
+        struct sockaddr_un client_addr;
+        char in_buffer[INDIM];
+        socklen_t client_addrlen = sizeof(struct sockaddr_un);
+        int c;
+
+        c = recvfrom(sockfd, in_buffer, sizeof(in_buffer)-1, 0,(struct sockaddr *)&client_addr, &client_addrlen); //receives what the client sent
+        if (c <= 0) continue;
+
+        //Preventivo, caso o cliente nao tenha terminado a mensagem em '\0',
+        in_buffer[c]='\0';
+
+        if (sched_push(&client_addr, in_buffer, c) == FAIL)
+            rejectRequest(in_buffer, &client_addr, TECNICOFS_ERROR_BUSY);
     }
     return 0;
 }
 
 
+/*
+ * Applies a request taken from the queues by a worker of the pool.
+ */
+void applyRequest(sched_request *request){
+    struct sockaddr_un client_addr = request->client;
+    char *in_buffer = request->buffer;
+    char *command = in_buffer;
+    int c;
+
+    /* "#<seq> <pedido>": um pedido reenviado e respondido pela cache */
+    requestHasSeq = requestCached = 0;
+    if (in_buffer[0] == '#') {
+        char reply[OUTDIM + 32];
+        int offset = 0;
+
+        if (sscanf(in_buffer, "#%lu %n", &requestSeq, &offset) < 1 || offset == 0) {
+            fprintf(stderr, "Error: invalid command in Queue\n");
+            rejectRequest(in_buffer, &client_addr, FAIL);
+            sched_done(request);
+            free(request->buffer);
+            return;
+        }
+        command = in_buffer + offset;
+        requestHasSeq = 1;
+        if (command[0] != '\0' && strchr(CACHED_COMMANDS, command[0]) != NULL) {
+            c = reply_cache_begin(&client_addr, requestSeq, reply, sizeof(reply));
+            if (c >= 0)
+                sendto(sockfd, reply, c+1, MSG_DONTWAIT, (struct sockaddr *)&client_addr, sizeof(struct sockaddr_un));
+            if (c != REPLY_CACHE_MISS) {
+                sched_done(request);
+                free(request->buffer);
+                return;
+            }
+            requestCached = 1;
+        }
+    }
+
+    if (trace_enabled()) {
+        struct timespec done;
+        applyCommand(command, &client_addr);
+        clock_gettime(CLOCK_MONOTONIC, &done);
+        /* a latencia inclui o tempo que o pedido esperou na fila */
+        trace_request(&client_addr, command, &request->received, &done);
+    }
+    else
+        applyCommand(command, &client_addr);
+
+    /* o pedido terminou sem resposta: uma copia dele volta a ser aplicada */
+    if (requestCached)
+        reply_cache_end(&client_addr, requestSeq, NULL, 0);
+    sched_done(request);
+    free(request->buffer);
+}
+
+
+/* So serve para interromper o recvfrom do receiver */
+static void wakeWorker(int signal) {
+}
+
+static void startWorkers() {
+    /* o pool comeca com numthreads workers e ajusta-se a carga */
+    if (pool_start(NumThreads, applyRequest) == FAIL)
+        exit(EXIT_FAILURE);
+    if (pthread_create(&receiver, NULL, receiveRequests, NULL) != 0)
+        exit(EXIT_FAILURE);
+}
+
+/*
+ * Stops receiving requests and then the workers, once they have applied
+ * every request already queued. The receiver waiting in recvfrom is
+ * interrupted with SIGUSR1, again and again in case it had not got there
+ * yet.
+ */
+static void stopWorkers() {
+    struct timespec deadline;
+
+    handingOff = 1;
+    do {
+        pthread_kill(receiver, SIGUSR1);
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += 1000000;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+    } while (pthread_timedjoin_np(receiver, NULL, &deadline) == ETIMEDOUT);
+
+    pool_stop();
+}
+
+static double elapsedMs(struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+/*
+ * Waits for a new server process on the control socket and hands it the
+ * server socket and the state. The new process confirms it loaded the
+ * state; until then this one can still take over again.
+ */
+void *handoffListener() {
+    while (1) {
+        struct timespec start;
+        double drained;
+        FILE *fp = NULL;
+        char ack;
+        int conn = accept(ctlfd, NULL, NULL);
+
+        if (conn < 0)
+            continue;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        stopWorkers();
+        drained = elapsedMs(&start);
+
+        mutex_lock();
+        /* o processo novo cria o seu mirror; ate la os clientes perguntam ao servidor */
+        mirror_invalidate();
+        if (handoff_send_socket(conn, sockfd) == SUCCESS && (fp = fdopen(conn, "w")) != NULL &&
+            handoff_save(fp) == SUCCESS && read(conn, &ack, 1) == 1) {
+            printf("Handoff: drained in %.3f ms, handed off in %.3f ms\n", drained, elapsedMs(&start));
+            fclose(fp);
+            handedOff = 1;
+            mutex_unlock();
+            kill(getpid(), SIGTERM);
+            return NULL;
+        }
+
+        /* o processo novo falhou: continua a servir */
+        fprintf(stderr, "server: handoff failed\n");
+        if (fp != NULL)
+            fclose(fp);
+        else
+            close(conn);
+        handingOff = 0;
+        mirror_rebuild();
+        startWorkers();
+        mutex_unlock();
+    }
+    return NULL;
+}
+
+/*
+ * Takes over the server running at path: receives its socket and its
+ * state over the control socket.
+ */
+static void takeOver(char *path) {
+    struct timespec start;
+    FILE *fp;
+    int conn;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if ((conn = handoff_connect(path)) == FAIL || (sockfd = handoff_receive_socket(conn)) == FAIL) {
+        perror("server: can't take over the running server");
+        exit(EXIT_FAILURE);
+    }
+    if ((fp = fdopen(conn, "r+")) == NULL || handoff_load(fp) == FAIL) {
+        fprintf(stderr, "server: invalid state from the running server\n");
+        exit(EXIT_FAILURE);
+    }
+    /* confirma ao processo antigo, que termina */
+    if (write(conn, "", 1) != 1) {
+        perror("server: can't take over the running server");
+        exit(EXIT_FAILURE);
+    }
+    fclose(fp);
+    printf("Handoff: took over %s in %.3f ms\n", path, elapsedMs(&start));
+}
+
+static void displayUsage(const char* appName) {
+    fprintf(stderr, "Usage: %s [-t tracefile] [-l lockprofile] [-r rate] [-w min:max] [-u] numthreads server_socket_name\n", appName);
+    exit(EXIT_FAILURE);
+}
+
 int main(int argc, char* argv[]) {
     struct sockaddr_un server_addr;
     char *path;
+    char *tracePath = NULL;
+    char *lockProfilePath = NULL;
+    int upgrade = 0;
+    int minThreads = 0, maxThreads = 0;
+    sigset_t signals;
+    struct sigaction wake;
+    pthread_rwlockattr_t lockattr;
+    pthread_t handoffThread;
+    int signal;
+    int opt;
 
     struct timeval start,end;
-    int i;
     
     // Verificacoes iniciais
-    if (argc != 3){
+    while ((opt = getopt(argc, argv, "t:l:r:w:u")) != -1) {
+        switch (opt) {
+            case 't': tracePath = optarg; break;
+            case 'l': lockProfilePath = optarg; break;
+            /* pedidos por segundo de cada cliente, 0 sem limite */
+            case 'r': sched_set_rate(atoi(optarg), SCHED_CLIENT_BURST); break;
+            /* limites do pool de workers */
+            case 'w':
+                if (sscanf(optarg, "%d:%d", &minThreads, &maxThreads) < 2)
+                    displayUsage(argv[0]);
+                break;
+            case 'u': upgrade = 1; break;
+            default: displayUsage(argv[0]);
+        }
+    }
+    if (argc - optind != 2){
         fprintf(stderr,"Not enough arguments\n");
-        exit(EXIT_FAILURE);
+        displayUsage(argv[0]);
     }
+    argv += optind - 1;
 
     NumThreads = atoi(argv[1]);
 
-    if(NumThreads < 1){
+    if(NumThreads < 1 || NumThreads > POOL_MAX_THREADS){
         printf("Error in the number of threads\n");
         exit(EXIT_FAILURE);
     }
-    
-    pthread_t tid[NumThreads];
-    
-    if ((sockfd = socket(AF_UNIX, SOCK_DGRAM, 0)) < 0) {
-        perror("server: can't open socket");
+    /* sem -w, o pool pode ir de 1 ao dobro dos workers iniciais */
+    if (minThreads == 0) {
+        minThreads = 1;
+        maxThreads = NumThreads * 2 < POOL_MAX_THREADS ? NumThreads * 2 : POOL_MAX_THREADS;
+    }
+    if (pool_set_bounds(minThreads, maxThreads) == FAIL) {
+        printf("Error in the bounds of the worker pool\n");
         exit(EXIT_FAILURE);
     }
-
+    
     path = argv[2];
 
-    unlink(path);
-
-    addrlen = setSockAddrUn (argv[2], &server_addr);
-    
-    if (bind(sockfd, (struct sockaddr *) &server_addr, addrlen) < 0) {
-        perror("server: bind error");
+    /* um print longo nao pode deixar as alteracoes a espera para sempre */
+    pthread_rwlockattr_init(&lockattr);
+    pthread_rwlockattr_setkind_np(&lockattr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    if (pthread_rwlock_init(&lock, &lockattr) != 0)
         exit(EXIT_FAILURE);
+    pthread_rwlockattr_destroy(&lockattr);
+
+    if (upgrade) {
+        /* o socket e o estado vem do servidor que esta a correr */
+        takeOver(path);
     }
+    else {
+        if ((sockfd = socket(AF_UNIX, SOCK_DGRAM, 0)) < 0) {
+            perror("server: can't open socket");
+            exit(EXIT_FAILURE);
+        }
 
-    /* init filesystem */
-    init_fs();
-    gettimeofday(&start,NULL);
-    /* process input and print tree */
+        unlink(path);
 
-    for(i=0;i<NumThreads;i++) { /*Chamar threads para o apply command*/
-        if(pthread_create(&tid[i],NULL,applyCommands,NULL)!=0){
+        addrlen = setSockAddrUn (argv[2], &server_addr);
+
+        if (bind(sockfd, (struct sockaddr *) &server_addr, addrlen) < 0) {
+            perror("server: bind error");
             exit(EXIT_FAILURE);
         }
+
+        /* init filesystem */
+        init_fs();
     }
 
-    for(i=0; i<NumThreads;i++){
-        pthread_join(tid[i],NULL);
-        
+    if (tracePath != NULL && trace_open(tracePath) == FAIL) {
+        perror("server: can't open trace file");
+        exit(EXIT_FAILURE);
+    }
+    if (lockProfilePath != NULL && lockprof_open(lockProfilePath) == FAIL) {
+        perror("server: can't open lock profile file");
+        exit(EXIT_FAILURE);
     }
+    registerCommandSites();
+    reply_cache_init();
+    watch_init(sockfd);
+    set_event_handler(publishEvent);
+    find_init(sockfd, read_lock, mutex_lock, mutex_unlock);
+    /* sem o mirror, os clientes continuam a fazer os lookups por pedido */
+    if (mirror_open(path) == FAIL)
+        perror("server: can't create namespace mirror");
+    if ((ctlfd = handoff_listen(path)) == FAIL) {
+        perror("server: can't open control socket");
+        exit(EXIT_FAILURE);
+    }
+    gettimeofday(&start,NULL);
+    /* process input and print tree */
+
+    /* SIGINT e SIGTERM sao tratados apenas pela thread principal, com sigwait */
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    /* SIGUSR1 interrompe os workers no handoff, sem SA_RESTART */
+    memset(&wake, 0, sizeof(wake));
+    wake.sa_handler = wakeWorker;
+    sigaction(SIGUSR1, &wake, NULL);
+    /* um processo novo que falhe a meio do handoff nao pode terminar este */
+    wake.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &wake, NULL);
+
+    startWorkers();
+    if (pthread_create(&handoffThread, NULL, handoffListener, NULL) != 0)
+        exit(EXIT_FAILURE);
 
-    //Fechar e apagar o nome do socket, apesar deste programa 
-    //nunca chegar a este ponto
+    sigwait(&signals, &signal);
+
+    //Fechar e apagar o nome do socket; as threads que estao a meio de um
+    //pedido ficam bloqueadas no lock ate o processo terminar
+    mutex_lock();
+
+    if (trace_enabled()) {
+        /* a arvore final fica junto ao trace, para comparar com um replay */
+        char treePath[PATH_MAX];
+        snprintf(treePath, sizeof(treePath), "%s.tree", tracePath);
+        FILE *output = fopen(treePath, "w");
+        if (output != NULL) {
+            print_tecnicofs_tree(output);
+            fclose(output);
+        }
+        trace_close();
+    }
 
     close(sockfd);
-    unlink(argv[2]);
+    close(ctlfd);
+    /* depois do handoff, os nomes dos sockets sao do processo novo */
+    if (!handedOff) {
+        unlink(argv[2]);
+        handoff_unlink(argv[2]);
+    }
+    mirror_close(argv[2], !handedOff);
     /* release allocated memory */
     destroy_fs();
+    reply_cache_destroy();
 
     gettimeofday(&end,NULL);
     double time = (end.tv_sec - start.tv_sec) + (double)(end.tv_usec - start.tv_usec)/(double)1000000;
     printf("TecnicoFS completed in %.4lf seconds.\n",time);
+    {
+        char stats[4096];
+        int c = sched_stats(stats, sizeof(stats));
+        c += pool_stats(stats + c, sizeof(stats) - c);
+        lockprof_report(stats + c, sizeof(stats) - c);
+        printf("%s", stats);
+    }
+    if (lockprof_close() == FAIL)
+        perror("server: can't write lock profile");
 
     exit(EXIT_SUCCESS);
 }
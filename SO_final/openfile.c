@@ -0,0 +1,213 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/un.h>
+#include "fs/operations.h"
+#include "openfile.h"
+
+/*
+ * An open handle: the i-node and the mode it was opened with.
+ */
+typedef struct open_file {
+	int inumber;
+	permission mode;
+} open_file;
+
+/*
+ * The open handles of one client.
+ */
+typedef struct session {
+	char client[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+	open_file files[MAX_OPEN_FILES];
+	int count;
+	struct session *next;
+} session;
+
+static session *sessions;
+/* number of handles open on each i-node, by every client */
+static int open_count[INODE_TABLE_SIZE];
+
+
+static session *find_session(char *client, int create) {
+	session *s;
+
+	for (s = sessions; s != NULL; s = s->next) {
+		if (strcmp(s->client, client) == 0)
+			return s;
+	}
+	if (!create || strlen(client) >= sizeof(s->client))
+		return NULL;
+
+	s = malloc(sizeof(session));
+	if (s == NULL)
+		return NULL;
+	strcpy(s->client, client);
+	for (int i = 0; i < MAX_OPEN_FILES; i++)
+		s->files[i].inumber = FREE_INODE;
+	s->count = 0;
+	s->next = sessions;
+	sessions = s;
+	return s;
+}
+
+
+/*
+ * Opens an i-node for a client.
+ * Input:
+ *  - client: socket path of the client
+ *  - inumber: identifier of the i-node
+ *  - mode: READ, WRITE or RW
+ * Returns: the handle, or TECNICOFS_ERROR_INVALID_MODE or
+ *  TECNICOFS_ERROR_MAXED_OPEN_FILES
+ */
+int openfile_open(char *client, int inumber, permission mode) {
+	session *s;
+
+	if (mode != READ && mode != WRITE && mode != RW)
+		return TECNICOFS_ERROR_INVALID_MODE;
+	if ((s = find_session(client, 1)) == NULL || s->count == MAX_OPEN_FILES)
+		return TECNICOFS_ERROR_MAXED_OPEN_FILES;
+
+	for (int handle = 0; handle < MAX_OPEN_FILES; handle++) {
+		if (s->files[handle].inumber == FREE_INODE) {
+			s->files[handle].inumber = inumber;
+			s->files[handle].mode = mode;
+			s->count++;
+			open_count[inumber]++;
+			return handle;
+		}
+	}
+	return TECNICOFS_ERROR_MAXED_OPEN_FILES;
+}
+
+
+/*
+ * Checks that a client has a handle open with a mode that allows an
+ * operation (WRITE and READ are bits of RW).
+ * Input:
+ *  - client: socket path of the client
+ *  - handle: the handle
+ *  - mode: mode the operation needs
+ * Returns: the inumber of the handle, or TECNICOFS_ERROR_FILE_NOT_OPEN or
+ *  TECNICOFS_ERROR_INVALID_MODE
+ */
+int openfile_get(char *client, int handle, permission mode) {
+	session *s = find_session(client, 0);
+
+	if (s == NULL || handle < 0 || handle >= MAX_OPEN_FILES || s->files[handle].inumber == FREE_INODE)
+		return TECNICOFS_ERROR_FILE_NOT_OPEN;
+	if ((s->files[handle].mode & mode) != mode)
+		return TECNICOFS_ERROR_INVALID_MODE;
+	return s->files[handle].inumber;
+}
+
+
+/*
+ * Closes a handle of a client.
+ * Returns: SUCCESS or TECNICOFS_ERROR_FILE_NOT_OPEN
+ */
+int openfile_close(char *client, int handle) {
+	session *s = find_session(client, 0);
+
+	if (s == NULL || handle < 0 || handle >= MAX_OPEN_FILES || s->files[handle].inumber == FREE_INODE)
+		return TECNICOFS_ERROR_FILE_NOT_OPEN;
+
+	open_count[s->files[handle].inumber]--;
+	s->files[handle].inumber = FREE_INODE;
+	s->count--;
+	return SUCCESS;
+}
+
+
+/*
+ * Closes every handle of a client, when it unmounts.
+ */
+void openfile_end_session(char *client) {
+	session **prev = &sessions;
+
+	for (session *s = sessions; s != NULL; prev = &s->next, s = s->next) {
+		if (strcmp(s->client, client) == 0) {
+			for (int handle = 0; handle < MAX_OPEN_FILES; handle++) {
+				if (s->files[handle].inumber != FREE_INODE)
+					open_count[s->files[handle].inumber]--;
+			}
+			*prev = s->next;
+			free(s);
+			return;
+		}
+	}
+}
+
+
+/*
+ * Returns: 1 if some client has the i-node open
+ */
+int openfile_is_open(int inumber) {
+	return inumber >= 0 && inumber < INODE_TABLE_SIZE && open_count[inumber] > 0;
+}
+
+
+/*
+ * Returns: 1 if some client has the i-node, or a node below it, open
+ */
+int openfile_subtree_is_open(int inumber) {
+	type nType;
+	union Data data;
+
+	if (inumber < 0)
+		return 0;
+	if (openfile_is_open(inumber))
+		return 1;
+	if (inode_get(inumber, &nType, &data) == FAIL || nType != T_DIRECTORY)
+		return 0;
+
+	for (int i = 0; i < data.directory->capacity; i++) {
+		int sub_inumber = data.directory->entries[i].inumber;
+		if (sub_inumber != FREE_INODE && openfile_subtree_is_open(sub_inumber))
+			return 1;
+	}
+	return 0;
+}
+
+
+/*
+ * Saves the open-file tables, to be loaded by another server process.
+ * Returns: SUCCESS or FAIL
+ */
+int openfile_save(FILE *fp) {
+	session end;
+
+	for (session *s = sessions; s != NULL; s = s->next) {
+		if (fwrite(s, sizeof(session), 1, fp) != 1)
+			return FAIL;
+	}
+	memset(&end, 0, sizeof(end));
+	return fwrite(&end, sizeof(end), 1, fp) == 1 ? SUCCESS : FAIL;
+}
+
+
+/*
+ * Loads the open-file tables saved by openfile_save.
+ * Returns: SUCCESS or FAIL
+ */
+int openfile_load(FILE *fp) {
+	session saved, *s;
+
+	while (fread(&saved, sizeof(saved), 1, fp) == 1) {
+		if (saved.client[0] == '\0')
+			return SUCCESS;
+		if ((s = malloc(sizeof(session))) == NULL)
+			return FAIL;
+		*s = saved;
+		s->next = sessions;
+		sessions = s;
+		for (int handle = 0; handle < MAX_OPEN_FILES; handle++) {
+			int inumber = s->files[handle].inumber;
+			if (inumber >= INODE_TABLE_SIZE)
+				return FAIL;
+			if (inumber != FREE_INODE)
+				open_count[inumber]++;
+		}
+	}
+	return FAIL;
+}
@@ -0,0 +1,25 @@
+#ifndef OPENFILE_H
+#define OPENFILE_H
+
+#include <stdio.h>
+#include "tecnicofs-api-constants.h"
+
+/*
+ * Open-file tables: every client, identified by the path of its socket,
+ * has its own table of MAX_OPEN_FILES handles. A handle refers to the
+ * i-node and not to the path, so it stays valid when the node is moved
+ * within the server. An open node cannot be deleted, nor moved to another
+ * shard.
+ * All functions must be called with the server lock held.
+ */
+
+int openfile_open(char *client, int inumber, permission mode);
+int openfile_get(char *client, int handle, permission mode);
+int openfile_close(char *client, int handle);
+void openfile_end_session(char *client);
+int openfile_is_open(int inumber);
+int openfile_subtree_is_open(int inumber);
+int openfile_save(FILE *fp);
+int openfile_load(FILE *fp);
+
+#endif /* OPENFILE_H */
@@ -0,0 +1,205 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "fs/state.h"
+#include "lockprof.h"
+#include "trace.h"
+#include "pool.h"
+
+static pool_handler handler;
+static int min_size = 1, max_size = POOL_MAX_THREADS;
+/* workers running, and how many of them are applying a request */
+static int running, busy;
+static int peak;
+static unsigned long grown, retired;
+static int stopping;
+static pthread_t manager;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+/* sitio do lock do pool no profiler de locks */
+static int pool_site;
+
+
+/*
+ * Tells a worker whether to leave, and counts it out if so: always when
+ * the pool is stopping or above its maximum, and above the minimum when
+ * the worker had nothing to do.
+ */
+static int worker_leaves(int idle, int stopped) {
+	int leaves;
+
+	lockprof_mutex_lock(&pool_lock, pool_site);
+	leaves = stopped || running > max_size || (idle && running > min_size);
+	if (leaves) {
+		running--;
+		if (!stopped)
+			retired++;
+		pthread_cond_broadcast(&pool_cond);
+	}
+	lockprof_mutex_unlock(&pool_lock);
+	return leaves;
+}
+
+
+static void *worker() {
+	sched_request request;
+	int res;
+
+	do {
+		res = sched_pop(&request, POOL_IDLE_MS);
+		if (res == SUCCESS) {
+			lockprof_mutex_lock(&pool_lock, pool_site);
+			busy++;
+			lockprof_mutex_unlock(&pool_lock);
+			handler(&request);
+			lockprof_mutex_lock(&pool_lock, pool_site);
+			busy--;
+			lockprof_mutex_unlock(&pool_lock);
+		}
+	} while (!worker_leaves(res == SCHED_TIMEOUT, res == FAIL));
+
+	/* o trace e o profiler guardam estado por thread, que os workers novos reutilizam */
+	trace_thread_exit();
+	lockprof_thread_exit();
+	return NULL;
+}
+
+
+/*
+ * Starts a worker. Must be called with the pool lock held.
+ * Returns: SUCCESS or FAIL
+ */
+static int add_worker() {
+	pthread_t thread;
+
+	if (pthread_create(&thread, NULL, worker, NULL) != 0)
+		return FAIL;
+	pthread_detach(thread);
+	if (++running > peak)
+		peak = running;
+	return SUCCESS;
+}
+
+
+/*
+ * Adds a worker when every worker is busy and the requests waiting are
+ * many or have waited long, and keeps the pool within its bounds.
+ */
+static void *manage() {
+	while (1) {
+		double wait_us;
+		int depth;
+
+		usleep(POOL_TICK_MS * 1000);
+		sched_load(&depth, &wait_us);
+
+		lockprof_mutex_lock(&pool_lock, pool_site);
+		if (stopping) {
+			lockprof_mutex_unlock(&pool_lock);
+			return NULL;
+		}
+		if (running < min_size ||
+		    (running < max_size && depth > 0 && busy == running &&
+		     (depth >= POOL_GROW_DEPTH || wait_us >= POOL_GROW_WAIT_US))) {
+			if (add_worker() == SUCCESS)
+				grown++;
+		}
+		lockprof_mutex_unlock(&pool_lock);
+	}
+}
+
+
+/*
+ * Sets the bounds of the pool. A pool above the new maximum shrinks as
+ * its workers finish their requests, and one below the new minimum grows
+ * on the next tick of the manager.
+ * Returns: SUCCESS, or FAIL if the bounds are not 1 <= min <= max <=
+ * POOL_MAX_THREADS
+ */
+int pool_set_bounds(int min, int max) {
+	if (min < 1 || min > max || max > POOL_MAX_THREADS)
+		return FAIL;
+	lockprof_mutex_lock(&pool_lock, LOCKPROF_OTHER);
+	min_size = min;
+	max_size = max;
+	lockprof_mutex_unlock(&pool_lock);
+	return SUCCESS;
+}
+
+
+/*
+ * Returns the number of workers running.
+ */
+int pool_size() {
+	int res;
+
+	lockprof_mutex_lock(&pool_lock, LOCKPROF_OTHER);
+	res = running;
+	lockprof_mutex_unlock(&pool_lock);
+	return res;
+}
+
+
+/*
+ * Starts the workers, which apply the requests the scheduler gives them.
+ * Input:
+ *  - initial: workers to start with, brought within the bounds
+ *  - apply: applies a request and frees its buffer
+ * Returns: SUCCESS, or FAIL if no worker could be started
+ */
+int pool_start(int initial, pool_handler apply) {
+	pool_site = lockprof_site("pool");
+	handler = apply;
+	sched_start();
+
+	lockprof_mutex_lock(&pool_lock, LOCKPROF_OTHER);
+	stopping = 0;
+	if (initial < min_size)
+		initial = min_size;
+	if (initial > max_size)
+		initial = max_size;
+	while (running < initial && add_worker() == SUCCESS)
+		;
+	lockprof_mutex_unlock(&pool_lock);
+
+	if (pool_size() == 0 || pthread_create(&manager, NULL, manage, NULL) != 0)
+		return FAIL;
+	return SUCCESS;
+}
+
+
+/*
+ * Stops the manager and then the workers, once they have applied every
+ * request already queued.
+ */
+void pool_stop() {
+	lockprof_mutex_lock(&pool_lock, LOCKPROF_OTHER);
+	stopping = 1;
+	lockprof_mutex_unlock(&pool_lock);
+	pthread_join(manager, NULL);
+
+	sched_stop();
+	lockprof_mutex_lock(&pool_lock, LOCKPROF_OTHER);
+	while (running > 0)
+		lockprof_cond_wait(&pool_cond, &pool_lock, LOCKPROF_OTHER);
+	lockprof_mutex_unlock(&pool_lock);
+}
+
+
+/*
+ * Writes the size and bounds of the pool, in one line.
+ * Input:
+ *  - buffer: where the line is written
+ *  - size: size of the buffer
+ * Returns: length of the line
+ */
+int pool_stats(char *buffer, int size) {
+	int c;
+
+	lockprof_mutex_lock(&pool_lock, LOCKPROF_OTHER);
+	c = snprintf(buffer, size, "pool size=%d busy=%d min=%d max=%d peak=%d grown=%lu retired=%lu\n",
+	             running, busy, min_size, max_size, peak, grown, retired);
+	lockprof_mutex_unlock(&pool_lock);
+	return c < size ? c : size - 1;
+}
@@ -0,0 +1,35 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include "scheduler.h"
+
+/*
+ * Elastic pool of the workers that apply the requests. A manager thread
+ * looks at the queues of the scheduler every POOL_TICK_MS and adds a
+ * worker while requests pile up or wait too long for one, up to the
+ * maximum; a worker that finds nothing to do for POOL_IDLE_MS leaves,
+ * down to the minimum. Has its own lock, so it can be called with or
+ * without the server lock held.
+ */
+
+#define POOL_MAX_THREADS 64
+
+/* How often the manager looks at the queues */
+#define POOL_TICK_MS 10
+
+/* How long a worker waits for a request before it leaves */
+#define POOL_IDLE_MS 2000
+
+/* Requests waiting, or how long they wait, for which a worker is added */
+#define POOL_GROW_DEPTH 8
+#define POOL_GROW_WAIT_US 2000
+
+typedef void (*pool_handler)(sched_request *request);
+
+int pool_set_bounds(int min, int max);
+int pool_size();
+int pool_start(int size, pool_handler handler);
+void pool_stop();
+int pool_stats(char *buffer, int size);
+
+#endif /* POOL_H */
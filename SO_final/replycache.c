@@ -0,0 +1,249 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "fs/path.h"
+#include "lockprof.h"
+#include "replycache.h"
+
+#define REPLY_CACHE_BUCKETS (2 * REPLY_CACHE_SIZE)
+
+/*
+ * A cached reply. While the request is being applied the entry is pending
+ * and has no reply: copies of the request that arrive then are ignored.
+ */
+typedef struct cached_reply {
+	char client[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+	unsigned long seq;
+	uint32_t hash;
+	int used;
+	int pending;
+	char *reply;
+	int length;
+	int next;
+} cached_reply;
+
+static cached_reply entries[REPLY_CACHE_SIZE];
+/* first entry of each bucket, plus one (0 is an empty bucket) */
+static int buckets[REPLY_CACHE_BUCKETS];
+/* next entry to reuse, the oldest one */
+static int oldest;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static int cache_site;
+
+
+static void lock_cache() {
+	lockprof_mutex_lock(&cache_lock, cache_site);
+}
+
+
+/*
+ * Registers the site of the cache lock in the lock profiler. Called once,
+ * before the workers start.
+ */
+void reply_cache_init() {
+	cache_site = lockprof_site("replycache");
+}
+
+
+static uint32_t request_hash(char *client, unsigned long seq) {
+	return name_hash(client, strlen(client)) ^ (uint32_t) (seq * 2654435761u);
+}
+
+
+static cached_reply *find_entry(char *client, unsigned long seq, uint32_t hash) {
+	for (int i = buckets[hash % REPLY_CACHE_BUCKETS]; i != 0; i = entries[i - 1].next) {
+		cached_reply *entry = &entries[i - 1];
+		if (entry->hash == hash && entry->seq == seq && strcmp(entry->client, client) == 0)
+			return entry;
+	}
+	return NULL;
+}
+
+
+/*
+ * Frees an entry and takes it out of its bucket.
+ */
+static void forget_entry(cached_reply *entry) {
+	int index = entry - entries + 1;
+	int *link = &buckets[entry->hash % REPLY_CACHE_BUCKETS];
+
+	while (*link != index)
+		link = &entries[*link - 1].next;
+	*link = entry->next;
+
+	free(entry->reply);
+	entry->reply = NULL;
+	entry->used = 0;
+}
+
+
+/*
+ * Takes the oldest entry that is not pending for a new request.
+ * Returns: the entry, or NULL if every entry is pending
+ */
+static cached_reply *new_entry(char *client, unsigned long seq, uint32_t hash) {
+	cached_reply *entry = NULL;
+
+	for (int i = 0; i < REPLY_CACHE_SIZE; i++) {
+		entry = &entries[oldest];
+		oldest = (oldest + 1) % REPLY_CACHE_SIZE;
+		if (!entry->used || !entry->pending)
+			break;
+	}
+	if (entry->used) {
+		if (entry->pending)
+			return NULL;
+		forget_entry(entry);
+	}
+
+	strcpy(entry->client, client);
+	entry->seq = seq;
+	entry->hash = hash;
+	entry->used = 1;
+	entry->pending = 1;
+	entry->next = buckets[hash % REPLY_CACHE_BUCKETS];
+	buckets[hash % REPLY_CACHE_BUCKETS] = entry - entries + 1;
+	return entry;
+}
+
+
+/*
+ * Looks up the reply to a request, or records that it is being applied.
+ * Input:
+ *  - client: address of the client
+ *  - seq: sequence number of the request
+ *  - reply: buffer for the cached reply
+ *  - size: size of that buffer
+ * Returns: the length of the reply copied to the buffer, REPLY_CACHE_PENDING
+ *  if the request is being applied or REPLY_CACHE_MISS if it is new (the
+ *  caller must then apply it and call reply_cache_end)
+ */
+int reply_cache_begin(struct sockaddr_un *client, unsigned long seq, char *reply, int size) {
+	uint32_t hash = request_hash(client->sun_path, seq);
+	cached_reply *entry;
+	int res;
+
+	lock_cache();
+	if ((entry = find_entry(client->sun_path, seq, hash)) != NULL) {
+		res = entry->pending ? REPLY_CACHE_PENDING : entry->length < size ? entry->length : size - 1;
+		if (res >= 0) {
+			memcpy(reply, entry->reply, res);
+			reply[res] = '\0';
+		}
+		lockprof_mutex_unlock(&cache_lock);
+		return res;
+	}
+
+	/* se estiverem todas a meio de um pedido, este e aplicado sem cache */
+	new_entry(client->sun_path, seq, hash);
+	lockprof_mutex_unlock(&cache_lock);
+	return REPLY_CACHE_MISS;
+}
+
+
+/*
+ * Stores the reply to a request started with reply_cache_begin. With a
+ * NULL reply the request is forgotten, so a copy of it is applied again.
+ */
+void reply_cache_end(struct sockaddr_un *client, unsigned long seq, char *reply, int length) {
+	uint32_t hash = request_hash(client->sun_path, seq);
+	cached_reply *entry;
+
+	lock_cache();
+	if ((entry = find_entry(client->sun_path, seq, hash)) != NULL && entry->pending) {
+		if (reply == NULL || (entry->reply = malloc(length + 1)) == NULL)
+			forget_entry(entry);
+		else {
+			memcpy(entry->reply, reply, length + 1);
+			entry->length = length;
+			entry->pending = 0;
+		}
+	}
+	lockprof_mutex_unlock(&cache_lock);
+}
+
+
+/*
+ * Forgets the replies to a client that ended its session.
+ */
+void reply_cache_end_session(char *client) {
+	lock_cache();
+	for (int i = 0; i < REPLY_CACHE_SIZE; i++) {
+		if (entries[i].used && !entries[i].pending && strcmp(entries[i].client, client) == 0)
+			forget_entry(&entries[i]);
+	}
+	lockprof_mutex_unlock(&cache_lock);
+}
+
+
+void reply_cache_destroy() {
+	lock_cache();
+	for (int i = 0; i < REPLY_CACHE_SIZE; i++) {
+		if (entries[i].used)
+			forget_entry(&entries[i]);
+	}
+	lockprof_mutex_unlock(&cache_lock);
+}
+
+
+/*
+ * Saves the cached replies from the oldest to the newest, to be loaded by
+ * another server process.
+ * Returns: SUCCESS or FAIL
+ */
+int reply_cache_save(FILE *fp) {
+	int end = -1;
+
+	lock_cache();
+	for (int i = 0; i < REPLY_CACHE_SIZE; i++) {
+		cached_reply *entry = &entries[(oldest + i) % REPLY_CACHE_SIZE];
+
+		if (!entry->used || entry->pending)
+			continue;
+		if (fwrite(&entry->length, sizeof(int), 1, fp) != 1 ||
+		    fwrite(entry->client, sizeof(entry->client), 1, fp) != 1 ||
+		    fwrite(&entry->seq, sizeof(entry->seq), 1, fp) != 1 ||
+		    fwrite(entry->reply, 1, entry->length, fp) != entry->length) {
+			lockprof_mutex_unlock(&cache_lock);
+			return FAIL;
+		}
+	}
+	lockprof_mutex_unlock(&cache_lock);
+	return fwrite(&end, sizeof(end), 1, fp) == 1 ? SUCCESS : FAIL;
+}
+
+
+/*
+ * Loads the replies saved by reply_cache_save into an empty cache.
+ * Returns: SUCCESS or FAIL
+ */
+int reply_cache_load(FILE *fp) {
+	char client[sizeof(entries[0].client)];
+	unsigned long seq;
+	int length;
+
+	while (fread(&length, sizeof(length), 1, fp) == 1) {
+		cached_reply *entry;
+		char *reply;
+
+		if (length < 0)
+			return SUCCESS;
+		if (fread(client, sizeof(client), 1, fp) != 1 || fread(&seq, sizeof(seq), 1, fp) != 1 ||
+		    (reply = malloc(length + 1)) == NULL)
+			return FAIL;
+		if (fread(reply, 1, length, fp) != length) {
+			free(reply);
+			return FAIL;
+		}
+		reply[length] = '\0';
+		client[sizeof(client) - 1] = '\0';
+
+		lock_cache();
+		entry = new_entry(client, seq, request_hash(client, seq));
+		entry->reply = reply;
+		entry->length = length;
+		entry->pending = 0;
+		lockprof_mutex_unlock(&cache_lock);
+	}
+	return FAIL;
+}
@@ -0,0 +1,32 @@
+#ifndef REPLYCACHE_H
+#define REPLYCACHE_H
+
+#include <stdio.h>
+#include <sys/un.h>
+
+/*
+ * Replies to requests that change the server, kept so a request the
+ * client sends again (after a timeout) is answered with the same reply
+ * instead of being applied twice. A request is identified by the client
+ * socket and the sequence number the client gave it ("#<seq> <command>").
+ * The cache holds the last REPLY_CACHE_SIZE replies; older ones are
+ * forgotten. Has its own lock, so it can be called with or without the
+ * server lock held.
+ */
+
+/* Replies kept at any time */
+#define REPLY_CACHE_SIZE 1024
+
+/* reply_cache_begin: the request is new, or is still being applied */
+#define REPLY_CACHE_MISS -1
+#define REPLY_CACHE_PENDING -2
+
+void reply_cache_init();
+int reply_cache_begin(struct sockaddr_un *client, unsigned long seq, char *reply, int size);
+void reply_cache_end(struct sockaddr_un *client, unsigned long seq, char *reply, int length);
+void reply_cache_end_session(char *client);
+void reply_cache_destroy();
+int reply_cache_save(FILE *fp);
+int reply_cache_load(FILE *fp);
+
+#endif /* REPLYCACHE_H */
@@ -0,0 +1,20 @@
+#!/bin/bash
+# Runs an input file against a namespace sharded across several servers
+# Usage: ./runShards.sh inputfile numshards numthreads
+
+INPUT=$1
+SHARDS=$2
+THREADS=$3
+
+MAP=""
+for ((shard=0; shard<$SHARDS; shard++));
+do
+    ./tecnicofs $THREADS /tmp/tecnicofs-shard-$shard > /dev/null &
+    PIDS="$PIDS $!"
+    MAP="$MAP${MAP:+,}/tmp/tecnicofs-shard-$shard"
+done
+sleep 0.2
+
+./tecnicofs-client $INPUT $MAP
+
+kill $PIDS
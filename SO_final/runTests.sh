@@ -1,18 +1,40 @@
 #!/bin/bash
+# Sweeps the number of server threads, running tecnicofs-bench against a
+# fresh server for each one, and writes the scaling curve to a CSV file
+# (or a JSON array if the file name ends in .json)
+# Usage: ./runTests.sh maxthreads outputfile [tecnicofs-bench options]
 
-INPUTS=$1
-OUTPUTS=$2
-MAXTHREADS=$3
+MAXTHREADS=$1
+OUTPUT=$2
+shift 2
+SOCKET=/tmp/tecnicofs-bench-$$
 
+case $OUTPUT in
+    *.json) FORMAT=-j; echo "[" > $OUTPUT ;;
+    *) FORMAT=; echo "server_threads,clients,ops,failed,seconds,ops_per_sec,lookups,creates,deletes,moves,p50_us,p90_us,p99_us,p999_us" > $OUTPUT ;;
+esac
 
-for file in $INPUTS/*.txt;
+for ((thread=1; thread<=$MAXTHREADS; thread++));
 do
-    for ((thread=1; thread<=$MAXTHREADS; thread++));
-        do 
-            TESTNAME=$(echo $file| cut -d "/" -f 2)
+    # a pool of exactly $thread workers, so the bench measures the server
+    # itself with that many threads
+    ./tecnicofs -w $thread:$thread $thread $SOCKET > /dev/null &
+    SERVER=$!
+    sleep 0.2
 
-            echo InputFile=$TESTNAME NumThreads=$thread
+    echo NumThreads=$thread
+    RESULT=$(./tecnicofs-bench $FORMAT -T $thread "$@" $SOCKET)
+    echo "$RESULT"
+    if [ -n "$FORMAT" ] && [ $thread -lt $MAXTHREADS ]; then
+        RESULT="$RESULT,"
+    fi
+    echo "$RESULT" >> $OUTPUT
 
-            ./tecnicofs $file $OUTPUTS/$TESTNAME-$thread.txt $thread | grep "TecnicoFS completed in"
-        done
-done
\ No newline at end of file
+    kill $SERVER
+    wait $SERVER 2> /dev/null
+done
+
+if [ -n "$FORMAT" ]; then
+    echo "]" >> $OUTPUT
+fi
+rm -f $SOCKET
@@ -0,0 +1,468 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include "fs/path.h"
+#include "lockprof.h"
+#include "scheduler.h"
+
+/* Latencies are counted in buckets of powers of two microseconds */
+#define LATENCY_BUCKETS 32
+
+#define SCHED_CLIENT_BUCKETS (2 * SCHED_MAX_CLIENTS)
+
+/*
+ * A request waiting in the queue of its client.
+ */
+typedef struct sched_node {
+	sched_request request;
+	struct sched_node *next;
+} sched_node;
+
+/*
+ * The requests of a client in a class, and its place in the round of
+ * the class while it has requests waiting.
+ */
+typedef struct sched_flow {
+	sched_node *head;
+	sched_node *tail;
+	int deficit; /* bytes it can still have served on its turn */
+	int next; /* next client in the round, plus one */
+} sched_flow;
+
+/*
+ * A client, with its token bucket and its queue in each class.
+ */
+typedef struct sched_client {
+	char client[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+	uint32_t hash;
+	int used;
+	int queued;
+	double tokens;
+	struct timespec refilled;
+	int next; /* next client in the same bucket, plus one */
+	sched_flow flows[SCHED_CLASSES];
+} sched_client;
+
+/*
+ * The round of the clients with requests of a class waiting, with its
+ * share in the round robin of the classes and the metrics of the requests
+ * it served.
+ */
+typedef struct sched_class {
+	int first; /* client whose turn it is, plus one */
+	int last;
+	int count;
+	int current;
+	int max_depth;
+	unsigned long served;
+	unsigned long rejected;
+	unsigned long limited;
+	double wait_us;
+	double latency_us;
+	unsigned long histogram[LATENCY_BUCKETS];
+} sched_class;
+
+static const char *class_names[SCHED_CLASSES] = { "interactive", "mutation", "bulk" };
+static const int weights[SCHED_CLASSES] = SCHED_WEIGHTS;
+
+static sched_class classes[SCHED_CLASSES];
+static sched_client clients[SCHED_MAX_CLIENTS];
+/* first client of each bucket, plus one (0 is an empty bucket) */
+static int buckets[SCHED_CLIENT_BUCKETS];
+/* next client to try to forget, when the table is full */
+static int oldest;
+static int client_rate = SCHED_CLIENT_RATE;
+static int client_burst = SCHED_CLIENT_BURST;
+static int waiting;
+static int stopping;
+/* media movel da espera dos ultimos pedidos servidos, em microssegundos */
+static double recent_wait_us;
+static pthread_mutex_t sched_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sched_cond = PTHREAD_COND_INITIALIZER;
+/* sitios do lock das filas no profiler de locks */
+static int push_site, pop_site, done_site;
+
+
+static double elapsed_us(struct timespec *from, struct timespec *to) {
+	return (to->tv_sec - from->tv_sec) * 1e6 + (to->tv_nsec - from->tv_nsec) / 1e3;
+}
+
+
+/*
+ * Takes a client out of its bucket, if it has one.
+ */
+static void forget_client(sched_client *client) {
+	int index = client - clients + 1;
+	int *link = &buckets[client->hash % SCHED_CLIENT_BUCKETS];
+
+	while (*link != index)
+		link = &clients[*link - 1].next;
+	*link = client->next;
+	client->used = 0;
+}
+
+
+/*
+ * Finds a client, or starts tracking it with a full bucket.
+ * Returns: the client, or NULL if every client tracked has requests waiting
+ */
+static sched_client *find_client(struct sockaddr_un *address, struct timespec *now) {
+	uint32_t hash = name_hash(address->sun_path, strlen(address->sun_path));
+	sched_client *client = NULL;
+
+	for (int i = buckets[hash % SCHED_CLIENT_BUCKETS]; i != 0; i = clients[i - 1].next) {
+		client = &clients[i - 1];
+		if (client->hash == hash && strcmp(client->client, address->sun_path) == 0)
+			return client;
+	}
+
+	/* um cliente sem pedidos na fila pode ser esquecido */
+	for (int i = 0; i < SCHED_MAX_CLIENTS; i++) {
+		client = &clients[oldest];
+		oldest = (oldest + 1) % SCHED_MAX_CLIENTS;
+		if (!client->used || client->queued == 0)
+			break;
+	}
+	if (client->used) {
+		if (client->queued > 0)
+			return NULL;
+		forget_client(client);
+	}
+
+	strcpy(client->client, address->sun_path);
+	client->hash = hash;
+	client->used = 1;
+	client->tokens = client_burst;
+	client->refilled = *now;
+	client->next = buckets[hash % SCHED_CLIENT_BUCKETS];
+	buckets[hash % SCHED_CLIENT_BUCKETS] = client - clients + 1;
+	return client;
+}
+
+
+/*
+ * Takes a token from the bucket of a client, refilled at client_rate
+ * tokens per second since it was last refilled.
+ * Returns: SUCCESS, or FAIL if the bucket is empty
+ */
+static int take_token(sched_client *client, struct timespec *now) {
+	if (client_rate <= 0)
+		return SUCCESS;
+	client->tokens += elapsed_us(&client->refilled, now) * client_rate / 1e6;
+	if (client->tokens > client_burst)
+		client->tokens = client_burst;
+	client->refilled = *now;
+	if (client->tokens < 1)
+		return FAIL;
+	client->tokens--;
+	return SUCCESS;
+}
+
+
+/*
+ * Returns the class of a request, given its text with or without the
+ * "#<seq> " prefix.
+ */
+int sched_classify(const char *command) {
+	if (command[0] == '#') {
+		const char *space = strchr(command, ' ');
+		command = space ? space + 1 : "";
+	}
+	if (command[0] != '\0' && strchr("lLvrRSDEQPA", command[0]) != NULL)
+		return SCHED_INTERACTIVE;
+	if (command[0] != '\0' && strchr("poikatF", command[0]) != NULL)
+		return SCHED_BULK;
+	return SCHED_MUTATION;
+}
+
+
+/*
+ * Queues a request received from a client, after the ones that client
+ * already has waiting in the same class.
+ * Input:
+ *  - client: address of the client
+ *  - buffer: the request, terminated
+ *  - length: length of the request
+ * Returns: SUCCESS, or FAIL if the client is over its rate or the queue
+ *  of the class is full
+ */
+int sched_push(struct sockaddr_un *client, const char *buffer, int length) {
+	int class = sched_classify(buffer);
+	sched_class *c = &classes[class];
+	sched_client *owner;
+	sched_flow *flow;
+	sched_node *node = malloc(sizeof(sched_node));
+	char *copy = malloc(length + 1);
+	struct timespec now;
+
+	if (node == NULL || copy == NULL) {
+		free(node);
+		free(copy);
+		return FAIL;
+	}
+	memcpy(copy, buffer, length + 1);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	lockprof_mutex_lock(&sched_lock, push_site);
+	if (c->count == SCHED_QUEUE_SIZE || (owner = find_client(client, &now)) == NULL) {
+		c->rejected++;
+		lockprof_mutex_unlock(&sched_lock);
+		free(node);
+		free(copy);
+		return FAIL;
+	}
+	if (take_token(owner, &now) == FAIL) {
+		c->limited++;
+		lockprof_mutex_unlock(&sched_lock);
+		free(node);
+		free(copy);
+		return FAIL;
+	}
+
+	node->request.client = *client;
+	node->request.buffer = copy;
+	node->request.length = length;
+	node->request.class = class;
+	node->request.received = now;
+	node->next = NULL;
+
+	/* um cliente que nao tinha pedidos desta classe entra no fim da ronda */
+	flow = &owner->flows[class];
+	if (flow->head == NULL) {
+		flow->head = node;
+		flow->deficit = SCHED_QUANTUM;
+		flow->next = 0;
+		if (c->last != 0)
+			clients[c->last - 1].flows[class].next = owner - clients + 1;
+		else
+			c->first = owner - clients + 1;
+		c->last = owner - clients + 1;
+	}
+	else
+		flow->tail->next = node;
+	flow->tail = node;
+	owner->queued++;
+
+	if (++c->count > c->max_depth)
+		c->max_depth = c->count;
+	waiting++;
+	pthread_cond_signal(&sched_cond);
+	lockprof_mutex_unlock(&sched_lock);
+	return SUCCESS;
+}
+
+
+/*
+ * Takes the next request of a class by deficit round robin: the client
+ * whose turn it is has its first request served if the bytes it can still
+ * have served cover it, and otherwise passes the turn to the next one,
+ * getting another SCHED_QUANTUM bytes for its next turn.
+ */
+static sched_node *take_request(int class) {
+	sched_class *c = &classes[class];
+
+	while (1) {
+		sched_client *client = &clients[c->first - 1];
+		sched_flow *flow = &client->flows[class];
+		sched_node *node = flow->head;
+
+		if (node->request.length <= flow->deficit) {
+			flow->deficit -= node->request.length;
+			client->queued--;
+			if ((flow->head = node->next) == NULL) {
+				/* sem pedidos, sai da ronda e nao guarda o que sobrou */
+				flow->tail = NULL;
+				flow->deficit = 0;
+				c->first = flow->next;
+				if (c->first == 0)
+					c->last = 0;
+			}
+			return node;
+		}
+
+		flow->deficit += SCHED_QUANTUM;
+		if (flow->next != 0) {
+			c->first = flow->next;
+			clients[c->last - 1].flows[class].next = client - clients + 1;
+			c->last = client - clients + 1;
+			flow->next = 0;
+		}
+	}
+}
+
+
+/*
+ * Takes the next request, waiting for one. Among the classes with
+ * requests waiting, the one with the most credit is served: each adds its
+ * weight to its credit and the one served pays the sum of their weights.
+ * Input:
+ *  - request: filled with the request, whose buffer the caller frees
+ *  - timeout_ms: how long to wait for one
+ * Returns: SUCCESS, SCHED_TIMEOUT if no request came in time, or FAIL once
+ * stopped and every queue is empty
+ */
+int sched_pop(sched_request *request, int timeout_ms) {
+	int total = 0, best = -1;
+	struct timespec deadline;
+	sched_node *node;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += timeout_ms / 1000;
+	deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+
+	lockprof_mutex_lock(&sched_lock, pop_site);
+	while (waiting == 0 && !stopping) {
+		if (lockprof_cond_timedwait(&sched_cond, &sched_lock, pop_site, &deadline) == ETIMEDOUT &&
+		    waiting == 0 && !stopping) {
+			lockprof_mutex_unlock(&sched_lock);
+			return SCHED_TIMEOUT;
+		}
+	}
+	/* ao parar, os pedidos que ja estao na fila sao aplicados na mesma */
+	if (waiting == 0) {
+		lockprof_mutex_unlock(&sched_lock);
+		return FAIL;
+	}
+
+	for (int i = 0; i < SCHED_CLASSES; i++) {
+		if (classes[i].count == 0)
+			continue;
+		classes[i].current += weights[i];
+		total += weights[i];
+		if (best < 0 || classes[i].current > classes[best].current)
+			best = i;
+	}
+	sched_class *c = &classes[best];
+	c->current -= total;
+	node = take_request(best);
+	/* uma classe que esvazia nao guarda credito para depois */
+	if (--c->count == 0)
+		c->current = 0;
+	waiting--;
+	clock_gettime(CLOCK_MONOTONIC, &node->request.started);
+	recent_wait_us += (elapsed_us(&node->request.received, &node->request.started) - recent_wait_us) / 8;
+	lockprof_mutex_unlock(&sched_lock);
+
+	*request = node->request;
+	free(node);
+	return SUCCESS;
+}
+
+
+/*
+ * Counts a request as served, from when it was received until now.
+ */
+void sched_done(sched_request *request) {
+	struct timespec now;
+	double latency;
+	int bucket = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	latency = elapsed_us(&request->received, &now);
+	while (bucket < LATENCY_BUCKETS - 1 && latency >= (2UL << bucket))
+		bucket++;
+
+	lockprof_mutex_lock(&sched_lock, done_site);
+	sched_class *c = &classes[request->class];
+	c->served++;
+	c->wait_us += elapsed_us(&request->received, &request->started);
+	c->latency_us += latency;
+	c->histogram[bucket]++;
+	lockprof_mutex_unlock(&sched_lock);
+}
+
+
+/*
+ * Makes sched_pop fail once the queues are empty, so the workers stop.
+ */
+void sched_stop() {
+	lockprof_mutex_lock(&sched_lock, LOCKPROF_OTHER);
+	stopping = 1;
+	pthread_cond_broadcast(&sched_cond);
+	lockprof_mutex_unlock(&sched_lock);
+}
+
+
+void sched_start() {
+	push_site = lockprof_site("sched push");
+	pop_site = lockprof_site("sched pop");
+	done_site = lockprof_site("sched done");
+	lockprof_mutex_lock(&sched_lock, LOCKPROF_OTHER);
+	stopping = 0;
+	lockprof_mutex_unlock(&sched_lock);
+}
+
+
+/*
+ * Sets the requests per second each client can send (0 for no limit) and
+ * how many it can send in a burst.
+ */
+void sched_set_rate(int rate, int burst) {
+	lockprof_mutex_lock(&sched_lock, LOCKPROF_OTHER);
+	client_rate = rate;
+	client_burst = burst < 1 ? 1 : burst;
+	lockprof_mutex_unlock(&sched_lock);
+}
+
+
+/*
+ * Tells how loaded the queues are.
+ * Input:
+ *  - depth: set to the requests waiting in every class
+ *  - wait_us: set to the moving average of how long the last requests
+ *    served waited in the queues
+ */
+void sched_load(int *depth, double *wait_us) {
+	lockprof_mutex_lock(&sched_lock, LOCKPROF_OTHER);
+	*depth = waiting;
+	*wait_us = recent_wait_us;
+	lockprof_mutex_unlock(&sched_lock);
+}
+
+
+/*
+ * Upper bound, in microseconds, of the latency of a fraction p of the
+ * requests served by a class.
+ */
+static unsigned long percentile(sched_class *c, double p) {
+	unsigned long seen = 0;
+
+	for (int bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+		seen += c->histogram[bucket];
+		if (seen >= p * c->served)
+			return 2UL << bucket;
+	}
+	return 2UL << (LATENCY_BUCKETS - 1);
+}
+
+
+/*
+ * Writes the metrics of each class, one line per class.
+ * Input:
+ *  - buffer: where the metrics are written
+ *  - size: size of the buffer
+ * Returns: length of the metrics
+ */
+int sched_stats(char *buffer, int size) {
+	int c = 0;
+
+	lockprof_mutex_lock(&sched_lock, LOCKPROF_OTHER);
+	for (int i = 0; i < SCHED_CLASSES && c < size; i++) {
+		sched_class *class = &classes[i];
+		double served = class->served ? class->served : 1;
+
+		c += snprintf(buffer + c, size - c,
+		              "%s depth=%d max_depth=%d served=%lu rejected=%lu limited=%lu wait_avg_us=%.1f "
+		              "latency_avg_us=%.1f p50_us<=%lu p99_us<=%lu\n",
+		              class_names[i], class->count, class->max_depth, class->served, class->rejected,
+		              class->limited, class->wait_us / served, class->latency_us / served,
+		              class->served ? percentile(class, 0.5) : 0, class->served ? percentile(class, 0.99) : 0);
+	}
+	lockprof_mutex_unlock(&sched_lock);
+	return c < size ? c : size - 1;
+}
@@ -0,0 +1,66 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdio.h>
+#include <time.h>
+#include <sys/un.h>
+
+/*
+ * Requests wait for a worker in one queue per class, so a cheap lookup
+ * does not wait behind a print of the whole tree. When several classes
+ * have requests waiting, workers take them by smooth weighted round robin
+ * with the weights below, which guarantees each class its share of the
+ * workers. Within a class, each client (told apart by its socket path)
+ * has its own queue and the clients take turns by deficit round robin, so
+ * one client with many requests waiting does not delay the others. Each
+ * client can also only send so many requests per second: the ones over
+ * the limit are rejected instead of queued. Has its own lock, so it can
+ * be called with or without the server lock held.
+ */
+
+#define SCHED_INTERACTIVE 0 /* lookups, listings and reads */
+#define SCHED_MUTATION 1 /* every other change to the tree */
+#define SCHED_BULK 2 /* print, find, transactions and moves across shards */
+#define SCHED_CLASSES 3
+
+/* Shares of the workers, in the order of the classes */
+#define SCHED_WEIGHTS { 6, 3, 1 }
+
+/* Requests that can wait in each class; more are rejected as busy */
+#define SCHED_QUEUE_SIZE 1024
+
+/* Bytes of requests a client can have served on each of its turns */
+#define SCHED_QUANTUM 256
+
+/* Clients tracked at once; an idle one is forgotten to make room */
+#define SCHED_MAX_CLIENTS 1024
+
+/* Requests per second each client can send by default (-r sets another
+ * rate, 0 for no limit; the clients send a request rejected as busy again
+ * after a while), and how many in a burst */
+#define SCHED_CLIENT_RATE 5000
+#define SCHED_CLIENT_BURST 1000
+
+/* Returned by sched_pop when no request came in time */
+#define SCHED_TIMEOUT 1
+
+typedef struct sched_request {
+	struct sockaddr_un client;
+	char *buffer; /* the request, terminated */
+	int length;
+	int class;
+	struct timespec received;
+	struct timespec started;
+} sched_request;
+
+int sched_classify(const char *command);
+int sched_push(struct sockaddr_un *client, const char *buffer, int length);
+int sched_pop(sched_request *request, int timeout_ms);
+void sched_done(sched_request *request);
+void sched_stop();
+void sched_start();
+void sched_set_rate(int rate, int burst);
+void sched_load(int *depth, double *wait_us);
+int sched_stats(char *buffer, int size);
+
+#endif /* SCHEDULER_H */
@@ -0,0 +1,414 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "fs/operations.h"
+#include "shard.h"
+
+#define MAX_PREPARED 16
+
+#define MOVE_OUT 0
+#define MOVE_IN 1
+
+/*
+ * A move prepared on this shard and waiting for commit or abort.
+ * While prepared, its path cannot be changed by any other operation.
+ */
+typedef struct prepared_move {
+	long txid;
+	int role;
+	char path[MAX_FILE_NAME];
+	char *subtree;
+	time_t deadline;
+} prepared_move;
+
+static prepared_move prepared[MAX_PREPARED];
+
+
+/*
+ * Copies a path without leading and trailing slashes.
+ */
+static void normalize_path(char *dest, char *path) {
+	int len;
+
+	while (*path == '/')
+		path++;
+	strncpy(dest, path, MAX_FILE_NAME - 1);
+	dest[MAX_FILE_NAME - 1] = '\0';
+
+	len = strlen(dest);
+	while (len > 0 && dest[len - 1] == '/')
+		dest[--len] = '\0';
+}
+
+
+/*
+ * Checks if path a is path b or one of its ancestors.
+ */
+static int is_ancestor_or_self(char *a, char *b) {
+	int len = strlen(a);
+
+	if (len == 0)
+		return 1;
+	return strncmp(a, b, len) == 0 && (b[len] == '\0' || b[len] == '/');
+}
+
+
+static void release(prepared_move *move) {
+	free(move->subtree);
+	move->subtree = NULL;
+	move->txid = 0;
+}
+
+
+/*
+ * Aborts the prepared moves whose coordinator never came back.
+ * A source that expires after its destination committed leaves the
+ * subtree in both shards, so the timeout must be much longer than a move.
+ */
+static void expire_prepared() {
+	time_t now = time(NULL);
+
+	for (int i = 0; i < MAX_PREPARED; i++) {
+		if (prepared[i].txid != 0 && prepared[i].deadline < now) {
+			printf("Shard: prepared move %ld expired\n", prepared[i].txid);
+			release(&prepared[i]);
+		}
+	}
+}
+
+
+static prepared_move *find_prepared(long txid) {
+	for (int i = 0; i < MAX_PREPARED; i++) {
+		if (prepared[i].txid == txid)
+			return &prepared[i];
+	}
+	return NULL;
+}
+
+
+static int add_prepared(long txid, int role, char *path, char *subtree) {
+	prepared_move *move = find_prepared(0);
+
+	if (txid == 0 || move == NULL || find_prepared(txid) != NULL)
+		return TECNICOFS_ERROR_BUSY;
+
+	move->txid = txid;
+	move->role = role;
+	normalize_path(move->path, path);
+	move->subtree = strdup(subtree);
+	move->deadline = time(NULL) + SHARD_PREPARE_TIMEOUT;
+	return SUCCESS;
+}
+
+
+/*
+ * Checks if a path conflicts with a prepared move.
+ * Input:
+ *  - path: path about to be changed
+ * Returns: 1 if the path or one of its ancestors or descendants is locked
+ *  by a prepared move, 0 otherwise
+ */
+int shard_path_busy(char *path) {
+	char normalized[MAX_FILE_NAME];
+
+	expire_prepared();
+	normalize_path(normalized, path);
+
+	for (int i = 0; i < MAX_PREPARED; i++) {
+		if (prepared[i].txid != 0 &&
+		    (is_ancestor_or_self(prepared[i].path, normalized) ||
+		     is_ancestor_or_self(normalized, prepared[i].path)))
+			return 1;
+	}
+	return 0;
+}
+
+
+/*
+ * Prepares the source of a cross-shard move.
+ * Input:
+ *  - txid: identifier chosen by the coordinator
+ *  - path: path of the node to move out of this shard
+ *  - subtree: buffer for the exported subtree, one "<f|d> <path>" line
+ *    per node, paths relative to the moved node ("." is the node itself),
+ *    followed by the contents of a file that has them
+ *  - size: size of the subtree buffer
+ * Returns: SUCCESS, FAIL or TECNICOFS_ERROR_BUSY
+ */
+int shard_prepare_out(long txid, char *path, char *subtree, int size) {
+	int inumber;
+	char *buffer;
+	size_t len;
+	FILE *fp;
+
+	if (shard_path_busy(path))
+		return TECNICOFS_ERROR_BUSY;
+
+	inumber = lookup(path);
+	if (inumber == FAIL || inumber == FS_ROOT) {
+		printf("failed to prepare move of %s, invalid path\n", path);
+		return FAIL;
+	}
+
+	if ((fp = open_memstream(&buffer, &len)) == NULL)
+		return FAIL;
+	inode_export_tree(fp, inumber, ".");
+	fclose(fp);
+
+	if (len >= size) {
+		printf("failed to prepare move of %s, subtree too large\n", path);
+		free(buffer);
+		return FAIL;
+	}
+	strcpy(subtree, buffer);
+	free(buffer);
+
+	return add_prepared(txid, MOVE_OUT, path, subtree);
+}
+
+
+/*
+ * Prepares the destination of a cross-shard move.
+ * Input:
+ *  - txid: identifier chosen by the coordinator
+ *  - path: new path of the moved node
+ *  - subtree: subtree exported by the source shard
+ * Returns: SUCCESS, FAIL or TECNICOFS_ERROR_BUSY
+ */
+int shard_prepare_in(long txid, char *path, char *subtree) {
+	char *parent_name, *child_name, name_copy[MAX_FILE_NAME];
+	int parent_inumber;
+	type pType;
+
+	if (shard_path_busy(path))
+		return TECNICOFS_ERROR_BUSY;
+
+	strcpy(name_copy, path);
+	split_parent_child_from_path(name_copy, &parent_name, &child_name);
+	parent_inumber = lookup(parent_name);
+
+	if (parent_inumber == FAIL || inode_get(parent_inumber, &pType, NULL) == FAIL ||
+	    pType != T_DIRECTORY) {
+		printf("failed to prepare move to %s, invalid parent dir %s\n", path, parent_name);
+		return FAIL;
+	}
+
+	if (lookup(path) != FAIL) {
+		printf("failed to prepare move to %s, already exists\n", path);
+		return FAIL;
+	}
+
+	return add_prepared(txid, MOVE_IN, path, subtree);
+}
+
+
+/*
+ * Undoes, in place, the escaping of the file contents in a subtree.
+ */
+static void unescape_contents(char *contents) {
+	int len = 0;
+
+	for (char *c = contents; *c != '\0'; c++) {
+		if (*c == '\\' && c[1] != '\0') {
+			c++;
+			contents[len++] = (*c == 'n') ? '\n' : *c;
+		}
+		else
+			contents[len++] = *c;
+	}
+	contents[len] = '\0';
+}
+
+
+/*
+ * Splits a subtree in lines and builds the full path of each node. The
+ * contents of a file point into the subtree, NULL if it has none.
+ * Returns the number of nodes, or FAIL.
+ */
+static int parse_subtree(char *base, char *subtree, char (**paths)[MAX_FILE_NAME], type **types,
+                         char ***contents) {
+	int n = 0, count = 0;
+	char *line, *saveptr;
+
+	for (char *c = subtree; *c != '\0'; c++) {
+		if (*c == '\n')
+			n++;
+	}
+	*paths = malloc(sizeof(**paths) * (n + 1));
+	*types = malloc(sizeof(**types) * (n + 1));
+	*contents = malloc(sizeof(**contents) * (n + 1));
+	if (*paths == NULL || *types == NULL || *contents == NULL) {
+		free(*paths);
+		free(*types);
+		free(*contents);
+		return FAIL;
+	}
+
+	for (line = strtok_r(subtree, "\n", &saveptr); line != NULL; line = strtok_r(NULL, "\n", &saveptr)) {
+		char t, rel[MAX_FILE_NAME];
+		int end = 0;
+
+		if (count > n || sscanf(line, "%c %99s%n", &t, rel, &end) != 2 || rel[0] != '.' ||
+		    snprintf((*paths)[count], MAX_FILE_NAME, "%s%s", base, rel + 1) >= MAX_FILE_NAME) {
+			free(*paths);
+			free(*types);
+			free(*contents);
+			return FAIL;
+		}
+		(*contents)[count] = NULL;
+		if (t == 'f' && line[end] == ' ') {
+			(*contents)[count] = line + end + 1;
+			unescape_contents((*contents)[count]);
+		}
+		(*types)[count++] = (t == 'd') ? T_DIRECTORY : T_FILE;
+	}
+	return count;
+}
+
+
+/*
+ * Creates a node of a moved subtree, with its contents if it is a file.
+ * A file whose contents cannot be set is deleted again.
+ * Returns: SUCCESS or FAIL
+ */
+static int create_node(char *path, type nodeType, char *contents) {
+	if (create(path, nodeType) == FAIL)
+		return FAIL;
+	if (contents != NULL && inode_set_file(lookup(path), contents, strlen(contents)) == FAIL) {
+		delete(path);
+		return FAIL;
+	}
+	return SUCCESS;
+}
+
+
+/*
+ * Commits a prepared move: the destination creates the subtree and the
+ * source deletes it. A destination that cannot create every node undoes
+ * the nodes it created, so the coordinator can still abort the source.
+ * Input:
+ *  - txid: identifier of the prepared move
+ * Returns: SUCCESS or FAIL
+ */
+int shard_commit(long txid) {
+	prepared_move *move = find_prepared(txid);
+	char (*paths)[MAX_FILE_NAME];
+	char **contents;
+	type *types;
+	int n, i, res = SUCCESS;
+
+	if (move == NULL) {
+		printf("failed to commit move %ld, not prepared\n", txid);
+		return FAIL;
+	}
+
+	n = parse_subtree(move->path, move->subtree, &paths, &types, &contents);
+	if (n == FAIL) {
+		release(move);
+		return FAIL;
+	}
+
+	if (move->role == MOVE_IN) {
+		for (i = 0; i < n; i++) {
+			if (create_node(paths[i], types[i], contents[i]) == FAIL)
+				break;
+		}
+		if (i < n) {
+			while (--i >= 0)
+				delete(paths[i]);
+			res = FAIL;
+		}
+	}
+	else {
+		/* children come after their parent in the export, delete them first */
+		for (i = n - 1; i >= 0; i--) {
+			if (delete(paths[i]) == FAIL)
+				res = FAIL;
+		}
+	}
+
+	free(paths);
+	free(types);
+	free(contents);
+	release(move);
+	return res;
+}
+
+
+/*
+ * Returns the path a prepared move takes out of this shard, or NULL if
+ * txid is not the source of a prepared move.
+ */
+char *shard_move_out_path(long txid) {
+	prepared_move *move = find_prepared(txid);
+
+	if (move == NULL || move->role != MOVE_OUT)
+		return NULL;
+	return move->path;
+}
+
+
+/*
+ * Aborts a prepared move, unlocking its path.
+ * Input:
+ *  - txid: identifier of the prepared move
+ * Returns: SUCCESS or FAIL
+ */
+int shard_abort(long txid) {
+	prepared_move *move = find_prepared(txid);
+
+	if (move == NULL)
+		return FAIL;
+
+	release(move);
+	return SUCCESS;
+}
+
+
+/*
+ * Saves the prepared moves, to be loaded by another server process, which
+ * then commits or aborts them when their coordinator asks.
+ * Returns: SUCCESS or FAIL
+ */
+int shard_save(FILE *fp) {
+	prepared_move end;
+
+	for (int i = 0; i < MAX_PREPARED; i++) {
+		int len;
+
+		if (prepared[i].txid == 0)
+			continue;
+		len = strlen(prepared[i].subtree);
+		if (fwrite(&prepared[i], sizeof(prepared_move), 1, fp) != 1 ||
+		    fwrite(&len, sizeof(len), 1, fp) != 1 || fwrite(prepared[i].subtree, 1, len, fp) != len)
+			return FAIL;
+	}
+	memset(&end, 0, sizeof(end));
+	return fwrite(&end, sizeof(end), 1, fp) == 1 ? SUCCESS : FAIL;
+}
+
+
+/*
+ * Loads the prepared moves saved by shard_save.
+ * Returns: SUCCESS or FAIL
+ */
+int shard_load(FILE *fp) {
+	prepared_move saved;
+
+	while (fread(&saved, sizeof(saved), 1, fp) == 1) {
+		prepared_move *move;
+		int len;
+
+		if (saved.txid == 0)
+			return SUCCESS;
+		if ((move = find_prepared(0)) == NULL || fread(&len, sizeof(len), 1, fp) != 1 || len < 0 ||
+		    (saved.subtree = malloc(len + 1)) == NULL)
+			return FAIL;
+		*move = saved;
+		if (fread(move->subtree, 1, len, fp) != len)
+			return FAIL;
+		move->subtree[len] = '\0';
+	}
+	return FAIL;
+}
@@ -0,0 +1,26 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+#include <stdio.h>
+
+/*
+ * Participant side of the two-phase cross-shard move.
+ * The client that issues the move coordinates it: it prepares the source
+ * shard (move-out), prepares the destination shard (move-in) and then
+ * commits the destination before the source, aborting on any failure.
+ * All functions must be called with the server lock held.
+ */
+
+/* Prepared moves are aborted if not committed within this many seconds */
+#define SHARD_PREPARE_TIMEOUT 30
+
+int shard_path_busy(char *path);
+int shard_prepare_out(long txid, char *path, char *subtree, int size);
+int shard_prepare_in(long txid, char *path, char *subtree);
+int shard_commit(long txid);
+char *shard_move_out_path(long txid);
+int shard_abort(long txid);
+int shard_save(FILE *fp);
+int shard_load(FILE *fp);
+
+#endif /* SHARD_H */
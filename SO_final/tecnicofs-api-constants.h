@@ -31,5 +31,34 @@ typedef enum type { T_FILE, T_DIRECTORY, T_NONE } type;
 #define TECNICOFS_ERROR_INVALID_MODE -10
 /* Generic error */
 #define TECNICOFS_ERROR_OTHER -11
+/* Path is locked by an operation in progress, try again later */
+#define TECNICOFS_ERROR_BUSY -12
+/* A node read by a transaction changed before it committed, try again */
+#define TECNICOFS_ERROR_CONFLICT -13
+
+/* Cursor that starts listing a directory */
+#define TECNICOFS_READDIR_START 0
+/* Cursor returned once a directory has been completely listed */
+#define TECNICOFS_READDIR_END -1
+/* Bytes needed for the reply to a full page of a readdir */
+#define READDIR_REPLY_SIZE 4096
+
+/* Handles a client can have open at the same time on each server */
+#define MAX_OPEN_FILES 5
+/* Most bytes moved by one read or write */
+#define FILE_IO_SIZE 4096
+
+/* Directories a client can watch at the same time on each server */
+#define MAX_WATCHES 16
+
+/* Maximum number of servers a namespace can be sharded across */
+#define MAX_SHARDS 16
+/* Bytes needed for the subtree carried by a cross-shard move */
+#define SHARD_SUBTREE_SIZE 8192
+
+/* Reads and changes a transaction can carry, and the bytes they take */
+#define TXN_MAX_READS 64
+#define TXN_MAX_OPS 64
+#define TXN_REQUEST_SIZE SHARD_SUBTREE_SIZE
 
 #endif /* TECNICOFS_API_CONSTANTS_H */
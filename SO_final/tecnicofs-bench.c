@@ -0,0 +1,325 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "tecnicofs-client-api.h"
+
+/*
+ * Load generator: K client processes run a mix of operations against a
+ * running server and the throughput and latency percentiles are printed
+ * as one CSV row or one JSON object (see runTests.sh for thread sweeps).
+ */
+
+#define OP_LOOKUP 0
+#define OP_CREATE 1
+#define OP_DELETE 2
+#define OP_MOVE 3
+#define NUM_OPS 4
+
+#define MAX_CLIENTS 256
+
+static const char *opNames[NUM_OPS] = { "lookup", "create", "delete", "move" };
+
+/* parametros */
+int numClients = 4;
+int opsPerClient = 1000;
+int mix[NUM_OPS] = { 70, 10, 10, 10 };
+int fanout = 3;
+int depth = 2;
+double skew = 0.99;
+int useCache = 0;
+int serverThreads = 0;
+int json = 0;
+char *serverName;
+
+/* arvore criada antes do teste: diretorias internas e chaves para lookups */
+int numKeys;
+char (*keys)[MAX_FILE_NAME];
+int numDirs;
+char (*dirs)[MAX_FILE_NAME];
+double *zipfCdf;
+
+/* resultado de cada cliente, enviado ao pai por um pipe */
+typedef struct clientResult {
+    double start, end;
+    int count[NUM_OPS];
+    int failed[NUM_OPS];
+} clientResult;
+
+static void displayUsage (const char* appName) {
+    printf("Usage: %s [-k clients] [-n ops_per_client] [-m lookup:create:delete:move]\n"
+           "          [-f fanout] [-d depth] [-z zipf_skew] [-c] [-T server_threads] [-j]\n"
+           "          server_socket_name\n", appName);
+    exit(EXIT_FAILURE);
+}
+
+static void parseArgs (int argc, char* const argv[]) {
+    int opt;
+
+    while ((opt = getopt(argc, argv, "k:n:m:f:d:z:cT:j")) != -1) {
+        switch (opt) {
+            case 'k': numClients = atoi(optarg); break;
+            case 'n': opsPerClient = atoi(optarg); break;
+            case 'm':
+                if (sscanf(optarg, "%d:%d:%d:%d", &mix[OP_LOOKUP], &mix[OP_CREATE],
+                           &mix[OP_DELETE], &mix[OP_MOVE]) != NUM_OPS)
+                    displayUsage(argv[0]);
+                break;
+            case 'f': fanout = atoi(optarg); break;
+            case 'd': depth = atoi(optarg); break;
+            case 'z': skew = atof(optarg); break;
+            case 'c': useCache = 1; break;
+            case 'T': serverThreads = atoi(optarg); break;
+            case 'j': json = 1; break;
+            default: displayUsage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || numClients < 1 || numClients > MAX_CLIENTS ||
+        opsPerClient < 1 || fanout < 1 || depth < 1 || skew < 0 ||
+        mix[OP_LOOKUP] + mix[OP_CREATE] + mix[OP_DELETE] + mix[OP_MOVE] <= 0)
+        displayUsage(argv[0]);
+
+    serverName = argv[optind];
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Creates the tree (fanout directories per level, depth levels) and uses
+ * every node of it as a lookup key, ranked by creation order for the Zipf
+ * distribution so the top levels are the hottest keys.
+ */
+static void buildTree() {
+    int levelStart = 0, levelEnd = 1, total = 0, n = 1;
+
+    for (int level = 0; level < depth; level++) {
+        n *= fanout;
+        total += n;
+    }
+    keys = malloc(sizeof(*keys) * total);
+    dirs = malloc(sizeof(*dirs) * (total + 1));
+
+    strcpy(dirs[numDirs++], "");
+    for (int level = 0; level < depth; level++) {
+        for (int parent = levelStart; parent < levelEnd; parent++) {
+            for (int i = 0; i < fanout; i++) {
+                char path[MAX_FILE_NAME];
+                snprintf(path, MAX_FILE_NAME, "%s%sn%d", dirs[parent], dirs[parent][0] ? "/" : "", i);
+                if (tfsCreate(path, 'd') != 0 && tfsLookup(path) < 0)
+                    fprintf(stderr, "bench: could not create %s\n", path);
+                strcpy(dirs[numDirs++], path);
+                strcpy(keys[numKeys++], path);
+            }
+        }
+        levelStart = levelEnd;
+        levelEnd = numDirs;
+    }
+
+    /* Zipf: P(rank k) proporcional a 1 / k^skew */
+    zipfCdf = malloc(sizeof(double) * numKeys);
+    double sum = 0;
+    for (int k = 0; k < numKeys; k++) {
+        sum += 1.0 / pow(k + 1, skew);
+        zipfCdf[k] = sum;
+    }
+    for (int k = 0; k < numKeys; k++)
+        zipfCdf[k] /= sum;
+}
+
+static int zipfPick(unsigned int *seed) {
+    double u = rand_r(seed) / (RAND_MAX + 1.0);
+    int lo = 0, hi = numKeys - 1;
+
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (zipfCdf[mid] < u)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static int pickOp(unsigned int *seed) {
+    int total = mix[OP_LOOKUP] + mix[OP_CREATE] + mix[OP_DELETE] + mix[OP_MOVE];
+    int r = rand_r(seed) % total;
+
+    for (int op = 0; op < NUM_OPS; op++) {
+        if (r < mix[op])
+            return op;
+        r -= mix[op];
+    }
+    return OP_LOOKUP;
+}
+
+/*
+ * Runs one client: the files it creates are its own, so deletes and moves
+ * never race with other clients. Writes its result and then one latency
+ * (in nanoseconds) per operation to fd.
+ */
+static void runClient(int id, int fd) {
+    unsigned int seed = id * 7919 + 1;
+    char (*files)[MAX_FILE_NAME] = malloc(sizeof(*files) * opsPerClient);
+    double *latencies = malloc(sizeof(double) * opsPerClient);
+    int numFiles = 0, created = 0;
+    clientResult result;
+
+    memset(&result, 0, sizeof(result));
+    if (tfsMount(serverName) != 0)
+        exit(EXIT_FAILURE);
+    tfsSetLookupCache(useCache);
+
+    result.start = now();
+    for (int i = 0; i < opsPerClient; i++) {
+        char path[MAX_FILE_NAME];
+        char *dir = dirs[zipfPick(&seed) % numDirs];
+        int op = pickOp(&seed), res = 0;
+        double t0;
+
+        /* sem ficheiros proprios, deletes e moves passam a creates */
+        if ((op == OP_DELETE || op == OP_MOVE) && numFiles == 0)
+            op = OP_CREATE;
+
+        t0 = now();
+        switch (op) {
+            case OP_LOOKUP:
+                res = tfsLookup(keys[zipfPick(&seed)]) < 0;
+                break;
+            case OP_CREATE:
+                snprintf(path, MAX_FILE_NAME, "%s%sc%d_%d", dir, dir[0] ? "/" : "", id, created++);
+                res = tfsCreate(path, 'f');
+                if (res == 0)
+                    strcpy(files[numFiles++], path);
+                break;
+            case OP_DELETE:
+                res = tfsDelete(files[--numFiles]);
+                break;
+            case OP_MOVE:
+                snprintf(path, MAX_FILE_NAME, "%s%sc%d_%d", dir, dir[0] ? "/" : "", id, created++);
+                res = tfsMove(files[numFiles - 1], path);
+                if (res == 0)
+                    strcpy(files[numFiles - 1], path);
+                break;
+        }
+        latencies[i] = (now() - t0) * 1e9;
+        result.count[op]++;
+        if (res != 0)
+            result.failed[op]++;
+    }
+    result.end = now();
+
+    /* deixa a arvore como estava */
+    while (numFiles > 0)
+        tfsDelete(files[--numFiles]);
+    tfsUnmount();
+
+    if (write(fd, &result, sizeof(result)) != sizeof(result) ||
+        write(fd, latencies, sizeof(double) * opsPerClient) != sizeof(double) * opsPerClient)
+        exit(EXIT_FAILURE);
+    exit(EXIT_SUCCESS);
+}
+
+static int readAll(int fd, void *buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = read(fd, (char *) buf + done, len - done);
+        if (n <= 0)
+            return -1;
+        done += n;
+    }
+    return 0;
+}
+
+static int compareDoubles(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(double *sorted, int n, double p) {
+    int i = (int) ceil(p * n) - 1;
+    return sorted[i < 0 ? 0 : (i >= n ? n - 1 : i)];
+}
+
+int main(int argc, char* argv[]) {
+    int fds[MAX_CLIENTS];
+    pid_t pids[MAX_CLIENTS];
+    int total = 0, failed = 0, counts[NUM_OPS] = { 0 };
+    double start = 0, end = 0;
+
+    parseArgs(argc, argv);
+
+    if (tfsMount(serverName) != 0) {
+        fprintf(stderr, "Unable to mount socket: %s\n", serverName);
+        exit(EXIT_FAILURE);
+    }
+    buildTree();
+
+    for (int i = 0; i < numClients; i++) {
+        int fd[2];
+        if (pipe(fd) != 0 || (pids[i] = fork()) < 0) {
+            perror("bench: fork");
+            exit(EXIT_FAILURE);
+        }
+        if (pids[i] == 0) {
+            close(fd[0]);
+            runClient(i, fd[1]);
+        }
+        close(fd[1]);
+        fds[i] = fd[0];
+    }
+
+    double *latencies = malloc(sizeof(double) * numClients * opsPerClient);
+    for (int i = 0; i < numClients; i++) {
+        clientResult result;
+        if (readAll(fds[i], &result, sizeof(result)) != 0 ||
+            readAll(fds[i], latencies + i * opsPerClient, sizeof(double) * opsPerClient) != 0) {
+            fprintf(stderr, "bench: client %d failed\n", i);
+            exit(EXIT_FAILURE);
+        }
+        close(fds[i]);
+        waitpid(pids[i], NULL, 0);
+
+        if (i == 0 || result.start < start)
+            start = result.start;
+        if (i == 0 || result.end > end)
+            end = result.end;
+        for (int op = 0; op < NUM_OPS; op++) {
+            counts[op] += result.count[op];
+            failed += result.failed[op];
+        }
+    }
+    tfsUnmount();
+
+    total = numClients * opsPerClient;
+    qsort(latencies, total, sizeof(double), compareDoubles);
+    double throughput = total / (end - start);
+
+    if (json) {
+        printf("{\"server_threads\": %d, \"clients\": %d, \"ops\": %d, \"failed\": %d, "
+               "\"seconds\": %.6f, \"ops_per_sec\": %.1f, ",
+               serverThreads, numClients, total, failed, end - start, throughput);
+        for (int op = 0; op < NUM_OPS; op++)
+            printf("\"%s\": %d, ", opNames[op], counts[op]);
+        printf("\"p50_us\": %.2f, \"p90_us\": %.2f, \"p99_us\": %.2f, \"p999_us\": %.2f}\n",
+               percentile(latencies, total, 0.5) / 1e3, percentile(latencies, total, 0.9) / 1e3,
+               percentile(latencies, total, 0.99) / 1e3, percentile(latencies, total, 0.999) / 1e3);
+    }
+    else {
+        printf("%d,%d,%d,%d,%.6f,%.1f,%d,%d,%d,%d,%.2f,%.2f,%.2f,%.2f\n",
+               serverThreads, numClients, total, failed, end - start, throughput,
+               counts[OP_LOOKUP], counts[OP_CREATE], counts[OP_DELETE], counts[OP_MOVE],
+               percentile(latencies, total, 0.5) / 1e3, percentile(latencies, total, 0.9) / 1e3,
+               percentile(latencies, total, 0.99) / 1e3, percentile(latencies, total, 0.999) / 1e3);
+    }
+
+    exit(EXIT_SUCCESS);
+}
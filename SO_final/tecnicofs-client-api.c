@@ -1,17 +1,157 @@
 #include "tecnicofs-client-api.h"
+#include "tecnicofs-mirror.h"
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <stdio.h>
+#include <time.h>
+#include <poll.h>
 
-char SOCKET_CLIENT[15];
-int pid_client; 
-int sockfd;
-socklen_t servlen, clilen;
-struct sockaddr_un serv_addr, client_addr;
-char buffer[10];
+/*
+ * Optional lookup cache: each entry is valid until the lease the server
+ * granted for it expires, or until the server sends an invalidation.
+ */
+#define LOOKUP_CACHE_SIZE 256
+
+typedef struct cachedLookup {
+  char path[MAX_FILE_NAME];
+  int inumber;
+  struct timespec expiry;
+} cachedLookup;
+
+/*
+ * Watch events received and not yet returned by tfsWatchNext. When full,
+ * the queue is emptied and an overflow event is returned instead.
+ */
+#define EVENT_QUEUE_SIZE 256
+/* Big enough for any message the servers send */
+#define MESSAGE_SIZE (SHARD_SUBTREE_SIZE + 64)
+
+/*
+ * Requests are sent again when no reply arrives in time. The sequence
+ * numbers of a session start from the clock, so a new session with the
+ * same socket is not answered from the reply cache of an old one.
+ */
+#define REQUEST_TIMEOUT_MS 100
+#define REQUEST_MAX_TIMEOUT_MS 1600
+#define REQUEST_ATTEMPTS 8
+
+/*
+ * Optional namespace mirror: the file each server keeps with the entries
+ * of every directory (see tecnicofs-mirror.h), mapped read-only so lookups
+ * are answered without a request while it is up to date.
+ */
+typedef struct mappedMirror {
+  mirror_header *header;
+  size_t size;
+  ino_t ino;
+} mappedMirror;
+
+/*
+ * A message sent in answer to a request before its reply ("#<seq> + ..."),
+ * such as a batch of the matches of a find.
+ */
+typedef struct partialReply {
+  struct partialReply *next;
+  char text[];
+} partialReply;
+
+/*
+ * Handles the partial replies to a request, in the order they arrived.
+ */
+typedef void (*partialHandler)(char *partial, void *arg);
+
+/*
+ * A request waiting for its reply, which the demultiplexer copies into
+ * reply and signals. The partial replies, if the request takes them, are
+ * queued until the thread that sent the request handles them.
+ */
+typedef struct pendingRequest {
+  unsigned long seq;
+  char *reply;
+  int replylen;
+  int length; /* of the reply, -1 until it arrives */
+  int takesPartial;
+  partialReply *partial, **partialTail;
+  pthread_cond_t done;
+  struct pendingRequest *next;
+} pendingRequest;
+
+/*
+ * A session: a socket per shard, named "<pid>.<n>.<shard>" in the working
+ * directory and connected to the shard, and a demultiplexer thread that
+ * reads every message the shards send to them. Replies go to the request
+ * with their sequence number, so any number of threads can have requests
+ * in flight at once; invalidations and watch events are handled as they
+ * arrive. A socket connected to its shard takes any number of replies,
+ * where an unconnected one drops them past net.unix.max_dgram_qlen. The
+ * lock guards the requests waiting, the lookup cache and the events.
+ */
+struct tfsSession {
+  pid_t pid;
+  int sockfd[MAX_SHARDS];
+  struct sockaddr_un client_addr[MAX_SHARDS];
+  pthread_t demux;
+  int wakefd[2];
+  pthread_mutex_t lock;
+  pthread_condattr_t condattr;
+
+  /* Shard map: every top-level name belongs to exactly one server */
+  int nshards;
+  socklen_t shard_len[MAX_SHARDS];
+  struct sockaddr_un shard_addr[MAX_SHARDS];
+  unsigned long txCounter;
+
+  unsigned long requestSeq;
+  int requestTimeout;
+  int requestAttempts;
+  pendingRequest *pending;
+
+  int cacheEnabled;
+  unsigned long cacheGeneration;
+  cachedLookup lookupCache[LOOKUP_CACHE_SIZE];
+
+  tfsWatchEvent eventQueue[EVENT_QUEUE_SIZE];
+  int eventHead, eventCount, eventOverflow;
+  int watching[MAX_SHARDS];
+  pthread_cond_t eventArrived;
+
+  /* remapping takes it for writing, so no lookup reads a mirror unmapped */
+  int mirrorEnabled;
+  pthread_rwlock_t mirrorLock;
+  mappedMirror mirrors[MAX_SHARDS];
+};
+
+/*
+ * Transaction started by tfsTxnBegin in this thread: the versions of the
+ * nodes looked up and the changes, sent together by tfsTxnCommit to the
+ * shard they all belong to. A change that cannot be part of it fails the
+ * whole commit.
+ */
+typedef struct tfsTxn {
+  tfsSession *session;
+  int active, failed, shard;
+  int reads, ops;
+  char readSet[TXN_REQUEST_SIZE], writeSet[TXN_REQUEST_SIZE];
+  int readLen, writeLen;
+} tfsTxn;
+
+static __thread tfsTxn txn;
+
+/* Session of the thread (tfsSessionUse), or of the process (tfsMount) */
+static __thread tfsSession *currentSession;
+static tfsSession *defaultSession;
+static unsigned long sessionCounter;
+static pthread_once_t forkHandlerOnce = PTHREAD_ONCE_INIT;
 
 int setSockAddrUn(char *path, struct sockaddr_un *addr) {
 
@@ -26,118 +166,1416 @@ int setSockAddrUn(char *path, struct sockaddr_un *addr) {
 }
 
 
-int tfsCreate(char *filename, char nodeType) {
-  char command[100];
-  if (nodeType == 'f') {
-    snprintf (command, 100, "%c %s %c",'c',filename,nodeType);
-    if (sendto(sockfd, command, strlen(command)+1, 0, (struct sockaddr *) &serv_addr, servlen) < 0) {
-      perror("client: sendto error");
-      return -1;
+static tfsSession *session() {
+  return currentSession != NULL ? currentSession : defaultSession;
+}
+
+/*
+ * Returns the shard that owns a path, chosen by hashing (FNV-1a) its
+ * top-level component. The root itself is answered by shard 0.
+ */
+static int shardOf(tfsSession *s, char *path) {
+  unsigned int hash = 2166136261u;
+
+  while (*path == '/')
+    path++;
+  for (; *path != '\0' && *path != '/'; path++) {
+    hash ^= (unsigned char) *path;
+    hash *= 16777619u;
+  }
+  return hash % s->nshards;
+}
+
+static int isRoot(char *path) {
+  while (*path == '/')
+    path++;
+  return *path == '\0';
+}
+
+
+static unsigned int pathHash(char *path) {
+  unsigned int hash = 2166136261u;
+
+  for (; *path != '\0'; path++) {
+    hash ^= (unsigned char) *path;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+/*
+ * Drops every cached lookup. Invalidations ("! <inumber>") only say that
+ * some cached path changed, so the whole cache goes. Must be called with
+ * the session lock held.
+ */
+static void flushLookupCache(tfsSession *s) {
+  for (int i = 0; i < LOOKUP_CACHE_SIZE; i++)
+    s->lookupCache[i].path[0] = '\0';
+  s->cacheGeneration++;
+}
+
+/*
+ * Handles a message a server sent without being asked: an invalidation
+ * ("! <inumber>") or a watch event ("* <watch> <type> <name>"). Must be
+ * called with the session lock held.
+ * Returns 1 if it was one of those.
+ */
+static int handleNotice(tfsSession *s, int shard, char *message) {
+  static const char types[] = "cdftox";
+  tfsWatchEvent *event;
+  char type, *t;
+  int id;
+
+  if (message[0] == '!') {
+    flushLookupCache(s);
+    return 1;
+  }
+  if (message[0] != '*')
+    return 0;
+
+  pthread_cond_broadcast(&s->eventArrived);
+  if (s->eventOverflow)
+    return 1;
+  if (s->eventCount == EVENT_QUEUE_SIZE) {
+    s->eventCount = 0;
+    s->eventOverflow = 1;
+    return 1;
+  }
+  event = &s->eventQueue[(s->eventHead + s->eventCount) % EVENT_QUEUE_SIZE];
+  if (sscanf(message, "* %d %c %99s", &id, &type, event->name) < 3 || (t = strchr(types, type)) == NULL)
+    return 1;
+  event->wd = shard * MAX_WATCHES + id;
+  event->type = (tfsEventType) (t - types);
+  s->eventCount++;
+  return 1;
+}
+
+/*
+ * Gives a reply ("#<seq> <reply>") to the request waiting for it. Replies
+ * to attempts of a request that was already answered are dropped. Must be
+ * called with the session lock held.
+ */
+static void handleReply(tfsSession *s, char *message, int n) {
+  pendingRequest *request;
+  unsigned long seq;
+  int offset = 0;
+
+  if (sscanf(message, "#%lu %n", &seq, &offset) < 1 || offset == 0)
+    return;
+  for (request = s->pending; request != NULL; request = request->next) {
+    if (request->seq == seq && request->length < 0 && message[offset] == '+') {
+      partialReply *partial;
+
+      if (!request->takesPartial || (partial = malloc(sizeof(partialReply) + n - offset + 1)) == NULL)
+        return;
+      memcpy(partial->text, message + offset, n - offset + 1);
+      partial->next = NULL;
+      *request->partialTail = partial;
+      request->partialTail = &partial->next;
+      pthread_cond_signal(&request->done);
+      return;
     }
-    if (recvfrom(sockfd, buffer, sizeof(buffer), 0, 0, 0) < 0) {
-      perror("client: recvfrom error");
-      return -1;
+    if (request->seq == seq && request->length < 0) {
+      n -= offset;
+      if (n > request->replylen - 1)
+        n = request->replylen - 1;
+      memcpy(request->reply, message + offset, n);
+      request->reply[n] = '\0';
+      request->length = n;
+      pthread_cond_signal(&request->done);
+      return;
     }
-    return 0;
-    
   }
-  else if (nodeType == 'd'){
-    snprintf (command, 100, "%c %s %c",'c',filename,nodeType);
-    if (sendto(sockfd, command, strlen(command)+1, 0, (struct sockaddr *) &serv_addr, servlen) < 0) {
+}
+
+/*
+ * Demultiplexer of a session: reads every message of its sockets until
+ * the session is closed, which it learns from its pipe.
+ */
+static void *demultiplex(void *arg) {
+  tfsSession *s = arg;
+  struct pollfd pfds[MAX_SHARDS + 1];
+  char *message = malloc(MESSAGE_SIZE);
+
+  for (int shard = 0; shard < s->nshards; shard++) {
+    pfds[shard].fd = s->sockfd[shard];
+    pfds[shard].events = POLLIN;
+  }
+  pfds[s->nshards].fd = s->wakefd[0];
+  pfds[s->nshards].events = POLLIN;
+
+  while (message != NULL) {
+    if (poll(pfds, s->nshards + 1, -1) < 0)
+      continue;
+    if (pfds[s->nshards].revents)
+      break;
+
+    for (int shard = 0; shard < s->nshards; shard++) {
+      int n;
+
+      if (!pfds[shard].revents)
+        continue;
+      while ((n = recv(s->sockfd[shard], message, MESSAGE_SIZE - 1, MSG_DONTWAIT)) > 0) {
+        message[n] = '\0';
+        pthread_mutex_lock(&s->lock);
+        if (!handleNotice(s, shard, message))
+          handleReply(s, message, n);
+        pthread_mutex_unlock(&s->lock);
+      }
+    }
+  }
+  free(message);
+  return NULL;
+}
+
+static void deadlineAfter(struct timespec *deadline, int ms) {
+  clock_gettime(CLOCK_MONOTONIC, deadline);
+  deadline->tv_sec += ms / 1000;
+  deadline->tv_nsec += (ms % 1000) * 1000000L;
+  if (deadline->tv_nsec >= 1000000000L) {
+    deadline->tv_sec++;
+    deadline->tv_nsec -= 1000000000L;
+  }
+}
+
+/*
+ * Sends a command to a shard, as "#<seq> <command>", and waits for the
+ * demultiplexer to hand it the reply. If none arrives in time the command
+ * is sent again, waiting twice as long each time, and so is one answered
+ * as busy (TECNICOFS_ERROR_BUSY) but on the last attempt. The partial
+ * replies that come before the reply go to handler, if not NULL, and each
+ * of them starts the wait again. Returns the number of bytes of the reply, or -1
+ * on error or if the shard never replied.
+ */
+static int tfsRequestPartial(tfsSession *s, int shard, char *command, char *reply, int replylen,
+                             partialHandler handler, void *arg) {
+  pendingRequest request, **link;
+  char prefix[32];
+  struct iovec iov[2] = { { prefix, 0 }, { command, strlen(command)+1 } };
+  struct msghdr msg = { .msg_name = &s->shard_addr[shard], .msg_namelen = s->shard_len[shard], .msg_iov = iov, .msg_iovlen = 2 };
+  int timeout = s->requestTimeout, res = -1, sent = 1;
+
+  request.seq = __atomic_add_fetch(&s->requestSeq, 1, __ATOMIC_RELAXED);
+  request.reply = reply;
+  request.replylen = replylen;
+  request.length = -1;
+  request.takesPartial = handler != NULL;
+  request.partial = NULL;
+  request.partialTail = &request.partial;
+  pthread_cond_init(&request.done, &s->condattr);
+  iov[0].iov_len = sprintf(prefix, "#%lu ", request.seq);
+
+  pthread_mutex_lock(&s->lock);
+  request.next = s->pending;
+  s->pending = &request;
+  pthread_mutex_unlock(&s->lock);
+
+  for (int attempt = 0; res < 0 && (timeout <= 0 || attempt < s->requestAttempts); attempt++) {
+    struct timespec deadline;
+
+    if (sendmsg(s->sockfd[shard], &msg, 0) < 0) {
       perror("client: sendto error");
-      return -1;
+      sent = 0;
+      break;
     }
-    if (recvfrom(sockfd, buffer, sizeof(buffer), 0, (struct sockaddr *) &serv_addr, &servlen) < 0) {
-      perror("client: recvfrom error");
-      return -1;
+    deadlineAfter(&deadline, timeout);
+
+    pthread_mutex_lock(&s->lock);
+    while (request.length < 0 || request.partial != NULL) {
+      if (request.partial != NULL) {
+        partialReply *partial = request.partial;
+
+        request.partial = NULL;
+        request.partialTail = &request.partial;
+        pthread_mutex_unlock(&s->lock);
+        while (partial != NULL) {
+          partialReply *next = partial->next;
+          handler(partial->text, arg);
+          free(partial);
+          partial = next;
+        }
+        /* o servidor continua a responder: o pedido nao se perdeu */
+        deadlineAfter(&deadline, timeout);
+        pthread_mutex_lock(&s->lock);
+        continue;
+      }
+      if (timeout <= 0)
+        pthread_cond_wait(&request.done, &s->lock);
+      else if (pthread_cond_timedwait(&request.done, &s->lock, &deadline) == ETIMEDOUT)
+        break;
     }
-    return 0;
-    
+    res = request.length;
+    /* ocupado, o servidor nao aplicou o pedido: e reenviado como se a resposta se tivesse perdido */
+    if (res >= 0 && timeout > 0 && attempt + 1 < s->requestAttempts && atoi(reply) == TECNICOFS_ERROR_BUSY) {
+      while (pthread_cond_timedwait(&request.done, &s->lock, &deadline) != ETIMEDOUT)
+        ;
+      request.length = res = -1;
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    if (timeout < REQUEST_MAX_TIMEOUT_MS)
+      timeout *= 2;
+  }
+
+  pthread_mutex_lock(&s->lock);
+  for (link = &s->pending; *link != &request; link = &(*link)->next)
+    ;
+  *link = request.next;
+  pthread_mutex_unlock(&s->lock);
+  pthread_cond_destroy(&request.done);
+  while (request.partial != NULL) {
+    partialReply *next = request.partial->next;
+    free(request.partial);
+    request.partial = next;
+  }
+
+  if (res < 0 && sent)
+    fprintf(stderr, "client: no reply from %s\n", s->shard_addr[shard].sun_path);
+  return res;
+}
+
+static int tfsRequest(tfsSession *s, int shard, char *command, char *reply, int replylen) {
+  return tfsRequestPartial(s, shard, command, reply, replylen, NULL, NULL);
+}
+
+/*
+ * Sets how long to wait for a reply before sending a request again
+ * (timeout_ms, doubled on every attempt) and how many times to send it.
+ * A timeout of 0 waits for the reply forever.
+ */
+int tfsSetRetries(int timeout_ms, int attempts) {
+  tfsSession *s = session();
+
+  if (s == NULL)
+    return TECNICOFS_ERROR_NO_OPEN_SESSION;
+  if (timeout_ms < 0 || attempts < 1)
+    return TECNICOFS_ERROR_OTHER;
+  s->requestTimeout = timeout_ms;
+  s->requestAttempts = attempts;
+  return 0;
+}
+
+/*
+ * Adds a line to the reads or the changes of the transaction.
+ * Returns 0, or TECNICOFS_ERROR_OTHER if the line cannot be part of it.
+ */
+static int txnAdd(int shard, char *set, int *len, int *count, int max, char *line) {
+  int n = strlen(line);
+
+  if (txn.shard < 0)
+    txn.shard = shard;
+  if (shard != txn.shard || *count == max || txn.readLen + txn.writeLen + n + 32 > TXN_REQUEST_SIZE) {
+    txn.failed = 1;
+    return TECNICOFS_ERROR_OTHER;
   }
-  
-  return -1;
+  memcpy(set + *len, line, n);
+  set[*len + n] = '\n';
+  *len += n + 1;
+  (*count)++;
+  return 0;
+}
+
+static int txnAddOp(int shard, char *command) {
+  return txnAdd(shard, txn.writeSet, &txn.writeLen, &txn.ops, TXN_MAX_OPS, command);
+}
+
+/*
+ * Inside a transaction, creates, deletes and moves are only queued (and
+ * return 0) and lookups see the tree as committed, without the changes
+ * queued. Every path must be on the same shard. A transaction belongs to
+ * the thread that began it, on the session the thread had then.
+ */
+int tfsTxnBegin() {
+  if (session() == NULL)
+    return TECNICOFS_ERROR_NO_OPEN_SESSION;
+  if (txn.active)
+    return TECNICOFS_ERROR_OTHER;
+  txn.session = session();
+  txn.active = 1;
+  txn.failed = 0;
+  txn.shard = -1;
+  txn.reads = txn.ops = txn.readLen = txn.writeLen = 0;
+  return 0;
+}
+
+int tfsTxnAbort() {
+  if (!txn.active)
+    return TECNICOFS_ERROR_OTHER;
+  txn.active = 0;
+  return 0;
+}
+
+/*
+ * Returns 0 if every change was applied, TECNICOFS_ERROR_CONFLICT if a
+ * node looked up changed meanwhile (nothing was applied, the transaction
+ * can be tried again) or the error of the change that failed.
+ */
+int tfsTxnCommit() {
+  char command[TXN_REQUEST_SIZE + 32], reply[32];
+  int c;
+
+  if (!txn.active)
+    return TECNICOFS_ERROR_OTHER;
+  txn.active = 0;
+  if (txn.failed)
+    return TECNICOFS_ERROR_OTHER;
+  if (txn.ops == 0)
+    return 0;
+
+  c = sprintf(command, "t %d %d\n", txn.reads, txn.ops);
+  memcpy(command + c, txn.readSet, txn.readLen);
+  memcpy(command + c + txn.readLen, txn.writeSet, txn.writeLen);
+  command[c + txn.readLen + txn.writeLen] = '\0';
+  if (tfsRequest(txn.session, txn.shard, command, reply, sizeof(reply)) < 0)
+    return -1;
+  return atoi(reply);
+}
+
+/*
+ * Tells if the calling thread has a transaction open on a session.
+ */
+static int inTxn(tfsSession *s) {
+  return txn.active && txn.session == s;
+}
+
+int tfsCreate(char *filename, char nodeType) {
+  tfsSession *s = session();
+  char command[100], reply[32];
+
+  if (s == NULL)
+    return TECNICOFS_ERROR_NO_OPEN_SESSION;
+  if (nodeType != 'f' && nodeType != 'd')
+    return -1;
+
+  snprintf (command, 100, "%c %s %c",'c',filename,nodeType);
+  if (inTxn(s))
+    return txnAddOp(shardOf(s, filename), command);
+  if (tfsRequest(s, shardOf(s, filename), command, reply, sizeof(reply)) < 0)
+    return -1;
+  return atoi(reply);
 }
 
 int tfsDelete(char *path) {
-  char command[100];
+  tfsSession *s = session();
+  char command[100], reply[32];
+
+  if (s == NULL)
+    return TECNICOFS_ERROR_NO_OPEN_SESSION;
   snprintf (command, 100, "%c %s",'d',path);
-  if (sendto(sockfd, command, strlen(command)+1, 0, (struct sockaddr *) &serv_addr, servlen) < 0) {
-      perror("client: sendto error");
-      return -1;
+  if (inTxn(s))
+    return txnAddOp(shardOf(s, path), command);
+  if (tfsRequest(s, shardOf(s, path), command, reply, sizeof(reply)) < 0)
+    return -1;
+  return atoi(reply);
+}
+
+/*
+ * Moves a node between two shards with a two-phase commit coordinated by
+ * this client: prepare the source (it exports the subtree and locks the
+ * path), prepare the destination (it reserves the new path), then commit
+ * the destination before the source. Any failure aborts the prepared side.
+ */
+static int tfsMoveAcrossShards(tfsSession *s, char *from, int fromShard, char *to, int toShard) {
+  char command[SHARD_SUBTREE_SIZE + MAX_FILE_NAME + 32];
+  char reply[SHARD_SUBTREE_SIZE + 32];
+  long txid = ((long) getpid() << 24) | (__atomic_add_fetch(&s->txCounter, 1, __ATOMIC_RELAXED) & 0xffffff);
+  char *subtree;
+  int res;
+
+  snprintf (command, sizeof(command), "%c %ld %s",'o',txid,from);
+  if (tfsRequest(s, fromShard, command, reply, sizeof(reply)) < 0)
+    return -1;
+  if ((res = atoi(reply)) != 0)
+    return res;
+  if ((subtree = strchr(reply, '\n')) == NULL)
+    res = TECNICOFS_ERROR_OTHER;
+
+  if (res == 0) {
+    snprintf (command, sizeof(command), "%c %ld %s%s",'i',txid,to,subtree);
+    if (tfsRequest(s, toShard, command, reply, sizeof(reply)) < 0)
+      res = -1;
+    else
+      res = atoi(reply);
+  }
+
+  if (res == 0) {
+    snprintf (command, sizeof(command), "%c %ld",'k',txid);
+    if (tfsRequest(s, toShard, command, reply, sizeof(reply)) < 0)
+      res = -1;
+    else
+      res = atoi(reply);
+  }
+
+  /* commits the source only once the destination holds the subtree */
+  snprintf (command, sizeof(command), "%c %ld", res == 0 ? 'k' : 'a', txid);
+  if (tfsRequest(s, fromShard, command, reply, sizeof(reply)) < 0)
+    return -1;
+  return res == 0 ? atoi(reply) : res;
+}
+
+int tfsMove(char *from, char *to) {
+  tfsSession *s = session();
+  char command[2*MAX_FILE_NAME+4], reply[32];
+  int fromShard, toShard;
+
+  if (s == NULL)
+    return TECNICOFS_ERROR_NO_OPEN_SESSION;
+  fromShard = shardOf(s, from);
+  toShard = shardOf(s, to);
+
+  snprintf (command, sizeof(command), "%c %s %s",'m',from,to);
+  if (inTxn(s) && fromShard == toShard)
+    return txnAddOp(fromShard, command);
+  /* a transacao so pode ter um shard */
+  if (inTxn(s)) {
+    txn.failed = 1;
+    return TECNICOFS_ERROR_OTHER;
+  }
+
+  if (fromShard != toShard)
+    return tfsMoveAcrossShards(s, from, fromShard, to, toShard);
+
+  if (tfsRequest(s, fromShard, command, reply, sizeof(reply)) < 0)
+    return -1;
+  return atoi(reply);
+}
+
+/*
+ * A snapshot (read-only) or a clone (writable) shares the tables of the
+ * original until either changes, so both paths must be on the same shard.
+ */
+static int tfsCopy(char op, char *from, char *to) {
+  tfsSession *s = session();
+  char command[2*MAX_FILE_NAME+4], reply[32];
+  int shard;
+
+  if (s == NULL)
+    return TECNICOFS_ERROR_NO_OPEN_SESSION;
+  shard = shardOf(s, from);
+  if (shardOf(s, to) != shard)
+    return TECNICOFS_ERROR_OTHER;
+
+  snprintf (command, sizeof(command), "%c %s %s",op,from,to);
+  if (tfsRequest(s, shard, command, reply, sizeof(reply)) < 0)
+    return -1;
+  return atoi(reply);
+}
+
+int tfsSnapshot(char *path, char *snapshotPath) {
+  return tfsCopy('s', path, snapshotPath);
+}
+
+int tfsClone(char *from, char *to) {
+  return tfsCopy('z', from, to);
+}
+
+/*
+ * Unmaps the mirror of a shard. Must be called with the mirror lock held
+ * for writing.
+ */
+static void unmapMirror(tfsSession *s, int shard) {
+  if (s->mirrors[shard].header != NULL)
+    munmap(s->mirrors[shard].header, s->mirrors[shard].size);
+  s->mirrors[shard].header = NULL;
+}
+
+/*
+ * Maps the mirror of a shard, unless the file is the one already mapped
+ * (a server that takes over from another writes a new one). Must be
+ * called with the mirror lock held for writing.
+ * Returns 1 if a new mirror was mapped, 0 otherwise.
+ */
+static int mapMirror(tfsSession *s, int shard) {
+  char path[sizeof(s->shard_addr[0].sun_path) + sizeof(MIRROR_SUFFIX)];
+  mappedMirror *mirror = &s->mirrors[shard];
+  mirror_header *header;
+  struct stat st;
+  int fd;
+
+  snprintf(path, sizeof(path), "%s%s", s->shard_addr[shard].sun_path, MIRROR_SUFFIX);
+  if ((fd = open(path, O_RDONLY)) < 0)
+    return 0;
+  if (fstat(fd, &st) < 0 || (mirror->header != NULL && st.st_ino == mirror->ino) ||
+      st.st_size < sizeof(mirror_header)) {
+    close(fd);
+    return 0;
+  }
+  header = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (header == MAP_FAILED)
+    return 0;
+  if (memcmp(header->magic, MIRROR_MAGIC, sizeof(header->magic)) != 0 || header->version != MIRROR_VERSION ||
+      st.st_size < MIRROR_SIZE(header->inodes, header->entries)) {
+    munmap(header, st.st_size);
+    return 0;
+  }
+
+  unmapMirror(s, shard);
+  mirror->header = header;
+  mirror->size = st.st_size;
+  mirror->ino = st.st_ino;
+  return 1;
+}
+
+/*
+ * Follows a path through the mirror, noting the counter of each directory
+ * before reading its entries. The path is read as the server reads it.
+ * Returns 1 with the i-number (-1 if there is no such node), 0 if the
+ * mirror changed meanwhile, or -1 if the path must go to the server.
+ */
+static int mirrorResolve(mirror_header *header, char *path, int *dirs, uint32_t *seqs, int *depth, int *inumber) {
+  uint32_t *counters = MIRROR_COUNTERS(header);
+  mirror_entry *slots = MIRROR_SLOTS(header);
+  int current = 0, i = 0;
+
+  *depth = 0;
+  while (path[i] != '\0' && !isspace((unsigned char) path[i])) {
+    unsigned int hash = 2166136261u, slot;
+    int start, len;
+
+    if (path[i] == '/') {
+      i++;
+      continue;
     }
-  if (recvfrom(sockfd, buffer, sizeof(buffer), 0, (struct sockaddr *) &serv_addr, &servlen) < 0) {
-      perror("client: recvfrom error");
+    for (start = i; path[i] != '\0' && path[i] != '/' && !isspace((unsigned char) path[i]); i++) {
+      hash ^= (unsigned char) path[i];
+      hash *= 16777619u;
+    }
+    len = i - start;
+    if (*depth == MAX_FILE_NAME / 2 || len >= MAX_FILE_NAME)
       return -1;
+
+    dirs[*depth] = current;
+    seqs[*depth] = __atomic_load_n(&counters[current], __ATOMIC_ACQUIRE);
+    if (seqs[(*depth)++] & 1)
+      return 0;
+
+    slot = (hash ^ current * MIRROR_HASH_MULTIPLIER) % header->entries;
+    for (int n = 0; n < header->entries; n++, slot = (slot + 1) % header->entries) {
+      mirror_entry *entry = &slots[slot];
+      int parent = __atomic_load_n(&entry->parent, __ATOMIC_ACQUIRE);
+
+      if (parent == MIRROR_EMPTY)
+        break;
+      if (parent == current && entry->hash == hash && entry->length == len &&
+          memcmp(entry->name, path + start, len) == 0) {
+        *inumber = __atomic_load_n(&entry->inumber, __ATOMIC_RELAXED);
+        break;
+      }
     }
-  return 0;
+    if (*inumber == -1)
+      return 1;
+    /* an i-number out of the table can only be a read in the middle of a write */
+    if (*inumber < 0 || *inumber >= header->inodes)
+      return 0;
+    current = *inumber;
+    *inumber = -1;
+  }
+
+  if (i >= MAX_FILE_NAME)
+    return -1;
+  *inumber = current;
+  return 1;
 }
 
-int tfsMove(char *from, char *to) {
-  char command[100];
-  snprintf (command, 100, "%c %s %s",'m',from,to);
-  if (sendto(sockfd, command, strlen(command)+1, 0, (struct sockaddr *) &serv_addr, servlen) < 0) {
-      perror("client: sendto error");
-      return -1;
+/*
+ * Looks a path up in the mirror of its shard: the lookup holds if the
+ * counters of the directories it went through did not change by the end.
+ * Returns 1 with the i-number, or 0 if the lookup must be sent to the
+ * server (no mirror, out of date, or changing all the time).
+ */
+static int mirrorLookup(tfsSession *s, int shard, char *path, int *inumber) {
+  int dirs[MAX_FILE_NAME / 2], depth, res = 0;
+  uint32_t seqs[MAX_FILE_NAME / 2];
+  int remapped = 0;
+
+  pthread_rwlock_rdlock(&s->mirrorLock);
+  for (int attempt = 0; attempt < MIRROR_RETRIES; attempt++) {
+    mirror_header *header = s->mirrors[shard].header;
+    uint32_t seq;
+    int valid;
+
+    if (header == NULL)
+      break;
+    seq = __atomic_load_n(&header->seq, __ATOMIC_ACQUIRE);
+    valid = header->valid;
+    if (!valid) {
+      /* the server may have moved to a new process, with another file */
+      if (remapped++)
+        break;
+      pthread_rwlock_unlock(&s->mirrorLock);
+      pthread_rwlock_wrlock(&s->mirrorLock);
+      mapMirror(s, shard);
+      pthread_rwlock_unlock(&s->mirrorLock);
+      pthread_rwlock_rdlock(&s->mirrorLock);
+      continue;
     }
-  if (recvfrom(sockfd, buffer, sizeof(buffer), 0, (struct sockaddr *) &serv_addr, &servlen) < 0) {
-      perror("client: recvfrom error");
-      return -1;
+    if (seq & 1)
+      continue;
+
+    *inumber = -1;
+    if ((res = mirrorResolve(header, path, dirs, seqs, &depth, inumber)) < 0)
+      break;
+    if (res == 0)
+      continue;
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    while (depth > 0 && __atomic_load_n(&MIRROR_COUNTERS(header)[dirs[depth - 1]], __ATOMIC_RELAXED) == seqs[depth - 1])
+      depth--;
+    if (depth == 0 && __atomic_load_n(&header->seq, __ATOMIC_RELAXED) == seq) {
+      pthread_rwlock_unlock(&s->mirrorLock);
+      return 1;
     }
+  }
+  pthread_rwlock_unlock(&s->mirrorLock);
   return 0;
 }
 
+/*
+ * Enables or disables looking paths up in the mirror of each server.
+ */
+int tfsSetMirror(int enabled) {
+  tfsSession *s = session();
+
+  if (s == NULL)
+    return TECNICOFS_ERROR_NO_OPEN_SESSION;
+  pthread_rwlock_wrlock(&s->mirrorLock);
+  s->mirrorEnabled = enabled;
+  for (int shard = 0; shard < s->nshards; shard++) {
+    if (enabled)
+      mapMirror(s, shard);
+    else
+      unmapMirror(s, shard);
+  }
+  pthread_rwlock_unlock(&s->mirrorLock);
+  return 0;
+}
+
+int tfsSetLookupCache(int enabled) {
+  tfsSession *s = session();
+
+  if (s == NULL)
+    return TECNICOFS_ERROR_NO_OPEN_SESSION;
+  pthread_mutex_lock(&s->lock);
+  s->cacheEnabled = enabled;
+  flushLookupCache(s);
+  pthread_mutex_unlock(&s->lock);
+  return 0;
+}
+
+/*
+ * With the cache enabled, a lookup asks for a lease ('L') and is then
+ * answered locally until the lease expires. The expiry is counted from
+ * before the request was sent, so it never outlives the server's lease.
+ */
 int tfsLookup(char *path) {
+  tfsSession *s = session();
   char command[100];
-  snprintf (command, 100, "%c %s",'l',path);
-  if (sendto(sockfd, command, strlen(command)+1, 0, (struct sockaddr *) &serv_addr, servlen) < 0) {
-      perror("client: sendto error");
+  char reply[32];
+  cachedLookup *entry;
+  struct timespec now;
+  unsigned long generation;
+  int inumber, duration;
+  char t;
+
+  if (s == NULL)
+    return TECNICOFS_ERROR_NO_OPEN_SESSION;
+
+  if (inTxn(s)) {
+    char line[MAX_FILE_NAME + 32];
+    unsigned long version;
+
+    snprintf (command, 100, "%c %s",'v',path);
+    if (tfsRequest(s, shardOf(s, path), command, reply, sizeof(reply)) < 0)
       return -1;
-    }
-  if (recvfrom(sockfd, buffer, sizeof(buffer), 0, (struct sockaddr *) &serv_addr, &servlen) < 0) {
-      perror("client: recvfrom error");
+    if (sscanf(reply, "%d %lu", &inumber, &version) < 2)
+      return atoi(reply);
+    snprintf (line, sizeof(line), "v %lu %s", version, path);
+    txnAdd(shardOf(s, path), txn.readSet, &txn.readLen, &txn.reads, TXN_MAX_READS, line);
+    return inumber;
+  }
+
+  if (s->mirrorEnabled && mirrorLookup(s, shardOf(s, path), path, &inumber))
+    return inumber;
+
+  if (!s->cacheEnabled) {
+    snprintf (command, 100, "%c %s",'l',path);
+    if (tfsRequest(s, shardOf(s, path), command, reply, sizeof(reply)) < 0)
       return -1;
+    return atoi(reply);
+  }
+
+  entry = &s->lookupCache[pathHash(path) % LOOKUP_CACHE_SIZE];
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  pthread_mutex_lock(&s->lock);
+  if (strcmp(entry->path, path) == 0 &&
+      (now.tv_sec < entry->expiry.tv_sec ||
+       (now.tv_sec == entry->expiry.tv_sec && now.tv_nsec < entry->expiry.tv_nsec))) {
+    inumber = entry->inumber;
+    pthread_mutex_unlock(&s->lock);
+    return inumber;
+  }
+  generation = s->cacheGeneration;
+  pthread_mutex_unlock(&s->lock);
+
+  snprintf (command, 100, "%c %s",'L',path);
+  if (tfsRequest(s, shardOf(s, path), command, reply, sizeof(reply)) < 0)
+    return -1;
+  if (sscanf(reply, "%d %c %d", &inumber, &t, &duration) < 3)
+    return atoi(reply);
+
+  /* an invalidation received meanwhile may be newer than this reply */
+  pthread_mutex_lock(&s->lock);
+  if (generation == s->cacheGeneration && strlen(path) < MAX_FILE_NAME) {
+    strcpy(entry->path, path);
+    entry->inumber = inumber;
+    entry->expiry.tv_sec = now.tv_sec + duration / 1000;
+    entry->expiry.tv_nsec = now.tv_nsec + (duration % 1000) * 1000000L;
+    if (entry->expiry.tv_nsec >= 1000000000L) {
+      entry->expiry.tv_sec++;
+      entry->expiry.tv_nsec -= 1000000000L;
+    }
+  }
+  pthread_mutex_unlock(&s->lock);
+  return inumber;
+}
+
+/*
+ * Parses the reply to a readdir: "<count> <next_cursor>" followed by
+ * "<name> <inumber> <f|d>" per entry.
+ */
+static int parseReadDir(char *reply, int max, tfsDirEntry *entries, int *next_cursor) {
+  int count, offset, n;
+
+  if (sscanf(reply, "%d%n", &count, &offset) < 1)
+    return TECNICOFS_ERROR_OTHER;
+  if (count < 0)
+    return count;
+  if (count > max || sscanf(reply + offset, "%d%n", next_cursor, &n) < 1)
+    return TECNICOFS_ERROR_OTHER;
+  offset += n;
+
+  for (int i = 0; i < count; i++) {
+    char t;
+    if (sscanf(reply + offset, " %99s %d %c%n", entries[i].name, &entries[i].inumber, &t, &n) < 3)
+      return TECNICOFS_ERROR_OTHER;
+    entries[i].nodeType = (t == 'd') ? T_DIRECTORY : T_FILE;
+    offset += n;
+  }
+  return count;
+}
+
+static int tfsReadDirShard(tfsSession *s, int shard, char *path, int cursor, int max, tfsDirEntry *entries, int *next_cursor) {
+  char command[MAX_FILE_NAME+32];
+  char reply[READDIR_REPLY_SIZE];
+
+  snprintf (command, sizeof(command), "%c %s %d %d",'r',path,cursor,max);
+  if (tfsRequest(s, shard, command, reply, sizeof(reply)) < 0)
+    return -1;
+  return parseReadDir(reply, max, entries, next_cursor);
+}
+
+/*
+ * The root is split across every shard, so its cursor also encodes the
+ * shard being listed: cursor = slot * nshards + shard.
+ */
+int tfsReadDir(char *path, int cursor, int max, tfsDirEntry *entries, int *next_cursor) {
+  tfsSession *s = session();
+  int shard, count;
+
+  if (s == NULL)
+    return TECNICOFS_ERROR_NO_OPEN_SESSION;
+  if (!isRoot(path) || s->nshards == 1)
+    return tfsReadDirShard(s, shardOf(s, path), path, cursor, max, entries, next_cursor);
+
+  if (cursor < 0)
+    return TECNICOFS_ERROR_OTHER;
+  shard = cursor % s->nshards;
+  count = tfsReadDirShard(s, shard, path, cursor / s->nshards, max, entries, next_cursor);
+  if (count < 0)
+    return count;
+
+  if (*next_cursor != TECNICOFS_READDIR_END)
+    *next_cursor = *next_cursor * s->nshards + shard;
+  else if (shard + 1 < s->nshards)
+    *next_cursor = shard + 1;
+  return count;
+}
+
+/*
+ * Matches of a find on one shard, handed to the handler of tfsFind as
+ * their batches arrive.
+ */
+typedef struct findBatches {
+  tfsFindHandler handler;
+  void *arg;
+  int received;
+  int lost;
+} findBatches;
+
+/*
+ * Handles a batch of matches ("+ <batch> <count>" and "<path> <f|d>" per
+ * match), which must be the next batch of its find.
+ */
+static void handleFindBatch(char *batch, void *arg) {
+  findBatches *find = arg;
+  char path[MAX_FILE_NAME], nodeType;
+  int index, count, offset = 0;
+
+  if (find->lost || sscanf(batch, "+ %d %d%n", &index, &count, &offset) < 2 || index != find->received) {
+    find->lost = 1;
+    return;
+  }
+  find->received++;
+  for (int i = 0; i < count; i++) {
+    batch += offset;
+    if (sscanf(batch, " %99s %c%n", path, &nodeType, &offset) < 2) {
+      find->lost = 1;
+      return;
     }
+    find->handler(path, nodeType == 'd' ? T_DIRECTORY : T_FILE, find->arg);
+  }
+}
+
+/*
+ * Finds the nodes below root whose name matches pattern (see fnmatch(3);
+ * it cannot have white space), up to limit of them, or all of them if
+ * limit is 0. The server searches the subtree as it was when the find
+ * started. The handler gets each match, with arg, as it arrives.
+ * Below the root of a shard map, the shards are searched one by one.
+ * Returns the number of matches, or a negative error.
+ */
+int tfsFind(char *root, char *pattern, int limit, tfsFindHandler handler, void *arg) {
+  tfsSession *s = session();
+  char command[2 * MAX_FILE_NAME + 32], reply[32];
+  int found = 0;
+
+  if (s == NULL)
+    return TECNICOFS_ERROR_NO_OPEN_SESSION;
+  if (strlen(root) >= MAX_FILE_NAME || pattern[0] == '\0' || strlen(pattern) >= MAX_FILE_NAME ||
+      strpbrk(pattern, " \t\n") != NULL || limit < 0)
+    return TECNICOFS_ERROR_OTHER;
+
+  for (int shard = 0; shard < s->nshards && (limit == 0 || found < limit); shard++) {
+    findBatches find = { handler, arg, 0, 0 };
+    int res, batches;
+
+    if (!isRoot(root) && shard != shardOf(s, root))
+      continue;
+    snprintf (command, sizeof(command), "F %s %s %d", root[0] != '\0' ? root : "/", pattern,
+              limit > 0 ? limit - found : 0);
+    if (tfsRequestPartial(s, shard, command, reply, sizeof(reply), handleFindBatch, &find) < 0)
+      return -1;
+    if (sscanf(reply, "%d %d", &res, &batches) < 2)
+      return TECNICOFS_ERROR_OTHER;
+    if (res < 0)
+      return res;
+    /* um lote que se perdeu deixava a procura incompleta */
+    if (find.lost || find.received != batches)
+      return TECNICOFS_ERROR_CONNECTION_ERROR;
+    found += res;
+  }
+  return found;
+}
+
+/*
+ * Gets how many files and directories there are below path, and the bytes
+ * in those files, or, for a file, the file itself and its bytes. The
+ * server keeps these totals for every directory, so it takes no longer
+ * for a large subtree than for a small one. The totals of the root of a
+ * shard map add up those of every shard.
+ * Returns 0, or a negative error.
+ */
+int tfsStatPath(char *path, tfsPathStat *stat) {
+  tfsSession *s = session();
+  char command[MAX_FILE_NAME + 16], reply[96];
+  tfsPathStat total = { 0, 0, 0 };
+
+  if (s == NULL)
+    return TECNICOFS_ERROR_NO_OPEN_SESSION;
+  if (strlen(path) >= MAX_FILE_NAME)
+    return TECNICOFS_ERROR_OTHER;
+
+  snprintf (command, sizeof(command), "%c %s", 'A', path[0] != '\0' ? path : "/");
+  for (int shard = 0; shard < s->nshards; shard++) {
+    tfsPathStat part;
+    int res;
+
+    if (!isRoot(path) && shard != shardOf(s, path))
+      continue;
+    if (tfsRequest(s, shard, command, reply, sizeof(reply)) < 0)
+      return -1;
+    if ((res = atoi(reply)) < 0)
+      return res;
+    if (sscanf(reply, "%d %ld %ld %ld", &res, &part.files, &part.directories, &part.bytes) < 4)
+      return TECNICOFS_ERROR_OTHER;
+    total.files += part.files;
+    total.directories += part.directories;
+    total.bytes += part.bytes;
+  }
+  if (stat)
+    *stat = total;
   return 0;
 }
 
+/*
+ * Sends a command about a handle ("<op> <args>") to the shard that opened
+ * it. Handles also say which shard holds the node:
+ * handle = shard * MAX_OPEN_FILES + handle on that shard.
+ * Returns the number of bytes received, or a negative error.
+ */
+static int handleRequest(int fd, char *command, char *reply, int replylen) {
+  tfsSession *s = session();
+  char request[FILE_IO_SIZE + 32];
+
+  if (s == NULL)
+    return TECNICOFS_ERROR_NO_OPEN_SESSION;
+  if (fd < 0 || fd >= s->nshards * MAX_OPEN_FILES)
+    return TECNICOFS_ERROR_FILE_NOT_OPEN;
+  snprintf (request, sizeof(request), "%c %d%s", command[0], fd % MAX_OPEN_FILES, command + 1);
+  return tfsRequest(s, fd / MAX_OPEN_FILES, request, reply, replylen);
+}
+
+/*
+ * Opens a node and returns a handle for it, which stays valid if the node
+ * is moved. Directories can only be opened for READ.
+ */
+int tfsOpen(char *path, permission mode) {
+  tfsSession *s = session();
+  char command[MAX_FILE_NAME+16], reply[32];
+  int shard, res;
+
+  if (s == NULL)
+    return TECNICOFS_ERROR_NO_OPEN_SESSION;
+  shard = shardOf(s, path);
+  snprintf (command, sizeof(command), "%c %s %d",'O',path,mode);
+  if (tfsRequest(s, shard, command, reply, sizeof(reply)) < 0)
+    return -1;
+  res = atoi(reply);
+  return res < 0 ? res : shard * MAX_OPEN_FILES + res;
+}
+
+int tfsClose(int fd) {
+  char reply[32];
+  int res;
+
+  if ((res = handleRequest(fd, "C", reply, sizeof(reply))) < 0)
+    return res;
+  return atoi(reply);
+}
+
+/*
+ * Reads at most len-1 bytes of a file opened for READ into buffer, which
+ * is then terminated. Returns the number of bytes read.
+ */
+int tfsRead(int fd, char *buf, int len) {
+  char command[32];
+  char reply[FILE_IO_SIZE + 32];
+  int count, offset;
+
+  if (len < 1)
+    return TECNICOFS_ERROR_OTHER;
+  snprintf (command, sizeof(command), "R %d", len - 1);
+  if ((count = handleRequest(fd, command, reply, sizeof(reply))) < 0)
+    return count;
+
+  /* "<bytes> <conteudo>" */
+  if (sscanf(reply, "%d%n", &count, &offset) < 1)
+    return TECNICOFS_ERROR_OTHER;
+  if (count < 0)
+    return count;
+  if (count > len - 1)
+    count = len - 1;
+  memcpy(buf, reply + offset + 1, count);
+  buf[count] = '\0';
+  return count;
+}
+
+/*
+ * Replaces the contents of a file opened for WRITE with len bytes of text.
+ * Returns the number of bytes written.
+ */
+int tfsWrite(int fd, char *buf, int len) {
+  char command[FILE_IO_SIZE + 8], reply[32];
+  int res;
+
+  if (len < 0 || len > FILE_IO_SIZE || memchr(buf, '\0', len) != NULL)
+    return TECNICOFS_ERROR_OTHER;
+  snprintf (command, sizeof(command), "W %.*s", len, buf);
+  if ((res = handleRequest(fd, command, reply, sizeof(reply))) < 0)
+    return res;
+  return atoi(reply);
+}
+
+int tfsStat(int fd, type *nodeType, int *size) {
+  char reply[64];
+  int res, bytes;
+  char t;
+
+  if ((res = handleRequest(fd, "S", reply, sizeof(reply))) < 0)
+    return res;
+  if ((res = atoi(reply)) < 0)
+    return res;
+  if (sscanf(reply, "%d %c %d", &res, &t, &bytes) < 3)
+    return TECNICOFS_ERROR_OTHER;
+  if (nodeType)
+    *nodeType = (t == 'd') ? T_DIRECTORY : T_FILE;
+  if (size)
+    *size = bytes;
+  return 0;
+}
+
+/*
+ * Lists a page of a directory opened for READ, like tfsReadDir.
+ */
+int tfsReadDirHandle(int fd, int cursor, int max, tfsDirEntry *entries, int *next_cursor) {
+  char command[32];
+  char reply[READDIR_REPLY_SIZE];
+  int res;
+
+  snprintf (command, sizeof(command), "D %d %d", cursor, max);
+  if ((res = handleRequest(fd, command, reply, sizeof(reply))) < 0)
+    return res;
+  return parseReadDir(reply, max, entries, next_cursor);
+}
+
+/*
+ * Starts watching a directory: its changes are returned by tfsWatchNext.
+ * Returns the watch descriptor (shard * MAX_WATCHES + watch on that shard).
+ */
+int tfsWatch(char *path) {
+  tfsSession *s = session();
+  char command[MAX_FILE_NAME+8], reply[32];
+  int shard, res;
+
+  if (s == NULL)
+    return TECNICOFS_ERROR_NO_OPEN_SESSION;
+  shard = shardOf(s, path);
+  snprintf (command, sizeof(command), "%c %s",'w',path);
+  if (tfsRequest(s, shard, command, reply, sizeof(reply)) < 0)
+    return -1;
+  res = atoi(reply);
+  if (res < 0)
+    return res;
+  pthread_mutex_lock(&s->lock);
+  s->watching[shard]++;
+  pthread_mutex_unlock(&s->lock);
+  return shard * MAX_WATCHES + res;
+}
+
+int tfsUnwatch(int wd) {
+  tfsSession *s = session();
+  char command[32], reply[32];
+  int shard = wd / MAX_WATCHES, res;
+
+  if (s == NULL)
+    return TECNICOFS_ERROR_NO_OPEN_SESSION;
+  if (wd < 0 || shard >= s->nshards)
+    return TECNICOFS_ERROR_FILE_NOT_OPEN;
+  snprintf (command, sizeof(command), "%c %d",'x',wd % MAX_WATCHES);
+  if (tfsRequest(s, shard, command, reply, sizeof(reply)) < 0)
+    return -1;
+  if ((res = atoi(reply)) == 0) {
+    pthread_mutex_lock(&s->lock);
+    s->watching[shard]--;
+    pthread_mutex_unlock(&s->lock);
+  }
+  return res;
+}
+
+/*
+ * Returns the next event of the watches of the session, waiting up to
+ * timeout_ms milliseconds (forever if negative) for one to arrive.
+ * Returns 1 with the event, 0 on timeout or -1 on error.
+ */
+int tfsWatchNext(tfsWatchEvent *event, int timeout_ms) {
+  tfsSession *s = session();
+  struct timespec deadline;
+  int watching[MAX_SHARDS], empty;
+  char reply[32];
+
+  if (s == NULL)
+    return TECNICOFS_ERROR_NO_OPEN_SESSION;
+  deadlineAfter(&deadline, timeout_ms < 0 ? 0 : timeout_ms);
+
+  pthread_mutex_lock(&s->lock);
+  empty = s->eventCount == 0 && !s->eventOverflow;
+  memcpy(watching, s->watching, sizeof(watching));
+  pthread_mutex_unlock(&s->lock);
+
+  /* eventos que nao couberam no socket ficaram na fila do servidor; o
+   * demultiplexer recebe-os antes da resposta */
+  if (empty) {
+    for (int shard = 0; shard < s->nshards; shard++) {
+      if (watching[shard] > 0 && tfsRequest(s, shard, "E", reply, sizeof(reply)) < 0)
+        return -1;
+    }
+  }
+
+  pthread_mutex_lock(&s->lock);
+  while (s->eventCount == 0 && !s->eventOverflow) {
+    if (timeout_ms < 0)
+      pthread_cond_wait(&s->eventArrived, &s->lock);
+    else if (pthread_cond_timedwait(&s->eventArrived, &s->lock, &deadline) == ETIMEDOUT &&
+             s->eventCount == 0 && !s->eventOverflow) {
+      pthread_mutex_unlock(&s->lock);
+      return 0;
+    }
+  }
+
+  if (s->eventOverflow) {
+    event->wd = -1;
+    event->type = TFS_EVENT_OVERFLOW;
+    strcpy(event->name, "-");
+    s->eventOverflow = 0;
+  }
+  else {
+    *event = s->eventQueue[s->eventHead];
+    s->eventHead = (s->eventHead + 1) % EVENT_QUEUE_SIZE;
+    s->eventCount--;
+  }
+  pthread_mutex_unlock(&s->lock);
+  return 1;
+}
+
+/*
+ * Each shard prints its part of the tree; with more than one shard the
+ * output of shard i goes to "<filename>.<i>".
+ */
 int tfsPrintTree(char *filename) {
-  char command[100];
-  snprintf (command, 100, "%c %s",'p',filename);
-  if (sendto(sockfd, command, strlen(command)+1, 0, (struct sockaddr *) &serv_addr, servlen) < 0) {
-      perror("client: sendto error");
+  tfsSession *s = session();
+  char command[100], reply[32];
+  int res = 0;
+
+  if (s == NULL)
+    return TECNICOFS_ERROR_NO_OPEN_SESSION;
+  for (int shard = 0; shard < s->nshards; shard++) {
+    if (s->nshards == 1)
+      snprintf (command, 100, "%c %s",'p',filename);
+    else
+      snprintf (command, 100, "%c %s.%d",'p',filename,shard);
+    if (tfsRequest(s, shard, command, reply, sizeof(reply)) < 0)
       return -1;
+    if (atoi(reply) != 0)
+      res = atoi(reply);
+  }
+  return res;
+}
+
+/*
+ * Copies the scheduling metrics of a shard into stats, one line per class
+ * of requests. Returns the length of the metrics, or -1 on error.
+ */
+int tfsSchedStats(int shard, char *stats, int size) {
+  tfsSession *s = session();
+
+  if (s == NULL)
+    return TECNICOFS_ERROR_NO_OPEN_SESSION;
+  if (shard < 0 || shard >= s->nshards)
+    return TECNICOFS_ERROR_OTHER;
+  return tfsRequest(s, shard, "Q", stats, size);
+}
+
+/*
+ * Sets the bounds of the worker pool of a shard, unless min is 0, which
+ * leaves them as they are. Returns the number of workers the shard has,
+ * or TECNICOFS_ERROR_OTHER if the bounds are not valid.
+ */
+int tfsWorkerPool(int shard, int min, int max) {
+  tfsSession *s = session();
+  char command[32], reply[32];
+
+  if (s == NULL)
+    return TECNICOFS_ERROR_NO_OPEN_SESSION;
+  if (shard < 0 || shard >= s->nshards)
+    return TECNICOFS_ERROR_OTHER;
+  if (min == 0)
+    strcpy(command, "P");
+  else
+    snprintf(command, sizeof(command), "P %d %d", min, max);
+  if (tfsRequest(s, shard, command, reply, sizeof(reply)) < 0)
+    return -1;
+  return atoi(reply);
+}
+
+/*
+ * A child process has none of the threads of its parent, demultiplexers
+ * included, so it starts without sessions; it mounts its own.
+ */
+static void forgetSessions() {
+  if (defaultSession != NULL) {
+    for (int shard = 0; shard < defaultSession->nshards; shard++)
+      close(defaultSession->sockfd[shard]);
+  }
+  defaultSession = NULL;
+  currentSession = NULL;
+  txn.active = 0;
+}
+
+static void registerForkHandler() {
+  pthread_atfork(NULL, NULL, forgetSessions);
+}
+
+/*
+ * Closes and removes the sockets of a session, and frees it.
+ */
+static void closeSockets(tfsSession *s) {
+  for (int i = 0; i < s->nshards; i++) {
+    if (s->sockfd[i] < 0)
+      continue;
+    close(s->sockfd[i]);
+    if (s->client_addr[i].sun_path[0] != '\0')
+      unlink(s->client_addr[i].sun_path);
+  }
+  for (int i = 0; i < 2; i++) {
+    if (s->wakefd[i] >= 0)
+      close(s->wakefd[i]);
+  }
+  free(s);
+}
+
+/*
+ * Opens a session with a server, or with a sharded namespace when sockPath
+ * is a shard map: the socket paths of the shards separated by commas,
+ * always listed in the same order by every client.
+ * Returns the session, or NULL on error.
+ */
+tfsSession *tfsSessionOpen(char *sockPath) {
+  char map[MAX_SHARDS * sizeof(((struct sockaddr_un *) 0)->sun_path)];
+  char *shard, *saveptr;
+  unsigned long id;
+  struct timespec now;
+  tfsSession *s;
+
+  pthread_once(&forkHandlerOnce, registerForkHandler);
+  if ((s = calloc(1, sizeof(tfsSession))) == NULL)
+    return NULL;
+
+  strncpy(map, sockPath, sizeof(map) - 1);
+  map[sizeof(map) - 1] = '\0';
+  for (shard = strtok_r(map, ",", &saveptr); shard != NULL; shard = strtok_r(NULL, ",", &saveptr)) {
+    if (s->nshards == MAX_SHARDS || strlen(shard) >= sizeof(s->shard_addr[0].sun_path)) {
+      fprintf(stderr, "client: invalid shard map\n");
+      free(s);
+      return NULL;
     }
-  if (recvfrom(sockfd, buffer, sizeof(buffer), 0, (struct sockaddr *) &serv_addr, &servlen) < 0) {
-      perror("client: recvfrom error");
-      return -1;
+    s->shard_len[s->nshards] = setSockAddrUn(shard, &s->shard_addr[s->nshards]);
+    s->nshards++;
+  }
+  if (s->nshards == 0) {
+    fprintf(stderr, "client: invalid shard map\n");
+    free(s);
+    return NULL;
+  }
+
+  s->pid = getpid();
+  clock_gettime(CLOCK_REALTIME, &now);
+  s->requestSeq = (unsigned long) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+  s->requestTimeout = REQUEST_TIMEOUT_MS;
+  s->requestAttempts = REQUEST_ATTEMPTS;
+  id = __atomic_add_fetch(&sessionCounter, 1, __ATOMIC_RELAXED);
+  for (int i = 0; i < s->nshards; i++)
+    s->sockfd[i] = -1;
+  s->wakefd[0] = s->wakefd[1] = -1;
+
+  for (int i = 0; i < s->nshards; i++) {
+    char name[sizeof(s->client_addr[0].sun_path)];
+    socklen_t clilen;
+
+    snprintf (name, sizeof(name), "%d.%lu.%d", s->pid, id, i);
+    if ((s->sockfd[i] = socket(AF_UNIX, SOCK_DGRAM, 0) ) < 0) {
+      perror("client: can't open socket");
+      closeSockets(s);
+      return NULL;
     }
+    unlink(name);
+    clilen = setSockAddrUn (name, &s->client_addr[i]);
+    if (bind(s->sockfd[i], (struct sockaddr *) &s->client_addr[i], clilen) < 0) {
+      perror("client: bind error");
+      s->client_addr[i].sun_path[0] = '\0';
+      closeSockets(s);
+      return NULL;
+    }
+    /* sem servidor a correr fica por ligar, e as respostas podem perder-se */
+    connect(s->sockfd[i], (struct sockaddr *) &s->shard_addr[i], s->shard_len[i]);
+  }
+
+  if (pipe(s->wakefd) < 0) {
+    perror("client: can't open pipe");
+    closeSockets(s);
+    return NULL;
+  }
+  pthread_mutex_init(&s->lock, NULL);
+  pthread_condattr_init(&s->condattr);
+  pthread_condattr_setclock(&s->condattr, CLOCK_MONOTONIC);
+  pthread_cond_init(&s->eventArrived, &s->condattr);
+  pthread_rwlock_init(&s->mirrorLock, NULL);
+  if (pthread_create(&s->demux, NULL, demultiplex, s) != 0) {
+    perror("client: can't start demultiplexer");
+    closeSockets(s);
+    return NULL;
+  }
+  return s;
+}
+
+/*
+ * Closes a session, and the handles and watches it left open on each
+ * server. No other thread can be using it.
+ */
+int tfsSessionClose(tfsSession *s) {
+  char reply[32];
+
+  if (s == NULL)
+    return TECNICOFS_ERROR_NO_OPEN_SESSION;
+  for (int shard = 0; shard < s->nshards; shard++)
+    tfsRequest(s, shard, "U", reply, sizeof(reply));
+
+  /* o demultiplexer sai do poll quando o pipe fecha */
+  close(s->wakefd[1]);
+  s->wakefd[1] = -1;
+  pthread_join(s->demux, NULL);
+
+  for (int shard = 0; shard < s->nshards; shard++)
+    unmapMirror(s, shard);
+  pthread_rwlock_destroy(&s->mirrorLock);
+  pthread_cond_destroy(&s->eventArrived);
+  pthread_condattr_destroy(&s->condattr);
+  pthread_mutex_destroy(&s->lock);
+  if (currentSession == s)
+    currentSession = NULL;
+  if (txn.session == s)
+    txn.active = 0;
+  closeSockets(s);
+  return 0;
+}
+
+/*
+ * Makes the calling thread use a session, or the one of tfsMount if NULL.
+ * Threads can share a session.
+ */
+int tfsSessionUse(tfsSession *s) {
+  currentSession = s;
   return 0;
 }
 
+/*
+ * Mounts a server (or a shard map, see tfsSessionOpen) as the session of
+ * every thread that does not use one of its own.
+ */
 int tfsMount(char * sockPath) {
+  tfsSession *s = tfsSessionOpen(sockPath);
 
-  pid_client = getpid();
-  snprintf (SOCKET_CLIENT, 15,"%d",pid_client);
-  if ((sockfd = socket(AF_UNIX, SOCK_DGRAM, 0) ) < 0) {
-    perror("client: can't open socket");
-    return -1;
-  }
-  unlink(SOCKET_CLIENT);
-  clilen = setSockAddrUn (SOCKET_CLIENT, &client_addr);
-  if (bind(sockfd, (struct sockaddr *) &client_addr, clilen) < 0) {
-    perror("client: bind error");
+  if (s == NULL)
     return -1;
-  }  
-  servlen = setSockAddrUn(sockPath, &serv_addr);
-  
+  if (defaultSession != NULL)
+    tfsSessionClose(defaultSession);
+  defaultSession = s;
   return 0;
 }
 
 int tfsUnmount() {
+  tfsSession *s = defaultSession;
 
-  close(sockfd);
-
-  unlink(SOCKET_CLIENT);
-  
-  return 0;
+  defaultSession = NULL;
+  return tfsSessionClose(s);
 }
@@ -3,11 +3,80 @@
 
 #include "tecnicofs-api-constants.h"
 
+typedef struct tfsDirEntry {
+  char name[MAX_FILE_NAME];
+  int inumber;
+  type nodeType;
+} tfsDirEntry;
+
+/*
+ * A change to a watched directory. An overflow (wd -1) means events were
+ * lost and the watched directories should be listed again; a watch whose
+ * directory was deleted ends with TFS_EVENT_GONE.
+ */
+typedef enum tfsEventType {
+  TFS_EVENT_CREATE, TFS_EVENT_DELETE, TFS_EVENT_MOVED_FROM, TFS_EVENT_MOVED_TO,
+  TFS_EVENT_OVERFLOW, TFS_EVENT_GONE
+} tfsEventType;
+
+typedef struct tfsWatchEvent {
+  int wd;
+  tfsEventType type;
+  char name[MAX_FILE_NAME];
+} tfsWatchEvent;
+
+/*
+ * Totals of the subtree below a path, see tfsStatPath
+ */
+typedef struct tfsPathStat {
+  long files;
+  long directories;
+  long bytes;
+} tfsPathStat;
+
+/*
+ * A session with a server (or shard map): a socket per shard and a
+ * thread that hands each reply to the request waiting for it, so threads
+ * can share a session and have many requests in flight. The functions
+ * below work on the session of the calling thread (tfsSessionUse), or on
+ * the one of tfsMount if it has none; transactions belong to the thread.
+ */
+typedef struct tfsSession tfsSession;
+
+/* Gets each match of tfsFind, with the argument given to it */
+typedef void (*tfsFindHandler)(char *path, type nodeType, void *arg);
+
+tfsSession *tfsSessionOpen(char *serverName);
+int tfsSessionClose(tfsSession *session);
+int tfsSessionUse(tfsSession *session);
+
 int tfsCreate(char *path, char nodeType);
 int tfsDelete(char *path);
 int tfsLookup(char *path);
+int tfsSetLookupCache(int enabled);
+int tfsSetMirror(int enabled);
+int tfsSetRetries(int timeout_ms, int attempts);
 int tfsMove(char *from, char *to);
+int tfsSnapshot(char *path, char *snapshotPath);
+int tfsClone(char *from, char *to);
+int tfsTxnBegin();
+int tfsTxnCommit();
+int tfsTxnAbort();
+int tfsReadDir(char *path, int cursor, int max, tfsDirEntry *entries, int *next_cursor);
+int tfsFind(char *root, char *pattern, int limit, tfsFindHandler handler, void *arg);
+int tfsStatPath(char *path, tfsPathStat *stat);
+int tfsOpen(char *path, permission mode);
+int tfsClose(int fd);
+int tfsRead(int fd, char *buffer, int len);
+int tfsWrite(int fd, char *buffer, int len);
+int tfsStat(int fd, type *nodeType, int *size);
+int tfsReadDirHandle(int fd, int cursor, int max, tfsDirEntry *entries, int *next_cursor);
+int tfsWatch(char *path);
+int tfsUnwatch(int wd);
+int tfsWatchNext(tfsWatchEvent *event, int timeout_ms);
 int tfsPrintTree(char *filename);
+int tfsSchedStats(int shard, char *stats, int size);
+int tfsWorkerPool(int shard, int min, int max);
 int tfsMount(char* serverName);
 int tfsUnmount();
 
@@ -9,30 +9,65 @@
 #include <sys/uio.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include <pthread.h>
 
 #define MAX_INPUT_SIZE 100
+#define READDIR_PAGE_SIZE 8
+#define MAX_THREADS 64
+#define STREAM_BUCKETS 4096
+#define MAX_HANDLES 64
+#define EVENT_WAIT_MS 200
 
 //notas
 // arg[1] e o nome do file com os inputs, o arg[2] nome do socket server
+// com -t N o input e repetido em paralelo por N threads (ver processParallel)
 
 
 FILE* inputFile;
 char* serverName;
+int numThreads = 0;
+
+/* handles abertos com 'o', fechados com 'k' pelo caminho */
+typedef struct openHandle {
+    char path[MAX_INPUT_SIZE];
+    int fd;
+} openHandle;
+
+openHandle handles[MAX_HANDLES];
+int numHandles = 0;
+pthread_mutex_t handlesLock = PTHREAD_MUTEX_INITIALIZER;
 
 static void displayUsage (const char* appName) {
-    printf("Usage: %s inputfile server_socket_name\n", appName);
+    printf("Usage: %s [-t threads] inputfile server_socket_name\n", appName);
     exit(EXIT_FAILURE);
 }
 
 static void parseArgs (long argc, char* const argv[]) {
-    if (argc != 3) {
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:")) != -1) {
+        switch (opt) {
+            case 't':
+                numThreads = atoi(optarg);
+                if (numThreads < 1 || numThreads > MAX_THREADS) {
+                    fprintf(stderr, "Error: threads must be between 1 and %d\n", MAX_THREADS);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            default: displayUsage(argv[0]);
+        }
+    }
+    if (argc - optind != 2) {
         fprintf(stderr, "Invalid format:\n");
         displayUsage(argv[0]);
     }
 
-    serverName = argv[2];
+    serverName = argv[optind + 1];
 
-    inputFile = fopen(argv[1], "r");
+    inputFile = fopen(argv[optind], "r");
 
     if (inputFile== NULL) {
         fprintf(stderr, "Error: cannot open input file\n");
@@ -45,100 +80,501 @@ void errorParse(){
     exit(EXIT_FAILURE);
 }
 
-void *processInput() {
-    char line[MAX_INPUT_SIZE];
+static void printMatch(char *path, type nodeType, void *arg) {
+    printf("  %s %c\n", path, nodeType == T_DIRECTORY ? 'd' : 'f');
+}
 
-    while (fgets(line, sizeof(line)/sizeof(char), inputFile)) {
-        char op;
-        char arg1[MAX_INPUT_SIZE], arg2[MAX_INPUT_SIZE];
-        int res;
+/*
+ * Keeps the handle of a file opened by an 'o' line until a 'k' line with
+ * the same path closes it.
+ * Returns: 0, or -1 if there are MAX_HANDLES handles open
+ */
+static int keepHandle(char *path, int fd) {
+    int res = -1;
 
-        sscanf(line, "%c",&op);
+    pthread_mutex_lock(&handlesLock);
+    if (numHandles < MAX_HANDLES) {
+        strcpy(handles[numHandles].path, path);
+        handles[numHandles++].fd = fd;
+        res = 0;
+    }
+    pthread_mutex_unlock(&handlesLock);
+    return res;
+}
 
-        if (op == 'p') {  
-            int numTokens = sscanf(line, "%c %s", &op, arg1);
-        
-            if (numTokens < 1) { /* perform minimal validation */
-                fprintf(stderr, "Error: invalid command in Queue\n");
-                exit(EXIT_FAILURE);
-            }
-            res = tfsPrintTree(arg1);
-            if (!res)
-                printf("Created output file: %s\n", arg1);
-            else
-                printf("Unable to create output file: %s\n", arg1);
-            continue;
+/*
+ * Takes the handle last kept for a path.
+ * Returns: the handle, or -1 if none is open for it
+ */
+static int takeHandle(char *path) {
+    int fd = -1;
+
+    pthread_mutex_lock(&handlesLock);
+    for (int i = numHandles - 1; i >= 0; i--)
+        if (strcmp(handles[i].path, path) == 0) {
+            fd = handles[i].fd;
+            handles[i] = handles[--numHandles];
+            break;
         }
+    pthread_mutex_unlock(&handlesLock);
+    return fd;
+}
+
+/*
+ * Prints the events of the watches until none arrives for EVENT_WAIT_MS.
+ */
+static void printEvents() {
+    static const char *names[] = { "create", "delete", "moved_from", "moved_to", "overflow", "gone" };
+    tfsWatchEvent event;
+    int res;
+
+    while ((res = tfsWatchNext(&event, EVENT_WAIT_MS)) > 0)
+        printf("Event: %d %s %s\n", event.wd, names[event.type], event.name);
+    if (res < 0)
+        printf("Unable to get events\n");
+}
+
+static void processLine(char *line) {
+    char op;
+    char arg1[MAX_INPUT_SIZE], arg2[MAX_INPUT_SIZE];
+    int res;
 
-        int numTokens = sscanf(line, "%c %s %s", &op, arg1, arg2);
-        /* perform minimal validation */
-        if (numTokens < 1) {
-            continue;
+    sscanf(line, "%c",&op);
+
+    if (op == 'p') {  
+        int numTokens = sscanf(line, "%c %s", &op, arg1);
+    
+        if (numTokens < 1) { /* perform minimal validation */
+            fprintf(stderr, "Error: invalid command in Queue\n");
+            exit(EXIT_FAILURE);
         }
-        switch (op) {
-            case 'c':
-                if(numTokens != 3) {
-                    errorParse();
+        res = tfsPrintTree(arg1);
+        if (!res)
+            printf("Created output file: %s\n", arg1);
+        else
+            printf("Unable to create output file: %s\n", arg1);
+        return;
+    }
+
+    int numTokens = sscanf(line, "%c %s %s", &op, arg1, arg2);
+    /* perform minimal validation */
+    if (numTokens < 1) {
+        return;
+    }
+    switch (op) {
+        case 'c':
+            if(numTokens != 3) {
+                errorParse();
+                break;
+            }
+            switch (arg2[0]) {
+                case 'f':
+                    res = tfsCreate(arg1, 'f');
+                    if (!res)
+                      printf("Created file: %s\n", arg1);
+                    else
+                      printf("Unable to create file: %s\n", arg1);
+                    break;
+                case 'd':
+                    res = tfsCreate(arg1, 'd');
+                    if (!res)
+                      printf("Created directory: %s\n", arg1);
+                    else
+                      printf("Unable to create directory: %s\n", arg1);
+                    break;
+                default:
+                    fprintf(stderr, "Error: invalid node type\n");
+            }
+            break;
+        case 'l':
+            if(numTokens != 2)
+                errorParse();
+            res = tfsLookup(arg1);
+            if (res >= 0)
+                printf("Search: %s found\n", arg1);
+            else
+                printf("Search: %s not found\n", arg1);
+            break;
+        case 'd':
+            if(numTokens != 2)
+                errorParse();
+            res = tfsDelete(arg1);
+            if (!res)
+              printf("Deleted: %s\n", arg1);
+            else
+              printf("Unable to delete: %s\n", arg1);
+            break;
+        case 'm':
+            if(numTokens != 3)
+                errorParse();
+            res = tfsMove(arg1, arg2);
+            if (!res)
+              printf("Moved: %s to %s\n", arg1, arg2);
+            else
+              printf("Unable to move: %s to %s\n", arg1, arg2);
+            break;
+        case 's':
+            if(numTokens != 3)
+                errorParse();
+            res = tfsSnapshot(arg1, arg2);
+            if (!res)
+              printf("Snapshot: %s to %s\n", arg1, arg2);
+            else
+              printf("Unable to snapshot: %s to %s\n", arg1, arg2);
+            break;
+        case 'z':
+            if(numTokens != 3)
+                errorParse();
+            res = tfsClone(arg1, arg2);
+            if (!res)
+              printf("Cloned: %s to %s\n", arg1, arg2);
+            else
+              printf("Unable to clone: %s to %s\n", arg1, arg2);
+            break;
+        case 'r': {
+            tfsDirEntry entries[READDIR_PAGE_SIZE];
+            int cursor = TECNICOFS_READDIR_START;
+            if(numTokens != 2)
+                errorParse();
+            /* no modo paralelo a listagem nao se mistura com as outras linhas */
+            flockfile(stdout);
+            printf("Listing: %s\n", arg1);
+            while (cursor != TECNICOFS_READDIR_END) {
+                res = tfsReadDir(arg1, cursor, READDIR_PAGE_SIZE, entries, &cursor);
+                if (res < 0) {
+                    printf("Unable to list: %s\n", arg1);
                     break;
                 }
-                switch (arg2[0]) {
-                    case 'f':
-                        res = tfsCreate(arg1, 'f');
-                        if (!res)
-                          printf("Created file: %s\n", arg1);
-                        else
-                          printf("Unable to create file: %s\n", arg1);
-                        break;
-                    case 'd':
-                        res = tfsCreate(arg1, 'd');
-                        if (!res)
-                          printf("Created directory: %s\n", arg1);
-                        else
-                          printf("Unable to create directory: %s\n", arg1);
-                        break;
-                    default:
-                        fprintf(stderr, "Error: invalid node type\n");
-                }
-                break;
-            case 'l':
-                if(numTokens != 2)
-                    errorParse();
-                res = tfsLookup(arg1);
-                if (res >= 0)
-                    printf("Search: %s found\n", arg1);
-                else
-                    printf("Search: %s not found\n", arg1);
-                break;
-            case 'd':
-                if(numTokens != 2)
-                    errorParse();
-                res = tfsDelete(arg1);
-                if (!res)
-                  printf("Deleted: %s\n", arg1);
-                else
-                  printf("Unable to delete: %s\n", arg1);
-                break;
-            case 'm':
-                if(numTokens != 3)
-                    errorParse();
-                res = tfsMove(arg1, arg2);
-                if (!res)
-                  printf("Moved: %s to %s\n", arg1, arg2);
-                else
-                  printf("Unable to move: %s to %s\n", arg1, arg2);
-                break;
-            case '#':
-                break;
-            default: { /* error */
+                for (int i = 0; i < res; i++)
+                    printf("  %s %d %c\n", entries[i].name, entries[i].inumber,
+                           entries[i].nodeType == T_DIRECTORY ? 'd' : 'f');
+            }
+            funlockfile(stdout);
+            break;
+        }
+        case 'f': {
+            /* f <raiz> <padrao> [limite] */
+            int limit = 0;
+            if(numTokens != 3)
+                errorParse();
+            sscanf(line, "%*c %*s %*s %d", &limit);
+            flockfile(stdout);
+            printf("Finding: %s in %s\n", arg2, arg1);
+            res = tfsFind(arg1, arg2, limit, printMatch, NULL);
+            if (res >= 0)
+                printf("Found: %d\n", res);
+            else
+                printf("Unable to find: %s in %s\n", arg2, arg1);
+            funlockfile(stdout);
+            break;
+        }
+        case 'u': {
+            tfsPathStat stat;
+            if(numTokens != 2)
+                errorParse();
+            res = tfsStatPath(arg1, &stat);
+            if (!res)
+              printf("Totals: %s %ld files %ld directories %ld bytes\n", arg1, stat.files, stat.directories, stat.bytes);
+            else
+              printf("Unable to get totals: %s\n", arg1);
+            break;
+        }
+        case 'o': {
+            int fd;
+            if(numTokens != 2)
                 errorParse();
+            fd = tfsOpen(arg1, READ);
+            if (fd >= 0 && keepHandle(arg1, fd) == 0)
+              printf("Opened: %s\n", arg1);
+            else {
+              if (fd >= 0)
+                tfsClose(fd);
+              printf("Unable to open: %s\n", arg1);
             }
+            break;
+        }
+        case 'k': {
+            int fd;
+            if(numTokens != 2)
+                errorParse();
+            fd = takeHandle(arg1);
+            if (fd >= 0 && tfsClose(fd) == 0)
+              printf("Closed: %s\n", arg1);
+            else
+              printf("Unable to close: %s\n", arg1);
+            break;
         }
+        case 'w':
+            if(numTokens != 2)
+                errorParse();
+            res = tfsWatch(arg1);
+            if (res >= 0)
+              printf("Watching: %s (%d)\n", arg1, res);
+            else
+              printf("Unable to watch: %s\n", arg1);
+            break;
+        case 'e':
+            flockfile(stdout);
+            printEvents();
+            funlockfile(stdout);
+            break;
+        case '#':
+            break;
+        default: { /* error */
+            errorParse();
+        }
+    }
+
+}
+
+void *processInput() {
+    char line[MAX_INPUT_SIZE];
+
+    while (fgets(line, sizeof(line)/sizeof(char), inputFile))
+        processLine(line);
+    fclose(inputFile);
+    return NULL;
+}
+
+/*
+ * Parallel mode: the input is read whole and split into streams by the
+ * first component of the paths each line touches (a move, snapshot or
+ * clone joins the streams of its two paths). Every stream goes to one
+ * thread, which issues its lines in order on a session of its own, so
+ * the order of the lines of each path is kept. A line that touches the
+ * root or the whole tree (such as 'p') runs alone, once every line
+ * before it is done.
+ */
+
+/* a linha corre sozinha, depois de todas as anteriores */
+#define BARRIER -1
+/* comentario ou linha vazia */
+#define SKIP -2
+
+typedef struct inputLine {
+    char text[MAX_INPUT_SIZE];
+    int stream;
+} inputLine;
+
+typedef struct inputStream {
+    char key[MAX_INPUT_SIZE];
+    int parent;
+    int next;
+    int ops;
+    int thread;
+} inputStream;
+
+inputLine *lines;
+int numLines;
+inputStream *streams;
+int numStreams;
+int streamBuckets[STREAM_BUCKETS];
+pthread_barrier_t barrier;
+
+/*
+ * Copies the first component of a path to key.
+ * Returns: length of the component, 0 for the root
+ */
+static int pathKey(const char *path, char *key) {
+    int len = 0;
+
+    while (*path == '/')
+        path++;
+    while (path[len] != '\0' && path[len] != '/') {
+        key[len] = path[len];
+        len++;
+    }
+    key[len] = '\0';
+    return len;
+}
+
+static int streamRoot(int stream) {
+    while (streams[stream].parent != stream) {
+        streams[stream].parent = streams[streams[stream].parent].parent;
+        stream = streams[stream].parent;
+    }
+    return stream;
+}
+
+/*
+ * Finds the stream of the paths below a first component, or adds it.
+ * Returns: the stream, or BARRIER for the root
+ */
+static int streamOf(const char *path) {
+    char key[MAX_INPUT_SIZE];
+    unsigned int hash = 5381;
+    int stream;
+
+    if (pathKey(path, key) == 0)
+        return BARRIER;
+    for (char *c = key; *c != '\0'; c++)
+        hash = hash * 33 + (unsigned char) *c;
+    hash %= STREAM_BUCKETS;
+
+    for (stream = streamBuckets[hash] - 1; stream >= 0; stream = streams[stream].next - 1)
+        if (strcmp(streams[stream].key, key) == 0)
+            return streamRoot(stream);
+
+    if (numStreams % 256 == 0) {
+        streams = realloc(streams, (numStreams + 256) * sizeof(inputStream));
+        if (streams == NULL) {
+            fprintf(stderr, "Error: out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    stream = numStreams++;
+    strcpy(streams[stream].key, key);
+    streams[stream].parent = stream;
+    streams[stream].next = streamBuckets[hash];
+    streams[stream].ops = 0;
+    streamBuckets[hash] = stream + 1;
+    return stream;
+}
+
+/*
+ * Tells which stream a line belongs to, joining the streams of both paths
+ * for the commands that take two.
+ * Returns: the stream, BARRIER or SKIP
+ */
+static int classifyLine(char *line) {
+    char op, arg1[MAX_INPUT_SIZE], arg2[MAX_INPUT_SIZE];
+    int numTokens = sscanf(line, "%c %s %s", &op, arg1, arg2);
+    int first, second;
 
-    } 
+    if (numTokens < 1 || op == '#' || op == '\n')
+        return SKIP;
+    /* comandos invalidos correm sozinhos, e o processLine termina o cliente;
+     * 'w' e 'e' tambem, para os eventos chegarem a sessao da primeira thread */
+    if (numTokens < 2 || strchr("cldrfmszuok", op) == NULL)
+        return BARRIER;
+    if ((first = streamOf(arg1)) == BARRIER)
+        return BARRIER;
+    if (strchr("msz", op) == NULL || numTokens < 3)
+        return first;
+    if ((second = streamOf(arg2)) == BARRIER)
+        return BARRIER;
+    if (first != second)
+        streams[second].parent = first;
+    return first;
+}
+
+static int compareStreams(const void *a, const void *b) {
+    return streams[*(const int *) b].ops - streams[*(const int *) a].ops;
+}
+
+/*
+ * Gives each stream to a thread, the longest first, each to the thread
+ * with the fewest lines so far.
+ */
+static void assignStreams() {
+    int load[MAX_THREADS] = { 0 };
+    int *order = malloc((numStreams + 1) * sizeof(int));
+    int roots = 0;
+
+    for (int i = 0; i < numLines; i++)
+        if (lines[i].stream >= 0) {
+            lines[i].stream = streamRoot(lines[i].stream);
+            streams[lines[i].stream].ops++;
+        }
+    for (int i = 0; i < numStreams; i++)
+        if (streams[i].parent == i && streams[i].ops > 0)
+            order[roots++] = i;
+    qsort(order, roots, sizeof(int), compareStreams);
+
+    for (int i = 0; i < roots; i++) {
+        int least = 0;
+        for (int t = 1; t < numThreads; t++)
+            if (load[t] < load[least])
+                least = t;
+        streams[order[i]].thread = least;
+        load[least] += streams[order[i]].ops;
+    }
+    free(order);
+    numStreams = roots;
+}
+
+static void readInput() {
+    char line[MAX_INPUT_SIZE];
+
+    while (fgets(line, sizeof(line)/sizeof(char), inputFile)) {
+        if (numLines % 1024 == 0) {
+            lines = realloc(lines, (numLines + 1024) * sizeof(inputLine));
+            if (lines == NULL) {
+                fprintf(stderr, "Error: out of memory\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        strcpy(lines[numLines].text, line);
+        lines[numLines].stream = classifyLine(line);
+        numLines++;
+    }
     fclose(inputFile);
+}
+
+void *replayStreams(void *arg) {
+    int thread = *(int *) arg;
+    tfsSession *session = tfsSessionOpen(serverName);
+
+    if (session == NULL) {
+        fprintf(stderr, "Unable to mount socket: %s\n", serverName);
+        exit(EXIT_FAILURE);
+    }
+    tfsSessionUse(session);
+
+    for (int i = 0; i < numLines; i++) {
+        if (lines[i].stream == BARRIER) {
+            pthread_barrier_wait(&barrier);
+            if (thread == 0)
+                processLine(lines[i].text);
+            pthread_barrier_wait(&barrier);
+        }
+        else if (lines[i].stream >= 0 && streams[lines[i].stream].thread == thread)
+            processLine(lines[i].text);
+    }
+
+    tfsSessionUse(NULL);
+    tfsSessionClose(session);
     return NULL;
 }
 
+/*
+ * Replays the input on numThreads threads and prints the operations per
+ * second achieved.
+ */
+void processParallel() {
+    pthread_t threads[MAX_THREADS];
+    int ids[MAX_THREADS];
+    struct timespec start, end;
+    double seconds;
+    int ops = 0;
+
+    readInput();
+    assignStreams();
+    for (int i = 0; i < numLines; i++)
+        if (lines[i].stream != SKIP)
+            ops++;
+
+    pthread_barrier_init(&barrier, NULL, numThreads);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < numThreads; i++) {
+        ids[i] = i;
+        if (pthread_create(&threads[i], NULL, replayStreams, &ids[i]) != 0) {
+            fprintf(stderr, "Error: cannot create thread\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int i = 0; i < numThreads; i++)
+        pthread_join(threads[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    pthread_barrier_destroy(&barrier);
+
+    seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("Replayed %d ops in %d streams on %d threads: %.3f s, %.0f ops/s\n",
+           ops, numStreams, numThreads, seconds, seconds > 0 ? ops / seconds : 0);
+    free(lines);
+    free(streams);
+}
+
 int main(int argc, char* argv[]) {
 
     parseArgs(argc, argv);  
@@ -150,7 +586,10 @@ int main(int argc, char* argv[]) {
       exit(EXIT_FAILURE);
     }
 
-    processInput();
+    if (numThreads > 0)
+        processParallel();
+    else
+        processInput();
 
     tfsUnmount();
 
@@ -0,0 +1,265 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include <pthread.h>
+#include "fs/operations.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_RDTSC 1
+#endif
+
+/*
+ * Microbenchmarks for the primitives of fs/state.c and fs/operations.c,
+ * linked directly against the fs objects (built with -DDELAY=0, see the
+ * microbench target of the Makefile). Each primitive runs under several
+ * directory fan-outs, path depths and thread counts; read-only primitives
+ * run in parallel, the others serialized by a mutex like in the server.
+ * With -m, prints the memory used per i-node by each tree instead, and
+ * -s chooses how directory tags are scanned (avx2, sse2 or scalar) and
+ * -b turns off the filters of large directories.
+ */
+
+#define MAX_THREADS 64
+
+int iterations = 100000;
+int maxThreads = 4;
+int memoryReport = 0;
+
+pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* arvore do teste atual */
+int fanout, depth;
+char deepPath[MAX_FILE_NAME];
+char lastName[MAX_FILE_NAME];
+int benchDir;
+
+typedef struct result {
+    double ns;
+    double cycles;
+} result;
+
+typedef void (*primitive)(long iters);
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static unsigned long long cycles() {
+#ifdef HAVE_RDTSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+/*
+ * Builds a chain of depth directories, each holding fanout entries with
+ * the next directory of the chain in the last slot, so every lookup scans
+ * the whole directory. benchDir is an empty directory for the writers.
+ */
+static int buildTree() {
+    char path[MAX_FILE_NAME] = "";
+
+    destroy_fs();
+    init_fs();
+    for (int level = 0; level < depth; level++) {
+        char entry[MAX_FILE_NAME];
+        for (int i = 0; i < fanout; i++) {
+            snprintf(entry, sizeof(entry), "%s%se%d", path, level ? "/" : "", i);
+            if (create(entry, T_DIRECTORY) == FAIL)
+                return FAIL;
+        }
+        strcpy(path, entry);
+    }
+    strcpy(deepPath, path);
+    snprintf(lastName, sizeof(lastName), "e%d", fanout - 1);
+
+    if (create("bench", T_DIRECTORY) == FAIL)
+        return FAIL;
+    benchDir = lookup("bench");
+    return SUCCESS;
+}
+
+static void benchLookup(long iters) {
+    for (long i = 0; i < iters; i++) {
+        if (lookup(deepPath) == FAIL)
+            exit(EXIT_FAILURE);
+    }
+}
+
+static void benchLookupSubNode(long iters) {
+    union Data data;
+    inode_get(FS_ROOT, NULL, &data);
+    for (long i = 0; i < iters; i++) {
+        if (lookup_sub_node(lastName, data.directory) == FAIL)
+            exit(EXIT_FAILURE);
+    }
+}
+
+static void benchLookupSubNodeMiss(long iters) {
+    union Data data;
+    inode_get(FS_ROOT, NULL, &data);
+    for (long i = 0; i < iters; i++) {
+        if (lookup_sub_node("missing", data.directory) != FAIL)
+            exit(EXIT_FAILURE);
+    }
+}
+
+static void benchSplit(long iters) {
+    char copy[MAX_FILE_NAME], *parent, *child;
+    for (long i = 0; i < iters; i++) {
+        strcpy(copy, deepPath);
+        split_parent_child_from_path(copy, &parent, &child);
+    }
+}
+
+static void benchPathParse(long iters) {
+    fs_path path;
+    for (long i = 0; i < iters; i++) {
+        if (path_parse(&path, deepPath) == FAIL)
+            exit(EXIT_FAILURE);
+    }
+}
+
+static void benchLookupParsed(long iters) {
+    fs_path path;
+    path_parse(&path, deepPath);
+    for (long i = 0; i < iters; i++) {
+        if (lookup_parsed(&path, path.depth, NULL) == FAIL)
+            exit(EXIT_FAILURE);
+    }
+}
+
+static void benchInodeCreate(long iters) {
+    for (long i = 0; i < iters; i++) {
+        pthread_mutex_lock(&lock);
+        int inumber = inode_create(T_FILE);
+        if (inumber == FAIL)
+            exit(EXIT_FAILURE);
+        inode_delete(inumber);
+        pthread_mutex_unlock(&lock);
+    }
+}
+
+static void benchDirAddEntry(long iters) {
+    for (long i = 0; i < iters; i++) {
+        pthread_mutex_lock(&lock);
+        if (dir_add_entry(benchDir, FS_ROOT, lastName) == FAIL)
+            exit(EXIT_FAILURE);
+        dir_reset_entry(benchDir, FS_ROOT);
+        pthread_mutex_unlock(&lock);
+    }
+}
+
+typedef struct worker {
+    pthread_t tid;
+    primitive fn;
+    result res;
+} worker;
+
+static void *runWorker(void *arg) {
+    worker *w = arg;
+    double t0 = now();
+    unsigned long long c0 = cycles();
+
+    w->fn(iterations);
+    w->res.cycles = (double) (cycles() - c0) / iterations;
+    w->res.ns = (now() - t0) / iterations;
+    return NULL;
+}
+
+/*
+ * Runs a primitive in threads threads and returns the average cost of one
+ * call as seen by each thread.
+ */
+static result run(primitive fn, int threads) {
+    worker workers[MAX_THREADS];
+    result total = { 0, 0 };
+
+    for (int i = 0; i < threads; i++) {
+        workers[i].fn = fn;
+        if (pthread_create(&workers[i].tid, NULL, runWorker, &workers[i]) != 0)
+            exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(workers[i].tid, NULL);
+        total.ns += workers[i].res.ns / threads;
+        total.cycles += workers[i].res.cycles / threads;
+    }
+    return total;
+}
+
+int main(int argc, char* argv[]) {
+    static const int fanouts[] = { 1, 5, 19, 100, 500 };
+    static const int depths[] = { 1, 2, 4, 8 };
+    static const struct { const char *name; primitive fn; } primitives[] = {
+        { "lookup", benchLookup },
+        { "lookup_parsed", benchLookupParsed },
+        { "lookup_sub_node", benchLookupSubNode },
+        { "lookup_sub_node_miss", benchLookupSubNodeMiss },
+        { "split_parent_child_from_path", benchSplit },
+        { "path_parse", benchPathParse },
+        { "inode_create+inode_delete", benchInodeCreate },
+        { "dir_add_entry+dir_reset_entry", benchDirAddEntry },
+    };
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:t:ms:b")) != -1) {
+        switch (opt) {
+            case 'n': iterations = atoi(optarg); break;
+            case 't': maxThreads = atoi(optarg); break;
+            case 'm': memoryReport = 1; break;
+            case 's':
+                if (tag_scan_select(optarg) == FAIL) {
+                    fprintf(stderr, "Error: tag scan %s not supported\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'b': filter_set_enabled(0); break;
+            default:
+                printf("Usage: %s [-n iterations] [-t max_threads] [-m] [-s avx2|sse2|scalar] [-b]\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (iterations < 1 || maxThreads < 1 || maxThreads > MAX_THREADS) {
+        fprintf(stderr, "Error: invalid arguments\n");
+        exit(EXIT_FAILURE);
+    }
+
+    init_fs();
+    fprintf(stderr, "tag scan: %s\n", tag_scan_name());
+    if (memoryReport)
+        printf("fanout,depth,inodes,bytes,bytes_per_inode\n");
+    else
+        printf("primitive,fanout,depth,threads,ns_per_op,cycles_per_op\n");
+    for (int f = 0; f < sizeof(fanouts) / sizeof(fanouts[0]); f++) {
+        for (int d = 0; d < sizeof(depths) / sizeof(depths[0]); d++) {
+            fanout = fanouts[f];
+            depth = depths[d];
+            /* a arvore tem de caber na tabela de i-nodes */
+            if (fanout * depth + 2 > INODE_TABLE_SIZE || buildTree() == FAIL)
+                continue;
+
+            if (memoryReport) {
+                int inodes;
+                size_t bytes = inode_table_bytes(&inodes);
+                printf("%d,%d,%d,%zu,%.1f\n", fanout, depth, inodes, bytes, (double) bytes / inodes);
+                continue;
+            }
+            for (int p = 0; p < sizeof(primitives) / sizeof(primitives[0]); p++) {
+                for (int threads = 1; threads <= maxThreads; threads *= 2) {
+                    result res = run(primitives[p].fn, threads);
+                    printf("%s,%d,%d,%d,%.1f,%.1f\n", primitives[p].name, fanout, depth,
+                           threads, res.ns, res.cycles);
+                }
+            }
+        }
+    }
+    destroy_fs();
+
+    exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,66 @@
+/* tecnicofs-mirror.h */
+#ifndef TECNICOFS_MIRROR_H
+#define TECNICOFS_MIRROR_H
+
+#include <stdint.h>
+#include "tecnicofs-api-constants.h"
+
+/*
+ * Layout of the namespace mirror: a file next to the server socket
+ * ("<socket>.map") that the server keeps up to date with every entry of
+ * every directory, and that clients map read-only to look up paths
+ * without asking the server. The file has a header, a sequence counter
+ * per i-node and a hash table of entries, in that order.
+ *
+ * An entry (parent, name) is in the first slot of its probe sequence,
+ * which starts at (hash ^ parent * MIRROR_HASH_MULTIPLIER) % entries,
+ * where hash is the FNV-1a hash of the name, and goes on one slot at a
+ * time; it ends at an empty slot. Removed entries leave a deleted slot.
+ *
+ * The counters are seqlocks: the server makes the counter of a directory
+ * odd while it changes its entries, and even again when done, and the one
+ * in the header while it rebuilds the whole table. A reader takes the
+ * counters of the directories it goes through before reading their
+ * entries and checks, at the end, that none of them changed; otherwise it
+ * reads again.
+ */
+
+#define MIRROR_SUFFIX ".map"
+#define MIRROR_MAGIC "TFSMIRRO"
+#define MIRROR_VERSION 1
+
+/* Slots of the hash table of entries, a power of two */
+#define MIRROR_ENTRIES 16384
+#define MIRROR_HASH_MULTIPLIER 2654435761u
+
+/* Slots that are not an entry */
+#define MIRROR_EMPTY -1
+#define MIRROR_DELETED -2
+
+/* Times a reader reads again before asking the server instead */
+#define MIRROR_RETRIES 8
+
+typedef struct mirror_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t seq;     /* odd while the whole table is rebuilt */
+	int32_t valid;    /* 0 if the mirror is not up to date, readers ask the server */
+	int32_t inodes;   /* counters that follow */
+	int32_t entries;  /* slots that follow the counters */
+} mirror_header;
+
+typedef struct mirror_entry {
+	int32_t parent;   /* i-number of the directory, or MIRROR_EMPTY or MIRROR_DELETED */
+	int32_t inumber;
+	uint32_t hash;
+	int32_t length;
+	char name[MAX_FILE_NAME];
+} mirror_entry;
+
+#define MIRROR_COUNTERS(header) ((uint32_t *) ((char *) (header) + sizeof(mirror_header)))
+#define MIRROR_SLOTS(header) \
+	((mirror_entry *) ((char *) MIRROR_COUNTERS(header) + sizeof(uint32_t) * (header)->inodes))
+#define MIRROR_SIZE(inodes, entries) \
+	(sizeof(mirror_header) + sizeof(uint32_t) * (inodes) + sizeof(mirror_entry) * (entries))
+
+#endif /* TECNICOFS_MIRROR_H */
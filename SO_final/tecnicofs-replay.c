@@ -0,0 +1,351 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <limits.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "tecnicofs-client-api.h"
+#include "trace.h"
+
+/*
+ * Replays a trace captured with "tecnicofs -t" against a running server.
+ * Every client of the trace is replayed by its own process, in the order
+ * it sent its requests, at the original pacing, N times faster (-s N) or
+ * as fast as possible (-a). Prints the original and replayed latency
+ * percentiles and compares the final tree with the captured one.
+ */
+
+typedef struct request {
+    uint64_t timestamp_ns;
+    uint64_t latency_ns;
+    int client;
+    char *command;
+} request;
+
+double speed = 1;
+char *tracePath;
+char *referencePath;
+char *serverName;
+
+request *requests;
+int numRequests;
+int numClients;
+
+static void displayUsage (const char* appName) {
+    printf("Usage: %s [-s speed | -a] [-c reference_tree] tracefile server_socket_name\n", appName);
+    exit(EXIT_FAILURE);
+}
+
+static void parseArgs (int argc, char* const argv[]) {
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:ac:")) != -1) {
+        switch (opt) {
+            case 's': speed = atof(optarg); break;
+            case 'a': speed = 0; break;
+            case 'c': referencePath = optarg; break;
+            default: displayUsage(argv[0]);
+        }
+    }
+    if (argc - optind != 2 || speed < 0)
+        displayUsage(argv[0]);
+
+    tracePath = argv[optind];
+    serverName = argv[optind + 1];
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compareRequests(const void *a, const void *b) {
+    const request *x = a, *y = b;
+    if (x->client != y->client)
+        return x->client - y->client;
+    return (x->timestamp_ns > y->timestamp_ns) - (x->timestamp_ns < y->timestamp_ns);
+}
+
+/*
+ * Reads the trace and sorts it by client and then by time, so each client
+ * is a contiguous run of requests in the order they were sent.
+ */
+static void readTrace() {
+    FILE *fp = fopen(tracePath, "rb");
+    trace_header header;
+    trace_record record;
+    uint32_t *clientHashes = NULL;
+    int capacity = 0;
+
+    if (fp == NULL || fread(&header, sizeof(header), 1, fp) != 1 ||
+        memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != TRACE_VERSION) {
+        fprintf(stderr, "Error: %s is not a trace\n", tracePath);
+        exit(EXIT_FAILURE);
+    }
+
+    while (fread(&record, sizeof(record), 1, fp) == 1) {
+        request *req;
+        int client;
+
+        if (numRequests == capacity) {
+            capacity = capacity ? capacity * 2 : 1024;
+            requests = realloc(requests, sizeof(request) * capacity);
+        }
+        req = &requests[numRequests];
+        req->command = malloc(record.length + 1);
+        if (fread(req->command, 1, record.length, fp) != record.length) {
+            fprintf(stderr, "Error: truncated trace\n");
+            exit(EXIT_FAILURE);
+        }
+        req->command[record.length] = '\0';
+        req->timestamp_ns = record.timestamp_ns;
+        req->latency_ns = record.latency_ns;
+
+        for (client = 0; client < numClients && clientHashes[client] != record.client; client++);
+        if (client == numClients) {
+            clientHashes = realloc(clientHashes, sizeof(uint32_t) * (numClients + 1));
+            clientHashes[numClients++] = record.client;
+        }
+        req->client = client;
+        numRequests++;
+    }
+    fclose(fp);
+    free(clientHashes);
+
+    qsort(requests, numRequests, sizeof(request), compareRequests);
+}
+
+/*
+ * Issues one traced request through the client API.
+ * Returns 1 if the request was replayed, 0 if it cannot be replayed.
+ */
+static int issue(char *command) {
+    char op, arg1[MAX_FILE_NAME], arg2[MAX_FILE_NAME];
+    tfsDirEntry entries[READDIR_REPLY_SIZE / MAX_FILE_NAME];
+    int cursor, max, next;
+
+    switch (command[0]) {
+        case 'c':
+            if (sscanf(command, "%c %99s %c", &op, arg1, &arg2[0]) == 3)
+                tfsCreate(arg1, arg2[0]);
+            return 1;
+        case 'd':
+            if (sscanf(command, "%c %99s", &op, arg1) == 2)
+                tfsDelete(arg1);
+            return 1;
+        case 'l':
+        case 'L':
+            if (sscanf(command, "%c %99s", &op, arg1) == 2)
+                tfsLookup(arg1);
+            return 1;
+        case 'm':
+            if (sscanf(command, "%c %99s %99s", &op, arg1, arg2) == 3)
+                tfsMove(arg1, arg2);
+            return 1;
+        case 'r':
+            if (sscanf(command, "%c %99s %d %d", &op, arg1, &cursor, &max) == 4) {
+                if (max > sizeof(entries) / sizeof(entries[0]))
+                    max = sizeof(entries) / sizeof(entries[0]);
+                tfsReadDir(arg1, cursor, max, entries, &next);
+            }
+            return 1;
+        case 'p':
+            /* faz o mesmo trabalho sem reescrever os ficheiros originais */
+            tfsPrintTree("/dev/null");
+            return 1;
+        default:
+            /* moves entre shards so fazem sentido com o coordenador original */
+            return 0;
+    }
+}
+
+/*
+ * Replays the requests of one client and writes the latency of each one
+ * (in nanoseconds, negative if skipped) to fd.
+ */
+static void replayClient(request *first, int n, double start, int fd) {
+    double *latencies = malloc(sizeof(double) * n);
+
+    if (tfsMount(serverName) != 0)
+        exit(EXIT_FAILURE);
+
+    for (int i = 0; i < n; i++) {
+        double t0;
+
+        if (speed > 0) {
+            double target = start + first[i].timestamp_ns / 1e9 / speed;
+            struct timespec ts = { (time_t) target, (long) ((target - (time_t) target) * 1e9) };
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+        }
+        t0 = now();
+        latencies[i] = issue(first[i].command) ? (now() - t0) * 1e9 : -1;
+    }
+    tfsUnmount();
+
+    if (write(fd, latencies, sizeof(double) * n) != sizeof(double) * n)
+        exit(EXIT_FAILURE);
+    exit(EXIT_SUCCESS);
+}
+
+static int readAll(int fd, void *buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = read(fd, (char *) buf + done, len - done);
+        if (n <= 0)
+            return -1;
+        done += n;
+    }
+    return 0;
+}
+
+static int compareDoubles(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+static void printPercentiles(const char *label, double *values, int n) {
+    double p[] = { 0.5, 0.9, 0.99, 0.999 };
+
+    qsort(values, n, sizeof(double), compareDoubles);
+    printf("%s latency (us):", label);
+    for (int i = 0; i < 4; i++) {
+        int k = (int) ceil(p[i] * n) - 1;
+        printf(" p%g=%.2f", p[i] * 100, n ? values[k < 0 ? 0 : k] / 1e3 : 0);
+    }
+    printf("\n");
+}
+
+static int compareLines(const void *a, const void *b) {
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/*
+ * Reads a printed tree as a sorted list of paths, as the order of the
+ * entries in a directory depends on the interleaving of the requests.
+ */
+static char **readTree(char *path, int *n) {
+    FILE *fp = fopen(path, "r");
+    char line[MAX_FILE_NAME + 2];
+    char **lines = NULL;
+
+    *n = 0;
+    if (fp == NULL)
+        return NULL;
+    while (fgets(line, sizeof(line), fp)) {
+        lines = realloc(lines, sizeof(char *) * (*n + 1));
+        lines[(*n)++] = strdup(line);
+    }
+    fclose(fp);
+    qsort(lines, *n, sizeof(char *), compareLines);
+    return lines;
+}
+
+static void compareTrees(char *reference, char *replayed) {
+    int n1, n2, differences = 0;
+    char **tree1 = readTree(reference, &n1), **tree2 = readTree(replayed, &n2);
+
+    if (tree1 == NULL || tree2 == NULL) {
+        printf("Tree: cannot compare %s with %s\n", reference, replayed);
+        return;
+    }
+    for (int i = 0, j = 0; i < n1 || j < n2;) {
+        int cmp = i == n1 ? 1 : j == n2 ? -1 : strcmp(tree1[i], tree2[j]);
+        if (cmp != 0)
+            differences++;
+        if (cmp <= 0)
+            i++;
+        if (cmp >= 0)
+            j++;
+    }
+    if (differences == 0)
+        printf("Tree: identical to %s (%d nodes)\n", reference, n1);
+    else
+        printf("Tree: %d paths differ from %s\n", differences, reference);
+}
+
+int main(int argc, char* argv[]) {
+    char defaultReference[PATH_MAX + 16], replayedTree[PATH_MAX + 16], absolute[PATH_MAX];
+    double start, *original, *replayed;
+    int skipped = 0, replayedCount = 0;
+    pid_t *pids;
+    int *fds;
+
+    parseArgs(argc, argv);
+    readTrace();
+    printf("Trace: %d requests from %d clients\n", numRequests, numClients);
+    fflush(stdout);
+
+    pids = malloc(sizeof(pid_t) * numClients);
+    fds = malloc(sizeof(int) * numClients);
+    replayed = malloc(sizeof(double) * (numRequests + 1));
+    original = malloc(sizeof(double) * (numRequests + 1));
+
+    /* os clientes comecam todos ao mesmo tempo, depois do fork */
+    start = speed > 0 ? now() + 0.1 : now();
+    for (int client = 0, first = 0; client < numClients; client++) {
+        int n = 0, fd[2];
+        while (first + n < numRequests && requests[first + n].client == client)
+            n++;
+        if (pipe(fd) != 0 || (pids[client] = fork()) < 0) {
+            perror("replay: fork");
+            exit(EXIT_FAILURE);
+        }
+        if (pids[client] == 0) {
+            close(fd[0]);
+            replayClient(&requests[first], n, start, fd[1]);
+        }
+        close(fd[1]);
+        fds[client] = fd[0];
+        first += n;
+    }
+
+    for (int client = 0, first = 0; client < numClients; client++) {
+        int n = 0;
+        while (first + n < numRequests && requests[first + n].client == client)
+            n++;
+        if (readAll(fds[client], replayed + first, sizeof(double) * n) != 0) {
+            fprintf(stderr, "replay: client %d failed\n", client);
+            exit(EXIT_FAILURE);
+        }
+        close(fds[client]);
+        waitpid(pids[client], NULL, 0);
+        first += n;
+    }
+    double elapsed = now() - start;
+
+    /* compara so os pedidos que foram repetidos */
+    for (int i = 0; i < numRequests; i++) {
+        if (replayed[i] < 0) {
+            skipped++;
+            continue;
+        }
+        original[replayedCount] = requests[i].latency_ns;
+        replayed[replayedCount++] = replayed[i];
+    }
+    printf("Replayed %d requests (%d skipped) in %.4f seconds\n", replayedCount, skipped, elapsed);
+    printPercentiles("Original server", original, replayedCount);
+    printPercentiles("Replayed client", replayed, replayedCount);
+
+    /* o servidor escreve a arvore, por isso o caminho tem de ser absoluto */
+    if (realpath(tracePath, absolute) == NULL)
+        strcpy(absolute, tracePath);
+    snprintf(replayedTree, sizeof(replayedTree), "%s.replay.tree", absolute);
+    if (referencePath == NULL) {
+        snprintf(defaultReference, sizeof(defaultReference), "%s.tree", absolute);
+        referencePath = defaultReference;
+    }
+    if (tfsMount(serverName) != 0 || tfsPrintTree(replayedTree) != 0) {
+        fprintf(stderr, "replay: unable to print the replayed tree\n");
+        exit(EXIT_FAILURE);
+    }
+    tfsUnmount();
+    compareTrees(referencePath, replayedTree);
+
+    exit(EXIT_SUCCESS);
+}
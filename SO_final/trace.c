@@ -0,0 +1,171 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "fs/state.h"
+#include "trace.h"
+
+/* Each worker buffers its records and writes them in blocks of this size */
+#define TRACE_BUFFER_SIZE 65536
+#define MAX_TRACE_BUFFERS 256
+
+typedef struct trace_buffer {
+	pthread_mutex_t lock;
+	int used;
+	char data[TRACE_BUFFER_SIZE];
+} trace_buffer;
+
+static FILE *trace_file;
+static pthread_mutex_t file_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct timespec trace_start;
+/* Buffers of the threads alive; buffers_lock is taken before a buffer's lock */
+static trace_buffer *buffers[MAX_TRACE_BUFFERS];
+static int num_buffers;
+static pthread_mutex_t buffers_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread trace_buffer *local_buffer;
+
+
+/*
+ * Starts capturing requests to a trace file.
+ * Returns: SUCCESS or FAIL
+ */
+int trace_open(char *path) {
+	trace_header header;
+
+	if ((trace_file = fopen(path, "wb")) == NULL)
+		return FAIL;
+
+	memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+	header.version = TRACE_VERSION;
+	if (fwrite(&header, sizeof(header), 1, trace_file) != 1)
+		return FAIL;
+
+	clock_gettime(CLOCK_MONOTONIC, &trace_start);
+	return SUCCESS;
+}
+
+
+int trace_enabled() {
+	return trace_file != NULL;
+}
+
+
+static void flush_buffer(trace_buffer *buffer) {
+	pthread_mutex_lock(&file_lock);
+	fwrite(buffer->data, 1, buffer->used, trace_file);
+	pthread_mutex_unlock(&file_lock);
+	buffer->used = 0;
+}
+
+
+static trace_buffer *register_buffer() {
+	trace_buffer *buffer = malloc(sizeof(trace_buffer));
+
+	if (buffer == NULL)
+		return NULL;
+	pthread_mutex_init(&buffer->lock, NULL);
+	buffer->used = 0;
+
+	pthread_mutex_lock(&buffers_lock);
+	if (num_buffers == MAX_TRACE_BUFFERS) {
+		pthread_mutex_unlock(&buffers_lock);
+		pthread_mutex_destroy(&buffer->lock);
+		free(buffer);
+		return NULL;
+	}
+	buffers[num_buffers++] = buffer;
+	pthread_mutex_unlock(&buffers_lock);
+	return buffer;
+}
+
+
+static uint64_t since_start(struct timespec *t) {
+	return (uint64_t) (t->tv_sec - trace_start.tv_sec) * 1000000000ULL + t->tv_nsec - trace_start.tv_nsec;
+}
+
+
+/*
+ * Records a request. The record goes to the calling thread's buffer, so
+ * the only shared lock is taken once per TRACE_BUFFER_SIZE bytes.
+ * Input:
+ *  - client: address of the client that sent the request
+ *  - request: the request, as received
+ *  - received: when the request was received
+ *  - done: when its reply was sent
+ */
+void trace_request(struct sockaddr_un *client, char *request, struct timespec *received, struct timespec *done) {
+	trace_record record;
+	uint32_t hash = 2166136261u;
+	size_t length = strlen(request);
+
+	if (trace_file == NULL)
+		return;
+	if (local_buffer == NULL && (local_buffer = register_buffer()) == NULL)
+		return;
+
+	for (char *c = client->sun_path; *c != '\0'; c++) {
+		hash ^= (unsigned char) *c;
+		hash *= 16777619u;
+	}
+
+	record.timestamp_ns = since_start(received);
+	record.client = hash;
+	record.latency_ns = since_start(done) - record.timestamp_ns;
+	record.length = length;
+
+	pthread_mutex_lock(&local_buffer->lock);
+	if (local_buffer->used + sizeof(record) + length > TRACE_BUFFER_SIZE)
+		flush_buffer(local_buffer);
+	memcpy(local_buffer->data + local_buffer->used, &record, sizeof(record));
+	memcpy(local_buffer->data + local_buffer->used + sizeof(record), request, length);
+	local_buffer->used += sizeof(record) + length;
+	pthread_mutex_unlock(&local_buffer->lock);
+}
+
+
+/*
+ * Writes the records of the calling thread and releases its buffer, so
+ * its slot can be taken by another thread. Called by a thread that is
+ * about to exit.
+ */
+void trace_thread_exit() {
+	trace_buffer *buffer = local_buffer;
+
+	if (buffer == NULL)
+		return;
+	local_buffer = NULL;
+
+	pthread_mutex_lock(&buffers_lock);
+	for (int i = 0; i < num_buffers; i++) {
+		if (buffers[i] == buffer) {
+			buffers[i] = buffers[--num_buffers];
+			break;
+		}
+	}
+	pthread_mutex_lock(&buffer->lock);
+	flush_buffer(buffer);
+	pthread_mutex_unlock(&buffer->lock);
+	pthread_mutex_unlock(&buffers_lock);
+
+	pthread_mutex_destroy(&buffer->lock);
+	free(buffer);
+}
+
+
+/*
+ * Writes every buffered record to the trace file. The file stays open for
+ * workers still finishing a request, it is closed when the server exits.
+ */
+void trace_close() {
+	if (trace_file == NULL)
+		return;
+
+	pthread_mutex_lock(&buffers_lock);
+	for (int i = 0; i < num_buffers; i++) {
+		pthread_mutex_lock(&buffers[i]->lock);
+		flush_buffer(buffers[i]);
+		pthread_mutex_unlock(&buffers[i]->lock);
+	}
+	pthread_mutex_unlock(&buffers_lock);
+	fflush(trace_file);
+}
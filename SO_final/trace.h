@@ -0,0 +1,36 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/un.h>
+
+/*
+ * Request traces: a header followed by one record per request, each
+ * record followed by the request bytes (without the final '\0').
+ * Records of different worker threads are interleaved in blocks, so only
+ * the records of the same client are in timestamp order.
+ */
+
+#define TRACE_MAGIC "TFSTRACE"
+#define TRACE_VERSION 2
+
+typedef struct trace_header {
+	char magic[8];
+	uint32_t version;
+} __attribute__((packed)) trace_header;
+
+typedef struct trace_record {
+	uint64_t timestamp_ns; /* receive time, since the start of the capture */
+	uint32_t client;       /* hash of the client socket path */
+	uint64_t latency_ns;   /* time to apply the request and send the reply */
+	uint16_t length;       /* bytes of the request that follow */
+} __attribute__((packed)) trace_record;
+
+int trace_open(char *path);
+int trace_enabled();
+void trace_request(struct sockaddr_un *client, char *request, struct timespec *received, struct timespec *done);
+void trace_thread_exit();
+void trace_close();
+
+#endif /* TRACE_H */
@@ -0,0 +1,167 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "fs/operations.h"
+#include "lease.h"
+#include "openfile.h"
+#include "shard.h"
+#include "txn.h"
+
+/*
+ * A change of a transaction, with what is needed to undo it.
+ */
+typedef struct txn_op {
+	char op;
+	type nodeType;
+	char name[MAX_FILE_NAME];
+	char other_name[MAX_FILE_NAME];
+	fs_path path;
+	fs_path other_path;
+	int inumber; /* node taken out by a delete, only deleted on commit */
+} txn_op;
+
+
+/*
+ * Reads a change, one of "c <path> <f|d>", "d <path>" or "m <path> <path>".
+ * Returns: SUCCESS or FAIL
+ */
+static int parse_op(txn_op *op, char *line) {
+	int offset = 0, other_offset = 0;
+	char t = 0;
+
+	op->op = line[0];
+	switch (op->op) {
+		case 'c':
+			if (sscanf(line, "c %n%99s %c", &offset, op->name, &t) != 2 || (t != 'f' && t != 'd'))
+				return FAIL;
+			op->nodeType = (t == 'd') ? T_DIRECTORY : T_FILE;
+			break;
+		case 'd':
+			if (sscanf(line, "d %n%99s", &offset, op->name) != 1)
+				return FAIL;
+			break;
+		case 'm':
+			if (sscanf(line, "m %n%99s %n%99s", &offset, op->name, &other_offset, op->other_name) != 2 ||
+			    path_parse(&op->other_path, line + other_offset) == FAIL)
+				return FAIL;
+			break;
+		default:
+			return FAIL;
+	}
+	return path_parse(&op->path, line + offset);
+}
+
+
+/*
+ * Applies a change, with the same checks as the request that makes it
+ * alone. A deleted node is only taken out of its directory.
+ * Returns: SUCCESS or the error of the change
+ */
+static int apply_op(int sockfd, txn_op *op) {
+	switch (op->op) {
+		case 'c':
+			if (shard_path_busy(op->name))
+				return TECNICOFS_ERROR_BUSY;
+			return create_parsed(&op->path, op->nodeType);
+		case 'd':
+			if (shard_path_busy(op->name))
+				return TECNICOFS_ERROR_BUSY;
+			if (openfile_subtree_is_open(lookup_parsed(&op->path, op->path.depth, NULL)))
+				return TECNICOFS_ERROR_FILE_IS_OPEN;
+			lease_revoke_path(sockfd, op->name);
+			op->inumber = detach_parsed(&op->path);
+			return op->inumber < 0 ? op->inumber : SUCCESS;
+		default:
+			if (shard_path_busy(op->name) || shard_path_busy(op->other_name))
+				return TECNICOFS_ERROR_BUSY;
+			lease_revoke_path(sockfd, op->name);
+			return move_parsed(&op->path, &op->other_path);
+	}
+}
+
+
+/*
+ * Undoes the changes already applied, the last one first, so each of them
+ * is undone on the tree it was applied to.
+ */
+static void undo_ops(txn_op *ops, int n) {
+	for (int i = n - 1; i >= 0; i--) {
+		switch (ops[i].op) {
+			case 'c':
+				delete_parsed(&ops[i].path);
+				break;
+			case 'd':
+				attach_parsed(&ops[i].path, ops[i].inumber);
+				break;
+			default:
+				move_parsed(&ops[i].other_path, &ops[i].path);
+		}
+	}
+}
+
+
+/*
+ * Validates and applies a transaction. The request is a line
+ * "t <reads> <changes>", a line "v <version> <path>" per node read and a
+ * line per change. The changes of a transaction that fails are undone and
+ * nothing is published about them.
+ * Input:
+ *  - sockfd: socket the lease invalidations are sent from
+ *  - request: the request, changed while it is read
+ * Returns: SUCCESS, TECNICOFS_ERROR_CONFLICT if a node read changed, or
+ *  the error of the first change that failed
+ */
+int txn_commit(int sockfd, char *request) {
+	int nreads, nops, applied, res = SUCCESS;
+	char *line, *saveptr;
+	txn_op *ops;
+
+	if (sscanf(request, "t %d %d", &nreads, &nops) != 2 ||
+	    nreads < 0 || nreads > TXN_MAX_READS || nops < 0 || nops > TXN_MAX_OPS)
+		return FAIL;
+	if ((ops = malloc(sizeof(txn_op) * (nops + 1))) == NULL)
+		return FAIL;
+
+	/* as versoes lidas sao validadas logo, nada muda enquanto se le o pedido */
+	strtok_r(request, "\n", &saveptr);
+	for (int i = 0; i < nreads + nops && res == SUCCESS; i++) {
+		if ((line = strtok_r(NULL, "\n", &saveptr)) == NULL)
+			res = FAIL;
+		else if (i < nreads) {
+			unsigned long version;
+			int offset = 0;
+			fs_path path;
+
+			if (sscanf(line, "v %lu %n", &version, &offset) != 1 || offset == 0 ||
+			    path_parse(&path, line + offset) == FAIL)
+				res = FAIL;
+			else if (inode_version(lookup_parsed(&path, path.depth, NULL)) != version)
+				res = TECNICOFS_ERROR_CONFLICT;
+		}
+		else if (parse_op(&ops[i - nreads], line) == FAIL)
+			res = FAIL;
+	}
+	if (res != SUCCESS) {
+		free(ops);
+		return res;
+	}
+
+	hold_events();
+	for (applied = 0; applied < nops; applied++) {
+		if ((res = apply_op(sockfd, &ops[applied])) != SUCCESS)
+			break;
+	}
+	if (res != SUCCESS) {
+		undo_ops(ops, applied);
+		release_events(0);
+	}
+	else {
+		release_events(1);
+		for (int i = 0; i < nops; i++) {
+			if (ops[i].op == 'd')
+				inode_delete(ops[i].inumber);
+		}
+	}
+	free(ops);
+	return res;
+}
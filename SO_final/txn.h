@@ -0,0 +1,16 @@
+#ifndef TXN_H
+#define TXN_H
+
+/*
+ * Multi-operation transactions with optimistic concurrency control.
+ * The client reads without holding anything, keeping the version of every
+ * node it looked up (0 if it did not exist), and then sends those versions
+ * with all its changes in a single request. The server checks that none
+ * of the nodes read changed since and applies every change or none, so
+ * nothing is held across round trips and a conflict just aborts.
+ * All functions must be called with the server lock held.
+ */
+
+int txn_commit(int sockfd, char *request);
+
+#endif /* TXN_H */
@@ -0,0 +1,271 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "fs/operations.h"
+#include "watch.h"
+
+/*
+ * An event waiting to be sent.
+ */
+typedef struct watch_event {
+	char type;
+	char name[MAX_FILE_NAME];
+} watch_event;
+
+/*
+ * A directory watched by a client. Once the directory is deleted the watch
+ * is gone: it only sends what is left in its queue and a WATCH_GONE event.
+ */
+typedef struct watcher {
+	struct sockaddr_un client;
+	int id;
+	int inumber;
+	watch_event queue[WATCH_QUEUE_SIZE];
+	int head, count;
+	int overflow;
+	int gone;
+	struct watcher *next;
+} watcher;
+
+static watcher *watchers;
+static int server_sockfd;
+
+
+/*
+ * Sends one event of a watch without blocking. An event that cannot be
+ * delivered because the client is gone counts as sent.
+ * Returns: 0 if sent, -1 if the client socket is full
+ */
+static int send_event(watcher *w, char type, char *name) {
+	char message[MAX_FILE_NAME + 32];
+	int len = sprintf(message, "* %d %c %s", w->id, type, name);
+
+	if (sendto(server_sockfd, message, len + 1, MSG_DONTWAIT, (struct sockaddr *) &w->client,
+	           sizeof(struct sockaddr_un)) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return -1;
+	return 0;
+}
+
+
+/*
+ * Sends the queued events of a watch until the client socket is full; the
+ * rest stay queued.
+ * Returns: 1 if the watch is gone and has nothing left to send
+ */
+static int watcher_flush(watcher *w) {
+	if (w->overflow) {
+		if (send_event(w, WATCH_OVERFLOW, "-") < 0)
+			return 0;
+		w->overflow = 0;
+	}
+
+	while (w->count > 0) {
+		watch_event *event = &w->queue[w->head];
+		if (send_event(w, event->type, event->name) < 0)
+			return 0;
+		w->head = (w->head + 1) % WATCH_QUEUE_SIZE;
+		w->count--;
+	}
+
+	return w->gone && send_event(w, WATCH_GONE, "-") == 0;
+}
+
+
+/*
+ * Queues an event on a watch, replacing the event queued for the same name.
+ */
+static void watcher_push(watcher *w, char type, const char *name, int len) {
+	watch_event *event;
+
+	if (w->overflow)
+		return;
+
+	for (int i = 0; i < w->count; i++) {
+		event = &w->queue[(w->head + i) % WATCH_QUEUE_SIZE];
+		if (strncmp(event->name, name, len) == 0 && event->name[len] == '\0') {
+			event->type = type;
+			return;
+		}
+	}
+
+	if (w->count == WATCH_QUEUE_SIZE) {
+		w->count = 0;
+		w->overflow = 1;
+		return;
+	}
+	event = &w->queue[(w->head + w->count) % WATCH_QUEUE_SIZE];
+	event->type = type;
+	memcpy(event->name, name, len);
+	event->name[len] = '\0';
+	w->count++;
+}
+
+
+static void remove_watchers(int gone_only, char *client) {
+	watcher **prev = &watchers;
+
+	while (*prev != NULL) {
+		watcher *w = *prev;
+		if ((gone_only && w->gone && watcher_flush(w)) ||
+		    (client != NULL && strcmp(w->client.sun_path, client) == 0)) {
+			*prev = w->next;
+			free(w);
+		}
+		else
+			prev = &w->next;
+	}
+}
+
+
+/*
+ * Receives the changes published by fs/operations.c, see set_event_handler.
+ */
+void watch_publish(fs_event event, int dir_inumber, const char *name, int len, int inumber) {
+	static const char types[] = { WATCH_CREATE, WATCH_DELETE, WATCH_MOVED_FROM, WATCH_MOVED_TO };
+	int gone = 0;
+
+	for (watcher *w = watchers; w != NULL; w = w->next) {
+		if (w->gone)
+			continue;
+		if (w->inumber == dir_inumber) {
+			watcher_push(w, types[event], name, len);
+			watcher_flush(w);
+		}
+		/* o i-node da diretoria vai ser reutilizado */
+		else if (event == FS_EVENT_DELETE && w->inumber == inumber) {
+			w->gone = gone = 1;
+		}
+	}
+	if (gone)
+		remove_watchers(1, NULL);
+}
+
+
+/*
+ * Sets the socket the events are sent from. The changes to directories
+ * get to the watches through watch_publish.
+ * Input:
+ *  - sockfd: socket the events are sent from
+ */
+void watch_init(int sockfd) {
+	server_sockfd = sockfd;
+}
+
+
+/*
+ * Adds a watch on a directory for a client.
+ * Input:
+ *  - client: socket path of the client
+ *  - inumber: identifier of the directory
+ * Returns: the watch identifier, or TECNICOFS_ERROR_MAXED_OPEN_FILES if
+ *  the client already has MAX_WATCHES watches
+ */
+int watch_add(char *client, int inumber) {
+	int used[MAX_WATCHES] = { 0 };
+	watcher *w;
+
+	if (strlen(client) >= sizeof(w->client.sun_path))
+		return TECNICOFS_ERROR_OTHER;
+	for (w = watchers; w != NULL; w = w->next) {
+		if (strcmp(w->client.sun_path, client) == 0)
+			used[w->id] = 1;
+	}
+
+	for (int id = 0; id < MAX_WATCHES; id++) {
+		if (used[id])
+			continue;
+		if ((w = malloc(sizeof(watcher))) == NULL)
+			return TECNICOFS_ERROR_OTHER;
+		memset(&w->client, 0, sizeof(w->client));
+		w->client.sun_family = AF_UNIX;
+		strcpy(w->client.sun_path, client);
+		w->id = id;
+		w->inumber = inumber;
+		w->head = w->count = 0;
+		w->overflow = w->gone = 0;
+		w->next = watchers;
+		watchers = w;
+		return id;
+	}
+	return TECNICOFS_ERROR_MAXED_OPEN_FILES;
+}
+
+
+/*
+ * Removes a watch of a client.
+ * Returns: SUCCESS or TECNICOFS_ERROR_FILE_NOT_OPEN
+ */
+int watch_remove(char *client, int id) {
+	for (watcher **prev = &watchers; *prev != NULL; prev = &(*prev)->next) {
+		watcher *w = *prev;
+		if (w->id == id && strcmp(w->client.sun_path, client) == 0) {
+			*prev = w->next;
+			free(w);
+			return SUCCESS;
+		}
+	}
+	return TECNICOFS_ERROR_FILE_NOT_OPEN;
+}
+
+
+/*
+ * Sends the events still queued for a client, which asks for them when
+ * it runs out of events.
+ */
+void watch_flush(char *client) {
+	for (watcher *w = watchers; w != NULL; w = w->next) {
+		if (!w->gone && strcmp(w->client.sun_path, client) == 0)
+			watcher_flush(w);
+	}
+	/* as que ficaram sem diretoria so saem depois de enviar tudo */
+	remove_watchers(1, NULL);
+}
+
+
+/*
+ * Removes every watch of a client, when it unmounts.
+ */
+void watch_end_session(char *client) {
+	remove_watchers(0, client);
+}
+
+
+/*
+ * Saves the watches with the events still queued, to be loaded by another
+ * server process.
+ * Returns: SUCCESS or FAIL
+ */
+int watch_save(FILE *fp) {
+	watcher end;
+
+	for (watcher *w = watchers; w != NULL; w = w->next) {
+		if (fwrite(w, sizeof(watcher), 1, fp) != 1)
+			return FAIL;
+	}
+	memset(&end, 0, sizeof(end));
+	end.id = -1;
+	return fwrite(&end, sizeof(end), 1, fp) == 1 ? SUCCESS : FAIL;
+}
+
+
+/*
+ * Loads the watches saved by watch_save.
+ * Returns: SUCCESS or FAIL
+ */
+int watch_load(FILE *fp) {
+	watcher saved, **last = &watchers;
+
+	while (fread(&saved, sizeof(saved), 1, fp) == 1) {
+		if (saved.id < 0)
+			return SUCCESS;
+		if ((*last = malloc(sizeof(watcher))) == NULL)
+			return FAIL;
+		**last = saved;
+		(*last)->next = NULL;
+		last = &(*last)->next;
+	}
+	return FAIL;
+}
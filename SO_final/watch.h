@@ -0,0 +1,37 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+#include <stdio.h>
+#include "fs/operations.h"
+
+/*
+ * Directory watches: a client watching a directory is sent an event
+ * ("* <watch> <type> <name>") for every entry created, deleted or moved in
+ * or out of it. Events wait in a bounded queue per watch until they can be
+ * sent, and a newer event for a name replaces the one queued for it. When
+ * the queue overflows it is emptied and the client is sent an overflow
+ * event instead, after which it should list the directory again.
+ * All functions must be called with the server lock held.
+ */
+
+/* Events a watch can hold while they cannot be sent */
+#define WATCH_QUEUE_SIZE 64
+
+/* Event types, as sent to the clients */
+#define WATCH_CREATE 'c'
+#define WATCH_DELETE 'd'
+#define WATCH_MOVED_FROM 'f'
+#define WATCH_MOVED_TO 't'
+#define WATCH_OVERFLOW 'o'
+#define WATCH_GONE 'x'
+
+void watch_init(int sockfd);
+void watch_publish(fs_event event, int dir_inumber, const char *name, int len, int inumber);
+int watch_add(char *client, int inumber);
+int watch_remove(char *client, int id);
+void watch_flush(char *client);
+void watch_end_session(char *client);
+int watch_save(FILE *fp);
+int watch_load(FILE *fp);
+
+#endif /* WATCH_H */